@@ -85,4 +85,24 @@
 #define CK_CC_UNLIKELY(x)
 #endif
 
+#ifndef CK_CC_PREFETCH
+#define CK_CC_PREFETCH(x) ((void)(x))
+#endif
+
+#ifndef CK_F_CC_FFS
+#define CK_F_CC_FFS
+CK_CC_INLINE static int
+ck_cc_ffs(unsigned int x)
+{
+	int i;
+
+	if (x == 0)
+		return 0;
+
+	for (i = 1; (x & 1) == 0; i++, x >>= 1);
+
+	return i;
+}
+#endif
+
 #endif /* _CK_CC_H */
@@ -35,13 +35,57 @@
 #include <ck_stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <string.h>
 
 #define CK_HS_MODE_SPMC     1
 #define CK_HS_MODE_DIRECT   2
+#define CK_HS_MODE_MPMC     4
 #define CK_HS_MODE_OBJECT   8
 
-/* Currently unsupported. */
-#define CK_HS_MODE_MPMC    (void)
+/*
+ * Growth migrates entries into a larger map over the course of subsequent
+ * write operations rather than in a single operation.
+ */
+#define CK_HS_MODE_INCREMENTAL 16
+
+/*
+ * A one byte fragment of the hash value is stored alongside every slot
+ * so that the comparison callback is only invoked on likely matches.
+ */
+#define CK_HS_MODE_TAG 32
+
+/*
+ * Entries are placed by linear probing with Robin Hood displacement and
+ * removed by backward-shift deletion, so no tombstones are left behind.
+ */
+#define CK_HS_MODE_ROBIN_HOOD 64
+
+/*
+ * The full hash value of every entry is stored alongside it, so that
+ * growth and garbage collection do not invoke the hash callback and the
+ * comparison callback is only invoked on entries of equal hash value.
+ */
+#define CK_HS_MODE_HASH 128
+
+/*
+ * Operations maintain the counters reported by ck_hs_stat, at the cost of
+ * an atomic update for every insertion, growth and retried lookup.
+ */
+#define CK_HS_MODE_STAT 256
+
+/*
+ * Every map carries a Bloom filter of the hash values of its keys, which
+ * lets lookups of most absent keys complete after reading a single cache
+ * line rather than a probe sequence.
+ */
+#define CK_HS_MODE_BLOOM 512
+
+/*
+ * Number of buckets in the probe length histogram. Bucket i counts the
+ * insertions that probed between 2^i and 2^(i+1) - 1 slots, the last
+ * bucket also counts all longer probe sequences.
+ */
+#define CK_HS_STAT_PROBES 16
 
 /*
  * Hash callback function.
@@ -53,12 +97,27 @@ typedef unsigned long ck_hs_hash_cb_t(const void *, unsigned long);
  */
 typedef bool ck_hs_compare_cb_t(const void *, const void *);
 
+/*
+ * Executes the specified function with the specified argument on up to the
+ * specified number of threads concurrently, returning once all invocations
+ * have returned.
+ */
+typedef void ck_hs_executor_cb_t(void (*)(void *), void *, unsigned int);
+
+/*
+ * Given the existing object, or NULL if there is none, and a closure,
+ * returns the object to be stored. Returning the existing object leaves
+ * the set unmodified and returning NULL removes the existing object.
+ */
+typedef void *ck_hs_apply_fn_t(void *, void *);
+
 #if defined(CK_MD_POINTER_PACK_ENABLE) && defined(CK_MD_VMA_BITS)
 #define CK_HS_PP
 #define CK_HS_KEY_MASK ((1U << ((sizeof(void *) * 8) - CK_MD_VMA_BITS)) - 1)
 #endif
 
 struct ck_hs_map;
+struct ck_hs_counters;
 struct ck_hs {
 	struct ck_malloc *m;
 	struct ck_hs_map *map;
@@ -66,6 +125,12 @@ struct ck_hs {
 	unsigned long seed;
 	ck_hs_hash_cb_t *hf;
 	ck_hs_compare_cb_t *compare;
+	unsigned int load_maximum;
+	unsigned int load_minimum;
+	unsigned long capacity;
+	unsigned int generations;
+	bool reseeded;
+	struct ck_hs_counters *counters;
 };
 typedef struct ck_hs ck_hs_t;
 
@@ -73,34 +138,886 @@ struct ck_hs_stat {
 	unsigned long tombstones;
 	unsigned long n_entries;
 	unsigned int probe_maximum;
+
+	/* The following are zero unless the set is in CK_HS_MODE_STAT. */
+	uint64_t probes[CK_HS_STAT_PROBES];
+	uint64_t retries;
+	uint64_t grows;
+	uint64_t grow_entries;
+	uint64_t allocated;
 };
 
 struct ck_hs_iterator {
 	void **cursor;
 	unsigned long offset;
+
+	/* Snapshot scanned by ck_hs_next_spmc, ending at slot limit. */
+	struct ck_hs_map *map;
+	unsigned long limit;
+	unsigned long version;
 };
 typedef struct ck_hs_iterator ck_hs_iterator_t;
 
-#define CK_HS_ITERATOR_INITIALIZER { NULL, 0 }
+#define CK_HS_ITERATOR_INITIALIZER { NULL, 0, NULL, 0, 0 }
 
 /* Convenience wrapper to table hash function. */
 #define CK_HS_HASH(T, F, K) F((K), (T)->seed)
 
 void ck_hs_iterator_init(ck_hs_iterator_t *);
 bool ck_hs_next(ck_hs_t *, ck_hs_iterator_t *, void **);
+void ck_hs_iterator_partition(ck_hs_t *, ck_hs_iterator_t *, unsigned int);
+bool ck_hs_next_spmc(ck_hs_t *, ck_hs_iterator_t *, void **);
+bool ck_hs_iterator_stale(ck_hs_t *, ck_hs_iterator_t *);
+bool ck_hs_snapshot_begin(ck_hs_t *, ck_hs_iterator_t *, unsigned int);
+void ck_hs_snapshot_end(ck_hs_t *, ck_hs_iterator_t *);
 bool ck_hs_init(ck_hs_t *, unsigned int, ck_hs_hash_cb_t *,
     ck_hs_compare_cb_t *, struct ck_malloc *, unsigned long, unsigned long);
 void ck_hs_destroy(ck_hs_t *);
 void *ck_hs_get(ck_hs_t *, unsigned long, const void *);
+unsigned long ck_hs_get_batch(ck_hs_t *, unsigned long, const unsigned long *,
+    const void *const *, void **);
 bool ck_hs_put(ck_hs_t *, unsigned long, const void *);
 bool ck_hs_set(ck_hs_t *, unsigned long, const void *, void **);
 bool ck_hs_fas(ck_hs_t *, unsigned long, const void *, void **);
+bool ck_hs_apply(ck_hs_t *, unsigned long, const void *, ck_hs_apply_fn_t *, void *);
 void *ck_hs_remove(ck_hs_t *, unsigned long, const void *);
 bool ck_hs_grow(ck_hs_t *, unsigned long);
+bool ck_hs_grow_parallel(ck_hs_t *, unsigned long, unsigned int, ck_hs_executor_cb_t *);
+bool ck_hs_gc(ck_hs_t *, unsigned long, unsigned long);
+bool ck_hs_load_factor_set(ck_hs_t *, unsigned int, unsigned int);
+bool ck_hs_generations_set(ck_hs_t *, unsigned int);
+bool ck_hs_rebuild(ck_hs_t *, unsigned long);
+void ck_hs_rebuild_end(ck_hs_t *);
 unsigned long ck_hs_count(ck_hs_t *);
 bool ck_hs_reset(ck_hs_t *);
 bool ck_hs_reset_size(ck_hs_t *, unsigned long);
 void ck_hs_stat(ck_hs_t *, struct ck_hs_stat *);
 
+/*
+ * Compile-time specialized hash sets. CK_HS_PROTOTYPE(N, H, C) generates a
+ * single-writer, multiple-reader set named N whose hash function H and
+ * comparison function C are called directly rather than through function
+ * pointers, which allows both to be inlined into the probe loop. H has the
+ * signature of ck_hs_hash_cb_t and C that of ck_hs_compare_cb_t. Keys must
+ * not be NULL or CK_HS_PROTOTYPE_TOMBSTONE. C is never invoked on empty or
+ * deleted slots.
+ */
+#define CK_HS_PROTOTYPE_L1 8
+#define CK_HS_PROTOTYPE_TOMBSTONE ((void *)~(uintptr_t)0)
+#define CK_HS_PROTOTYPE_GROUP(M, H) \
+	((H) & (M)->mask & ~(unsigned long)(CK_HS_PROTOTYPE_L1 - 1))
+
+#define CK_HS_NAME(N) ck_hs_##N
+#define CK_HS_INSTANCE(N) struct CK_HS_NAME(N)
+#define CK_HS_INIT(N, T, M, C, S) ck_hs_##N##_init(T, M, C, S)
+#define CK_HS_DESTROY(N, T) ck_hs_##N##_destroy(T)
+#define CK_HS_GET(N, T, H, K) ck_hs_##N##_get(T, H, K)
+#define CK_HS_PUT(N, T, H, K) ck_hs_##N##_put(T, H, K)
+#define CK_HS_SET(N, T, H, K, P) ck_hs_##N##_set(T, H, K, P)
+#define CK_HS_REMOVE(N, T, H, K) ck_hs_##N##_remove(T, H, K)
+#define CK_HS_GROW(N, T, C) ck_hs_##N##_grow(T, C)
+#define CK_HS_COUNT(N, T) ck_hs_##N##_count(T)
+#define CK_HS_NEXT(N, T, I, K) ck_hs_##N##_next(T, I, K)
+
+#define CK_HS_PROTOTYPE(N, H, C)					\
+	struct ck_hs_##N##_map {					\
+		unsigned long mask;					\
+		unsigned long step;					\
+		unsigned long capacity;					\
+		unsigned long n_entries;				\
+		unsigned long tombstones;				\
+		unsigned long size;					\
+		unsigned int probe_maximum;				\
+		void **entries;						\
+	};								\
+									\
+	CK_HS_INSTANCE(N) {						\
+		struct ck_malloc *m;					\
+		struct ck_hs_##N##_map *map;				\
+		unsigned long seed;					\
+	};								\
+									\
+	CK_CC_UNUSED static struct ck_hs_##N##_map *			\
+	ck_hs_##N##_map_create(struct ck_malloc *m, unsigned long capacity) \
+	{								\
+		struct ck_hs_##N##_map *map;				\
+		unsigned long n, size, step = 0;			\
+									\
+		for (n = CK_HS_PROTOTYPE_L1; n < capacity; n <<= 1)	\
+			step++;						\
+									\
+		size = sizeof(struct ck_hs_##N##_map) +			\
+		    sizeof(void *) * n + CK_MD_CACHELINE - 1;		\
+		map = m->malloc(size);					\
+		if (map == NULL)					\
+			return NULL;					\
+									\
+		map->mask = n - 1;					\
+		map->step = step + 3;					\
+		map->capacity = n;					\
+		map->n_entries = 0;					\
+		map->tombstones = 0;					\
+		map->size = size;					\
+		map->probe_maximum = 0;					\
+		map->entries = (void *)(((uintptr_t)(map + 1) +		\
+		    CK_MD_CACHELINE - 1) & ~(uintptr_t)(CK_MD_CACHELINE - 1)); \
+		memset(map->entries, 0, sizeof(void *) * n);		\
+		ck_pr_fence_store();					\
+		return map;						\
+	}								\
+									\
+	CK_CC_INLINE static unsigned long				\
+	ck_hs_##N##_probe_next(struct ck_hs_##N##_map *map,		\
+	    unsigned long offset, unsigned long h)			\
+	{								\
+		unsigned long stride;					\
+									\
+		stride = ((h >> map->step) << 3) | CK_HS_PROTOTYPE_L1;	\
+		return (offset + stride) & map->mask;			\
+	}								\
+									\
+	/*								\
+	 * Loads a probe group into slot and returns a bitmap of the slots \
+	 * holding key. The loads are separated from the comparisons so that \
+	 * the latter can be vectorized.				\
+	 */								\
+	CK_CC_UNUSED static unsigned int				\
+	ck_hs_##N##_group(void **entries, const void *key, void **slot,	\
+	    unsigned int *empty, unsigned int *tombstone)		\
+	{								\
+		unsigned int i, match = 0, e = 0, t = 0;		\
+									\
+		for (i = 0; i < CK_HS_PROTOTYPE_L1; i++)		\
+			slot[i] = ck_pr_load_ptr(&entries[i]);		\
+									\
+		for (i = 0; i < CK_HS_PROTOTYPE_L1; i++) {		\
+			e |= (unsigned int)(slot[i] == NULL) << i;	\
+			t |= (unsigned int)(slot[i] ==			\
+			    CK_HS_PROTOTYPE_TOMBSTONE) << i;		\
+			match |= (unsigned int)(slot[i] != NULL &&	\
+			    slot[i] != CK_HS_PROTOTYPE_TOMBSTONE &&	\
+			    C(slot[i], key)) << i;			\
+		}							\
+									\
+		*empty = e;						\
+		*tombstone = t;						\
+		return match;						\
+	}								\
+									\
+	/*								\
+	 * Returns the slot holding key, if any. The slot a new key would be \
+	 * inserted into is returned in first, along with the number of probe \
+	 * groups visited to reach it.					\
+	 */								\
+	CK_CC_UNUSED static void **					\
+	ck_hs_##N##_probe(struct ck_hs_##N##_map *map, unsigned long h,	\
+	    const void *key, void ***first, void **object,		\
+	    unsigned int *n_probes)					\
+	{								\
+		void *slot[CK_HS_PROTOTYPE_L1];				\
+		void **insert = NULL;					\
+		unsigned long offset, i, limit;				\
+		unsigned int j, match, empty, tombstone, probes = 0;	\
+									\
+		limit = map->capacity / CK_HS_PROTOTYPE_L1;		\
+		offset = CK_HS_PROTOTYPE_GROUP(map, h);			\
+		for (i = 0; i < limit; i++) {				\
+			match = ck_hs_##N##_group(map->entries + offset, key, \
+			    slot, &empty, &tombstone);			\
+									\
+			if (insert == NULL && tombstone != 0) {		\
+				insert = map->entries + offset +	\
+				    ck_cc_ffs(tombstone) - 1;		\
+				probes = i + 1;				\
+			}						\
+									\
+			if (match != 0) {				\
+				*first = insert;			\
+				*n_probes = probes;			\
+				j = ck_cc_ffs(match) - 1;		\
+				*object = slot[j];			\
+				return map->entries + offset + j;	\
+			}						\
+									\
+			if (empty != 0) {				\
+				if (insert == NULL) {			\
+					insert = map->entries + offset + \
+					    ck_cc_ffs(empty) - 1;	\
+					probes = i + 1;			\
+				}					\
+									\
+				break;					\
+			}						\
+									\
+			offset = ck_hs_##N##_probe_next(map, offset, h); \
+		}							\
+									\
+		*first = insert;					\
+		*n_probes = probes;					\
+		return NULL;						\
+	}								\
+									\
+	CK_CC_UNUSED static bool					\
+	ck_hs_##N##_rehash(CK_HS_INSTANCE(N) *hs, unsigned long capacity) \
+	{								\
+		struct ck_hs_##N##_map *map, *update;			\
+		unsigned long k, h, offset, probes, limit;		\
+		unsigned int j;						\
+		void *entry;						\
+									\
+		map = hs->map;						\
+	restart:							\
+		update = ck_hs_##N##_map_create(hs->m, capacity);	\
+		if (update == NULL)					\
+			return false;					\
+									\
+		limit = update->capacity / CK_HS_PROTOTYPE_L1;		\
+		for (k = 0; k < map->capacity; k++) {			\
+			entry = map->entries[k];			\
+			if (entry == NULL || entry == CK_HS_PROTOTYPE_TOMBSTONE) \
+				continue;				\
+									\
+			h = H(entry, hs->seed);				\
+			offset = CK_HS_PROTOTYPE_GROUP(update, h);	\
+			for (probes = 1; probes <= limit; probes++) {	\
+				for (j = 0; j < CK_HS_PROTOTYPE_L1; j++) { \
+					if (update->entries[offset + j] == NULL) \
+						break;			\
+				}					\
+									\
+				if (j < CK_HS_PROTOTYPE_L1)		\
+					break;				\
+									\
+				offset = ck_hs_##N##_probe_next(update,	\
+				    offset, h);				\
+			}						\
+									\
+			if (probes > limit) {				\
+				hs->m->free(update, update->size, false); \
+				capacity <<= 1;				\
+				goto restart;				\
+			}						\
+									\
+			update->entries[offset + j] = entry;		\
+			update->n_entries++;				\
+			if (probes > update->probe_maximum)		\
+				update->probe_maximum = (unsigned int)probes; \
+		}							\
+									\
+		ck_pr_fence_store();					\
+		ck_pr_store_ptr(&hs->map, update);			\
+		hs->m->free(map, map->size, true);			\
+		return true;						\
+	}								\
+									\
+	CK_CC_UNUSED static void					\
+	ck_hs_##N##_insert(CK_HS_INSTANCE(N) *hs, struct ck_hs_##N##_map *map, \
+	    void **slot, const void *key, unsigned int n_probes)	\
+	{								\
+									\
+		if (n_probes > map->probe_maximum)			\
+			ck_pr_store_uint(&map->probe_maximum, n_probes); \
+									\
+		if (*slot == CK_HS_PROTOTYPE_TOMBSTONE)			\
+			map->tombstones--;				\
+									\
+		ck_pr_fence_store();					\
+		ck_pr_store_ptr(slot, (void *)(uintptr_t)key);		\
+		map->n_entries++;					\
+									\
+		/*							\
+		 * Tombstones are only reclaimed by a re-hash, which doubles the \
+		 * capacity only if the live entries alone warrant it.	\
+		 */							\
+		if ((map->n_entries + map->tombstones) << 1 > map->capacity) { \
+			ck_hs_##N##_rehash(hs, map->capacity <<		\
+			    ((map->n_entries << 2) > map->capacity));	\
+		}							\
+									\
+		return;							\
+	}								\
+									\
+	CK_CC_INLINE static bool					\
+	ck_hs_##N##_init(CK_HS_INSTANCE(N) *hs, struct ck_malloc *m,	\
+	    unsigned long capacity, unsigned long seed)			\
+	{								\
+									\
+		if (m == NULL || m->malloc == NULL || m->free == NULL)	\
+			return false;					\
+									\
+		hs->m = m;						\
+		hs->seed = seed;					\
+		hs->map = ck_hs_##N##_map_create(m, capacity);		\
+		return hs->map != NULL;					\
+	}								\
+									\
+	CK_CC_INLINE static void					\
+	ck_hs_##N##_destroy(CK_HS_INSTANCE(N) *hs)			\
+	{								\
+									\
+		hs->m->free(hs->map, hs->map->size, false);		\
+		return;							\
+	}								\
+									\
+	CK_CC_UNUSED static void *					\
+	ck_hs_##N##_get(CK_HS_INSTANCE(N) *hs, unsigned long h, const void *key) \
+	{								\
+		struct ck_hs_##N##_map *map;				\
+		void *slot[CK_HS_PROTOTYPE_L1];				\
+		unsigned long offset;					\
+		unsigned int i, probes, match, empty, tombstone;	\
+									\
+		map = ck_pr_load_ptr(&hs->map);				\
+		probes = ck_pr_load_uint(&map->probe_maximum);		\
+		offset = CK_HS_PROTOTYPE_GROUP(map, h);			\
+		for (i = 0; i < probes; i++) {				\
+			match = ck_hs_##N##_group(map->entries + offset, key, \
+			    slot, &empty, &tombstone);			\
+			if (match != 0)					\
+				return slot[ck_cc_ffs(match) - 1];	\
+									\
+			if (empty != 0)					\
+				break;					\
+									\
+			offset = ck_hs_##N##_probe_next(map, offset, h); \
+		}							\
+									\
+		return NULL;						\
+	}								\
+									\
+	CK_CC_INLINE static bool					\
+	ck_hs_##N##_grow(CK_HS_INSTANCE(N) *hs, unsigned long capacity)	\
+	{								\
+									\
+		if (hs->map->capacity > capacity)			\
+			return false;					\
+									\
+		return ck_hs_##N##_rehash(hs, capacity);		\
+	}								\
+									\
+	CK_CC_INLINE static bool					\
+	ck_hs_##N##_put(CK_HS_INSTANCE(N) *hs, unsigned long h, const void *key) \
+	{								\
+		struct ck_hs_##N##_map *map;				\
+		void **first, *object;					\
+		unsigned int n_probes;					\
+									\
+		for (;;) {						\
+			map = hs->map;					\
+			if (ck_hs_##N##_probe(map, h, key, &first, &object, \
+			    &n_probes) != NULL)				\
+				return false;				\
+									\
+			if (first != NULL)				\
+				break;					\
+									\
+			if (ck_hs_##N##_rehash(hs, map->capacity << 1) == false) \
+				return false;				\
+		}							\
+									\
+		ck_hs_##N##_insert(hs, map, first, key, n_probes);	\
+		return true;						\
+	}								\
+									\
+	CK_CC_INLINE static bool					\
+	ck_hs_##N##_set(CK_HS_INSTANCE(N) *hs, unsigned long h, const void *key, \
+	    void **previous)						\
+	{								\
+		struct ck_hs_##N##_map *map;				\
+		void **slot, **first, *object;				\
+		unsigned int n_probes;					\
+									\
+		for (;;) {						\
+			map = hs->map;					\
+			slot = ck_hs_##N##_probe(map, h, key, &first, &object, \
+			    &n_probes);					\
+			if (slot != NULL) {				\
+				ck_pr_store_ptr(slot, (void *)(uintptr_t)key); \
+				*previous = object;			\
+				return true;				\
+			}						\
+									\
+			if (first != NULL)				\
+				break;					\
+									\
+			if (ck_hs_##N##_rehash(hs, map->capacity << 1) == false) \
+				return false;				\
+		}							\
+									\
+		ck_hs_##N##_insert(hs, map, first, key, n_probes);	\
+		*previous = NULL;					\
+		return true;						\
+	}								\
+									\
+	CK_CC_INLINE static void *					\
+	ck_hs_##N##_remove(CK_HS_INSTANCE(N) *hs, unsigned long h,	\
+	    const void *key)						\
+	{								\
+		struct ck_hs_##N##_map *map = hs->map;			\
+		void **slot, **first, *object;				\
+		unsigned int n_probes;					\
+									\
+		slot = ck_hs_##N##_probe(map, h, key, &first, &object,	\
+		    &n_probes);						\
+		if (slot == NULL)					\
+			return NULL;					\
+									\
+		ck_pr_store_ptr(slot, CK_HS_PROTOTYPE_TOMBSTONE);	\
+		map->n_entries--;					\
+		map->tombstones++;					\
+		return object;						\
+	}								\
+									\
+	CK_CC_INLINE static unsigned long				\
+	ck_hs_##N##_count(CK_HS_INSTANCE(N) *hs)			\
+	{								\
+									\
+		return hs->map->n_entries;				\
+	}								\
+									\
+	CK_CC_INLINE static bool					\
+	ck_hs_##N##_next(CK_HS_INSTANCE(N) *hs, ck_hs_iterator_t *i,	\
+	    void **key)							\
+	{								\
+		struct ck_hs_##N##_map *map = hs->map;			\
+		void *value;						\
+									\
+		while (i->offset < map->capacity) {			\
+			value = map->entries[i->offset++];		\
+			if (value == NULL || value == CK_HS_PROTOTYPE_TOMBSTONE) \
+				continue;				\
+									\
+			*key = value;					\
+			return true;					\
+		}							\
+									\
+		return false;						\
+	}
+
+
+/*
+ * Compact compile-time specialized hash sets. CK_HS_COMPACT_PROTOTYPE(N, T,
+ * H, C) generates a single-writer, multiple-reader set named N that stores
+ * indices into a caller-supplied array of records of type T, rather than
+ * pointers. Every slot is a 32-bit word holding an index in its low
+ * CK_HS_COMPACT_INDEX_BITS bits and a fragment of the hash value of the
+ * record in the remaining bits, so a cache line holds twice as many slots
+ * and C is only invoked on records with a matching fragment. H and C are
+ * invoked on pointers to records, and C also receives the key of a lookup,
+ * which may be a record. The array of records must not move for the
+ * lifetime of the set.
+ */
+#define CK_HS_COMPACT_L1 16
+#define CK_HS_COMPACT_L1_SHIFT 4
+#define CK_HS_COMPACT_INDEX_BITS 24
+#define CK_HS_COMPACT_INDEX_MASK ((UINT32_C(1) << CK_HS_COMPACT_INDEX_BITS) - 1)
+#define CK_HS_COMPACT_INDEX_MAX (CK_HS_COMPACT_INDEX_MASK - 2)
+#define CK_HS_COMPACT_TOMBSTONE CK_HS_COMPACT_INDEX_MASK
+#define CK_HS_COMPACT_NONE UINT32_MAX
+#define CK_HS_COMPACT_TAG(H) \
+	((uint32_t)((H) >> (sizeof(unsigned long) * 8 - 8)) << CK_HS_COMPACT_INDEX_BITS)
+#define CK_HS_COMPACT_ENTRY(H, I) (CK_HS_COMPACT_TAG(H) | ((uint32_t)(I) + 1))
+#define CK_HS_COMPACT_GROUP(M, H) \
+	((H) & (M)->mask & ~(unsigned long)(CK_HS_COMPACT_L1 - 1))
+
+#define CK_HS_COMPACT_INIT(N, T, M, A, C, S) ck_hs_##N##_init(T, M, A, C, S)
+
+#define CK_HS_COMPACT_PROTOTYPE(N, T, H, C)				\
+	struct ck_hs_##N##_map {					\
+		unsigned long mask;					\
+		unsigned long step;					\
+		unsigned long capacity;					\
+		unsigned long n_entries;				\
+		unsigned long tombstones;				\
+		unsigned long size;					\
+		unsigned int probe_maximum;				\
+		uint32_t *entries;					\
+	};								\
+									\
+	CK_HS_INSTANCE(N) {						\
+		struct ck_malloc *m;					\
+		struct ck_hs_##N##_map *map;				\
+		unsigned long seed;					\
+		const T *arena;						\
+	};								\
+									\
+	CK_CC_UNUSED static struct ck_hs_##N##_map *			\
+	ck_hs_##N##_map_create(struct ck_malloc *m, unsigned long capacity) \
+	{								\
+		struct ck_hs_##N##_map *map;				\
+		unsigned long n, size, step = 0;			\
+									\
+		for (n = CK_HS_COMPACT_L1; n < capacity; n <<= 1)	\
+			step++;						\
+									\
+		size = sizeof(struct ck_hs_##N##_map) +			\
+		    sizeof(uint32_t) * n + CK_MD_CACHELINE - 1;		\
+		map = m->malloc(size);					\
+		if (map == NULL)					\
+			return NULL;					\
+									\
+		map->mask = n - 1;					\
+		map->step = step + CK_HS_COMPACT_L1_SHIFT;		\
+		map->capacity = n;					\
+		map->n_entries = 0;					\
+		map->tombstones = 0;					\
+		map->size = size;					\
+		map->probe_maximum = 0;					\
+		map->entries = (void *)(((uintptr_t)(map + 1) +		\
+		    CK_MD_CACHELINE - 1) & ~(uintptr_t)(CK_MD_CACHELINE - 1)); \
+		memset(map->entries, 0, sizeof(uint32_t) * n);		\
+		ck_pr_fence_store();					\
+		return map;						\
+	}								\
+									\
+	CK_CC_INLINE static unsigned long				\
+	ck_hs_##N##_probe_next(struct ck_hs_##N##_map *map,		\
+	    unsigned long offset, unsigned long h)			\
+	{								\
+		unsigned long stride;					\
+									\
+		stride = ((h >> map->step) << CK_HS_COMPACT_L1_SHIFT) |	\
+		    CK_HS_COMPACT_L1;					\
+		return (offset + stride) & map->mask;			\
+	}								\
+									\
+	/*								\
+	 * Loads a probe group into slot and returns a bitmap of the slots \
+	 * holding key. Records are only read for slots whose fragment	\
+	 * matches tag.							\
+	 */								\
+	CK_CC_UNUSED static unsigned int				\
+	ck_hs_##N##_group(CK_HS_INSTANCE(N) *hs, uint32_t *entries,	\
+	    uint32_t tag, const void *key, uint32_t *slot,		\
+	    unsigned int *empty, unsigned int *tombstone)		\
+	{								\
+		unsigned int i, candidate = 0, match = 0, e = 0, t = 0;	\
+									\
+		for (i = 0; i < CK_HS_COMPACT_L1; i++)			\
+			slot[i] = ck_pr_load_32(&entries[i]);		\
+									\
+		for (i = 0; i < CK_HS_COMPACT_L1; i++) {		\
+			e |= (unsigned int)(slot[i] == 0) << i;		\
+			t |= (unsigned int)(slot[i] ==			\
+			    CK_HS_COMPACT_TOMBSTONE) << i;		\
+			candidate |= (unsigned int)(slot[i] != 0 &&	\
+			    slot[i] != CK_HS_COMPACT_TOMBSTONE &&	\
+			    (slot[i] & ~CK_HS_COMPACT_INDEX_MASK) == tag) << i; \
+		}							\
+									\
+		while (candidate != 0) {				\
+			i = ck_cc_ffs(candidate) - 1;			\
+			candidate &= candidate - 1;			\
+			if (C(&hs->arena[(slot[i] &			\
+			    CK_HS_COMPACT_INDEX_MASK) - 1], key))	\
+				match |= 1U << i;			\
+		}							\
+									\
+		*empty = e;						\
+		*tombstone = t;						\
+		return match;						\
+	}								\
+									\
+	CK_CC_UNUSED static uint32_t *					\
+	ck_hs_##N##_probe(CK_HS_INSTANCE(N) *hs,			\
+	    struct ck_hs_##N##_map *map, unsigned long h,		\
+	    const void *key, uint32_t **first, uint32_t *object,	\
+	    unsigned int *n_probes)					\
+	{								\
+		uint32_t slot[CK_HS_COMPACT_L1], tag;			\
+		uint32_t *insert = NULL;				\
+		unsigned long offset, i, limit;				\
+		unsigned int j, match, empty, tombstone, probes = 0;	\
+									\
+		tag = CK_HS_COMPACT_TAG(h);				\
+		limit = map->capacity / CK_HS_COMPACT_L1;		\
+		offset = CK_HS_COMPACT_GROUP(map, h);			\
+		for (i = 0; i < limit; i++) {				\
+			match = ck_hs_##N##_group(hs, map->entries + offset, \
+			    tag, key, slot, &empty, &tombstone);	\
+									\
+			if (insert == NULL && tombstone != 0) {		\
+				insert = map->entries + offset +	\
+				    ck_cc_ffs(tombstone) - 1;		\
+				probes = i + 1;				\
+			}						\
+									\
+			if (match != 0) {				\
+				*first = insert;			\
+				*n_probes = probes;			\
+				j = ck_cc_ffs(match) - 1;		\
+				*object = (slot[j] &			\
+				    CK_HS_COMPACT_INDEX_MASK) - 1;	\
+				return map->entries + offset + j;	\
+			}						\
+									\
+			if (empty != 0) {				\
+				if (insert == NULL) {			\
+					insert = map->entries + offset + \
+					    ck_cc_ffs(empty) - 1;	\
+					probes = i + 1;			\
+				}					\
+									\
+				break;					\
+			}						\
+									\
+			offset = ck_hs_##N##_probe_next(map, offset, h); \
+		}							\
+									\
+		*first = insert;					\
+		*n_probes = probes;					\
+		*object = CK_HS_COMPACT_NONE;				\
+		return NULL;						\
+	}								\
+									\
+	CK_CC_UNUSED static bool					\
+	ck_hs_##N##_rehash(CK_HS_INSTANCE(N) *hs, unsigned long capacity) \
+	{								\
+		struct ck_hs_##N##_map *map, *update;			\
+		unsigned long k, h, offset, probes, limit;		\
+		unsigned int j;						\
+		uint32_t entry;						\
+									\
+		map = hs->map;						\
+	restart:							\
+		update = ck_hs_##N##_map_create(hs->m, capacity);	\
+		if (update == NULL)					\
+			return false;					\
+									\
+		limit = update->capacity / CK_HS_COMPACT_L1;		\
+		for (k = 0; k < map->capacity; k++) {			\
+			entry = map->entries[k];			\
+			if (entry == 0 || entry == CK_HS_COMPACT_TOMBSTONE) \
+				continue;				\
+									\
+			h = H(&hs->arena[(entry &			\
+			    CK_HS_COMPACT_INDEX_MASK) - 1], hs->seed);	\
+			offset = CK_HS_COMPACT_GROUP(update, h);	\
+			for (probes = 1; probes <= limit; probes++) {	\
+				for (j = 0; j < CK_HS_COMPACT_L1; j++) { \
+					if (update->entries[offset + j] == 0) \
+						break;			\
+				}					\
+									\
+				if (j < CK_HS_COMPACT_L1)		\
+					break;				\
+									\
+				offset = ck_hs_##N##_probe_next(update,	\
+				    offset, h);				\
+			}						\
+									\
+			if (probes > limit) {				\
+				hs->m->free(update, update->size, false); \
+				capacity <<= 1;				\
+				goto restart;				\
+			}						\
+									\
+			update->entries[offset + j] = entry;		\
+			update->n_entries++;				\
+			if (probes > update->probe_maximum)		\
+				update->probe_maximum = (unsigned int)probes; \
+		}							\
+									\
+		ck_pr_fence_store();					\
+		ck_pr_store_ptr(&hs->map, update);			\
+		hs->m->free(map, map->size, true);			\
+		return true;						\
+	}								\
+									\
+	CK_CC_UNUSED static void					\
+	ck_hs_##N##_insert(CK_HS_INSTANCE(N) *hs, struct ck_hs_##N##_map *map, \
+	    uint32_t *slot, uint32_t entry, unsigned int n_probes)	\
+	{								\
+									\
+		if (n_probes > map->probe_maximum)			\
+			ck_pr_store_uint(&map->probe_maximum, n_probes); \
+									\
+		if (*slot == CK_HS_COMPACT_TOMBSTONE)			\
+			map->tombstones--;				\
+									\
+		ck_pr_fence_store();					\
+		ck_pr_store_32(slot, entry);				\
+		map->n_entries++;					\
+									\
+		if ((map->n_entries + map->tombstones) << 1 > map->capacity) { \
+			ck_hs_##N##_rehash(hs, map->capacity <<		\
+			    ((map->n_entries << 2) > map->capacity));	\
+		}							\
+									\
+		return;							\
+	}								\
+									\
+	CK_CC_INLINE static bool					\
+	ck_hs_##N##_init(CK_HS_INSTANCE(N) *hs, struct ck_malloc *m,	\
+	    const T *arena, unsigned long capacity, unsigned long seed)	\
+	{								\
+									\
+		if (m == NULL || m->malloc == NULL || m->free == NULL ||	\
+		    arena == NULL)					\
+			return false;					\
+									\
+		hs->m = m;						\
+		hs->seed = seed;					\
+		hs->arena = arena;					\
+		hs->map = ck_hs_##N##_map_create(m, capacity);		\
+		return hs->map != NULL;					\
+	}								\
+									\
+	CK_CC_INLINE static void					\
+	ck_hs_##N##_destroy(CK_HS_INSTANCE(N) *hs)			\
+	{								\
+									\
+		hs->m->free(hs->map, hs->map->size, false);		\
+		return;							\
+	}								\
+									\
+	CK_CC_UNUSED static uint32_t					\
+	ck_hs_##N##_get(CK_HS_INSTANCE(N) *hs, unsigned long h, const void *key) \
+	{								\
+		struct ck_hs_##N##_map *map;				\
+		uint32_t slot[CK_HS_COMPACT_L1], tag;			\
+		unsigned long offset;					\
+		unsigned int i, probes, match, empty, tombstone;	\
+									\
+		map = ck_pr_load_ptr(&hs->map);				\
+		probes = ck_pr_load_uint(&map->probe_maximum);		\
+		tag = CK_HS_COMPACT_TAG(h);				\
+		offset = CK_HS_COMPACT_GROUP(map, h);			\
+		for (i = 0; i < probes; i++) {				\
+			match = ck_hs_##N##_group(hs, map->entries + offset, \
+			    tag, key, slot, &empty, &tombstone);	\
+			if (match != 0) {				\
+				return (slot[ck_cc_ffs(match) - 1] &	\
+				    CK_HS_COMPACT_INDEX_MASK) - 1;	\
+			}						\
+									\
+			if (empty != 0)					\
+				break;					\
+									\
+			offset = ck_hs_##N##_probe_next(map, offset, h); \
+		}							\
+									\
+		return CK_HS_COMPACT_NONE;				\
+	}								\
+									\
+	CK_CC_INLINE static bool					\
+	ck_hs_##N##_grow(CK_HS_INSTANCE(N) *hs, unsigned long capacity)	\
+	{								\
+									\
+		if (hs->map->capacity > capacity)			\
+			return false;					\
+									\
+		return ck_hs_##N##_rehash(hs, capacity);		\
+	}								\
+									\
+	CK_CC_INLINE static bool					\
+	ck_hs_##N##_put(CK_HS_INSTANCE(N) *hs, unsigned long h, uint32_t index) \
+	{								\
+		struct ck_hs_##N##_map *map;				\
+		uint32_t *first, object;				\
+		unsigned int n_probes;					\
+									\
+		if (index > CK_HS_COMPACT_INDEX_MAX)			\
+			return false;					\
+									\
+		for (;;) {						\
+			map = hs->map;					\
+			if (ck_hs_##N##_probe(hs, map, h, &hs->arena[index], \
+			    &first, &object, &n_probes) != NULL)	\
+				return false;				\
+									\
+			if (first != NULL)				\
+				break;					\
+									\
+			if (ck_hs_##N##_rehash(hs, map->capacity << 1) == false) \
+				return false;				\
+		}							\
+									\
+		ck_hs_##N##_insert(hs, map, first,			\
+		    CK_HS_COMPACT_ENTRY(h, index), n_probes);		\
+		return true;						\
+	}								\
+									\
+	CK_CC_INLINE static bool					\
+	ck_hs_##N##_set(CK_HS_INSTANCE(N) *hs, unsigned long h, uint32_t index, \
+	    uint32_t *previous)						\
+	{								\
+		struct ck_hs_##N##_map *map;				\
+		uint32_t *slot, *first, object;				\
+		unsigned int n_probes;					\
+									\
+		if (index > CK_HS_COMPACT_INDEX_MAX)			\
+			return false;					\
+									\
+		for (;;) {						\
+			map = hs->map;					\
+			slot = ck_hs_##N##_probe(hs, map, h, &hs->arena[index], \
+			    &first, &object, &n_probes);		\
+			if (slot != NULL) {				\
+				ck_pr_fence_store();			\
+				ck_pr_store_32(slot,			\
+				    CK_HS_COMPACT_ENTRY(h, index));	\
+				*previous = object;			\
+				return true;				\
+			}						\
+									\
+			if (first != NULL)				\
+				break;					\
+									\
+			if (ck_hs_##N##_rehash(hs, map->capacity << 1) == false) \
+				return false;				\
+		}							\
+									\
+		ck_hs_##N##_insert(hs, map, first,			\
+		    CK_HS_COMPACT_ENTRY(h, index), n_probes);		\
+		*previous = CK_HS_COMPACT_NONE;				\
+		return true;						\
+	}								\
+									\
+	CK_CC_INLINE static uint32_t					\
+	ck_hs_##N##_remove(CK_HS_INSTANCE(N) *hs, unsigned long h,	\
+	    const void *key)						\
+	{								\
+		struct ck_hs_##N##_map *map = hs->map;			\
+		uint32_t *slot, *first, object;				\
+		unsigned int n_probes;					\
+									\
+		slot = ck_hs_##N##_probe(hs, map, h, key, &first, &object, \
+		    &n_probes);						\
+		if (slot == NULL)					\
+			return CK_HS_COMPACT_NONE;			\
+									\
+		ck_pr_store_32(slot, CK_HS_COMPACT_TOMBSTONE);		\
+		map->n_entries--;					\
+		map->tombstones++;					\
+		return object;						\
+	}								\
+									\
+	CK_CC_INLINE static unsigned long				\
+	ck_hs_##N##_count(CK_HS_INSTANCE(N) *hs)			\
+	{								\
+									\
+		return hs->map->n_entries;				\
+	}								\
+									\
+	CK_CC_INLINE static bool					\
+	ck_hs_##N##_next(CK_HS_INSTANCE(N) *hs, ck_hs_iterator_t *i,	\
+	    uint32_t *index)						\
+	{								\
+		struct ck_hs_##N##_map *map = hs->map;			\
+		uint32_t value;						\
+									\
+		while (i->offset < map->capacity) {			\
+			value = map->entries[i->offset++];		\
+			if (value == 0 || value == CK_HS_COMPACT_TOMBSTONE) \
+				continue;				\
+									\
+			*index = (value & CK_HS_COMPACT_INDEX_MASK) - 1; \
+			return true;					\
+		}							\
+									\
+		return false;						\
+	}
+
 #endif /* _CK_HS_H */
 
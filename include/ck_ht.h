@@ -35,6 +35,7 @@
 #include <ck_cc.h>
 #include <ck_malloc.h>
 #include <ck_md.h>
+#include <ck_spinlock.h>
 #include <ck_stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -45,10 +46,39 @@ struct ck_ht_hash {
 typedef struct ck_ht_hash ck_ht_hash_t;
 
 enum ck_ht_mode {
-	CK_HT_MODE_DIRECT,
-	CK_HT_MODE_BYTESTRING
+	CK_HT_MODE_DIRECT = 0,
+	CK_HT_MODE_BYTESTRING = 1,
+
+	/*
+	 * Maintains the probe, retry and growth counters reported by
+	 * ck_ht_stat. May be combined with either of the above modes.
+	 */
+	CK_HT_MODE_STAT = 2,
+
+	/*
+	 * Growth triggered by insertion migrates entries into the larger map
+	 * a few buckets at a time, as part of subsequent write operations,
+	 * rather than all at once. Lookups consult both maps in the meantime.
+	 */
+	CK_HT_MODE_INCREMENTAL = 4,
+
+	/*
+	 * Keys are copied into storage owned by the hash table rather than
+	 * referenced. Short keys are stored in the slot of their entry, so
+	 * that their comparison does not leave the probed cache line. Returned
+	 * key pointers are only valid within the protected section of the
+	 * reader. Requires CK_HT_MODE_BYTESTRING.
+	 */
+	CK_HT_MODE_INLINE = 8
 };
 
+/*
+ * Number of buckets in the probe length histogram of ck_ht_stat. Bucket i
+ * counts insertions with a probe sequence of [2^i, 2^(i + 1)) slots; the
+ * last bucket also counts all longer probe sequences.
+ */
+#define CK_HT_STAT_PROBES 16
+
 #if defined(CK_MD_POINTER_PACK_ENABLE) && defined(CK_MD_VMA_BITS)
 #define CK_HT_PP
 #define CK_HT_KEY_LENGTH ((sizeof(void *) * 8) - CK_MD_VMA_BITS)
@@ -90,27 +120,41 @@ typedef struct ck_ht_entry ck_ht_entry_t;
 typedef void ck_ht_hash_cb_t(ck_ht_hash_t *, const void *, size_t, uint64_t);
 
 struct ck_ht_map;
+struct ck_ht_counters;
 struct ck_ht {
 	struct ck_malloc *m;
 	struct ck_ht_map *map;
 	enum ck_ht_mode mode;
 	uint64_t seed;
 	ck_ht_hash_cb_t *h;
+	struct ck_ht_counters *counters;
 };
 typedef struct ck_ht ck_ht_t;
 
 struct ck_ht_stat {
 	uint64_t probe_maximum;
 	uint64_t n_entries;
+	uint64_t tombstones;
+
+	/* The following are only maintained in CK_HT_MODE_STAT mode. */
+	uint64_t probes[CK_HT_STAT_PROBES];
+	uint64_t retries;
+	uint64_t grows;
+	uint64_t grow_entries;
 };
 
 struct ck_ht_iterator {
 	struct ck_ht_entry *current;
 	uint64_t offset;
+
+	/* Snapshot scanned by ck_ht_next_spmc, ending at slot limit. */
+	struct ck_ht_map *map;
+	uint64_t limit;
+	uint64_t version;
 };
 typedef struct ck_ht_iterator ck_ht_iterator_t;
 
-#define CK_HT_ITERATOR_INITIALIZER { NULL, 0 }
+#define CK_HT_ITERATOR_INITIALIZER { NULL, 0, NULL, 0, 0 }
 
 CK_CC_INLINE static void
 ck_ht_iterator_init(struct ck_ht_iterator *iterator)
@@ -118,6 +162,9 @@ ck_ht_iterator_init(struct ck_ht_iterator *iterator)
 
 	iterator->current = NULL;
 	iterator->offset = 0;
+	iterator->map = NULL;
+	iterator->limit = 0;
+	iterator->version = 0;
 	return;
 }
 
@@ -242,6 +289,14 @@ ck_ht_entry_value_direct(ck_ht_entry_t *entry)
  */
 bool ck_ht_next(ck_ht_t *, ck_ht_iterator_t *, ck_ht_entry_t **entry);
 
+/*
+ * Partitioned iteration may occur concurrently with a single writer.
+ * Every iterator returns a copy of the entry.
+ */
+void ck_ht_iterator_partition(ck_ht_t *, ck_ht_iterator_t *, unsigned int);
+bool ck_ht_next_spmc(ck_ht_t *, ck_ht_iterator_t *, ck_ht_entry_t *);
+bool ck_ht_iterator_stale(ck_ht_t *, ck_ht_iterator_t *);
+
 void ck_ht_stat(ck_ht_t *, struct ck_ht_stat *);
 void ck_ht_hash(ck_ht_hash_t *, ck_ht_t *, const void *, uint16_t);
 void ck_ht_hash_direct(ck_ht_hash_t *, ck_ht_t *, uintptr_t);
@@ -256,5 +311,77 @@ bool ck_ht_reset_spmc(ck_ht_t *);
 bool ck_ht_reset_size_spmc(ck_ht_t *, uint64_t);
 uint64_t ck_ht_count(ck_ht_t *);
 
+/*
+ * A sharded hash table routes every key, by the most significant bits of
+ * its hash value, to one of a power of two number of hash tables. Every
+ * shard is written under its own lock, so writers to different shards do
+ * not contend. Lookups remain lock-free. All shards share a seed and hash
+ * function, so keys must be hashed with ck_ht_sharded_hash or
+ * ck_ht_sharded_hash_direct.
+ */
+struct ck_ht_shard {
+	ck_spinlock_t lock;
+	char pad[CK_MD_CACHELINE - sizeof(ck_spinlock_t)];
+	ck_ht_t table;
+} CK_CC_CACHELINE;
+
+struct ck_ht_sharded {
+	struct ck_malloc *m;
+	struct ck_ht_shard *shards;
+
+	/* Allocation holding the shards, which are aligned to a cache line. */
+	void *memory;
+	unsigned int n_shards;
+	unsigned int shift;
+};
+typedef struct ck_ht_sharded ck_ht_sharded_t;
+
+struct ck_ht_sharded_iterator {
+	unsigned int shard;
+	ck_ht_iterator_t iterator;
+};
+typedef struct ck_ht_sharded_iterator ck_ht_sharded_iterator_t;
+
+#define CK_HT_SHARDED_ITERATOR_INITIALIZER { 0, CK_HT_ITERATOR_INITIALIZER }
+
+CK_CC_INLINE static void
+ck_ht_sharded_iterator_init(struct ck_ht_sharded_iterator *iterator)
+{
+
+	iterator->shard = 0;
+	ck_ht_iterator_init(&iterator->iterator);
+	return;
+}
+
+/*
+ * Returns the shard of a hash value. The shift is bounded by 63 so that a
+ * single shard needs no special case.
+ */
+CK_CC_INLINE static struct ck_ht_shard *
+ck_ht_sharded_shard(struct ck_ht_sharded *table, ck_ht_hash_t h)
+{
+
+	return &table->shards[(h.value >> 1) >> table->shift];
+}
+
+/*
+ * Iteration may occur concurrently with writers and returns a copy of
+ * every entry. Entries migrated or relocated by concurrent writers may
+ * be missed or returned more than once.
+ */
+bool ck_ht_sharded_next(ck_ht_sharded_t *, ck_ht_sharded_iterator_t *, ck_ht_entry_t *);
+
+void ck_ht_sharded_stat(ck_ht_sharded_t *, struct ck_ht_stat *);
+void ck_ht_sharded_hash(ck_ht_hash_t *, ck_ht_sharded_t *, const void *, uint16_t);
+void ck_ht_sharded_hash_direct(ck_ht_hash_t *, ck_ht_sharded_t *, uintptr_t);
+bool ck_ht_sharded_init(ck_ht_sharded_t *, enum ck_ht_mode, ck_ht_hash_cb_t *, struct ck_malloc *, uint64_t, uint64_t, unsigned int);
+void ck_ht_sharded_destroy(ck_ht_sharded_t *);
+bool ck_ht_sharded_set_mpmc(ck_ht_sharded_t *, ck_ht_hash_t, ck_ht_entry_t *);
+bool ck_ht_sharded_put_mpmc(ck_ht_sharded_t *, ck_ht_hash_t, ck_ht_entry_t *);
+bool ck_ht_sharded_get_mpmc(ck_ht_sharded_t *, ck_ht_hash_t, ck_ht_entry_t *);
+bool ck_ht_sharded_remove_mpmc(ck_ht_sharded_t *, ck_ht_hash_t, ck_ht_entry_t *);
+bool ck_ht_sharded_reset_mpmc(ck_ht_sharded_t *);
+uint64_t ck_ht_sharded_count(ck_ht_sharded_t *);
+
 #endif /* CK_F_PR_LOAD_64 && CK_F_PR_STORE_64 */
 #endif /* _CK_HT_H */
@@ -27,12 +27,68 @@
 #ifndef _CK_MALLOC_H
 #define _CK_MALLOC_H
 
+#include <ck_cc.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <sys/types.h>
 
+/*
+ * Hints describing how memory will be accessed. Any hint may be ignored.
+ * The slots of hash tables are accessed at random by every thread, so
+ * they benefit from huge pages and from pages spread across NUMA nodes.
+ */
+#define CK_MALLOC_HINT_RANDOM	1
+#define CK_MALLOC_HINT_SHARED	2
+
 struct ck_malloc {
 	void *(*malloc)(size_t);
 	void (*free)(void *, size_t, bool);
+
+	/*
+	 * Optional. Returns memory aligned to the specified power of two,
+	 * which is released through free.
+	 */
+	void *(*aligned)(size_t, size_t);
+
+	/*
+	 * Optional. Advises the allocator of how memory it has just returned
+	 * will be accessed, before any of it is touched.
+	 */
+	void (*hint)(void *, size_t, unsigned int);
 };
 
+/*
+ * Allocates memory through the optional callbacks if they are provided.
+ * Memory is only aligned if the allocator has an aligned callback.
+ */
+CK_CC_INLINE static void *
+ck_malloc_hinted(struct ck_malloc *m, size_t size, size_t alignment, unsigned int hints)
+{
+	void *p;
+
+	if (m->aligned != NULL)
+		p = m->aligned(size, alignment);
+	else
+		p = m->malloc(size);
+
+	if (p != NULL && m->hint != NULL)
+		m->hint(p, size, hints);
+
+	return p;
+}
+
+/*
+ * Default implementation backed by anonymous memory mappings. Large
+ * allocations are backed by huge pages where the system provides them.
+ * ck_malloc_mmap_free releases memory immediately, so the allocator is
+ * initialized with a free callback that defers releases requested with
+ * the defer argument, for example with ck_epoch_call, and then releases
+ * memory through ck_malloc_mmap_free.
+ */
+void *ck_malloc_mmap(size_t);
+void *ck_malloc_mmap_aligned(size_t, size_t);
+void ck_malloc_mmap_hint(void *, size_t, unsigned int);
+void ck_malloc_mmap_free(void *, size_t);
+bool ck_malloc_mmap_init(struct ck_malloc *, void (*)(void *, size_t, bool));
+
 #endif /* _CK_MALLOC_H */
@@ -81,6 +81,12 @@
 #define CK_CC_LIKELY(x) (__builtin_expect(!!(x), 1))
 #define CK_CC_UNLIKELY(x) (__builtin_expect(!!(x), 0))
 
+/*
+ * Hint that the cache line containing the specified address will be
+ * read in the near future.
+ */
+#define CK_CC_PREFETCH(x) __builtin_prefetch((x))
+
 /*
  * Some compilers are overly strict regarding aliasing semantics.
  * Unfortunately, in many cases it makes more sense to pay aliasing
@@ -88,4 +94,16 @@
  */
 #define CK_CC_ALIASED __attribute__((__may_alias__))
 
+/*
+ * Returns one plus the index of the least significant bit set in x, or
+ * zero if x is zero.
+ */
+#define CK_F_CC_FFS
+CK_CC_INLINE static int
+ck_cc_ffs(unsigned int x)
+{
+
+	return __builtin_ffs(x);
+}
+
 #endif /* _CK_GCC_CC_H */
@@ -0,0 +1,299 @@
+/*
+ * Copyright 2026 Samy Al Bahra.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <ck_barrier.h>
+#include <ck_hs.h>
+#include <ck_malloc.h>
+#include <ck_pr.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../common.h"
+
+#ifndef KEYS
+#define KEYS 65536
+#endif
+
+struct key {
+	char value[16];
+} CK_CC_ALIGN(16);
+
+static struct key keys[KEYS];
+static ck_hs_t hs;
+static unsigned int nthr;
+static unsigned int successes;
+static ck_barrier_centralized_t barrier = CK_BARRIER_CENTRALIZED_INITIALIZER;
+
+static void *
+hs_malloc(size_t r)
+{
+
+	return malloc(r);
+}
+
+static void
+hs_free(void *p, size_t b, bool r)
+{
+
+	(void)b;
+
+	/*
+	 * Concurrent readers may still reference maps retired during the
+	 * test, so deferred frees are leaked rather than reclaimed.
+	 */
+	if (r == false)
+		free(p);
+
+	return;
+}
+
+static struct ck_malloc my_allocator = {
+	.malloc = hs_malloc,
+	.free = hs_free
+};
+
+static unsigned long
+hs_hash(const void *object, unsigned long seed)
+{
+	const unsigned char *c = object;
+	unsigned long h = 14695981039346656037ULL ^ seed;
+
+	while (*c != '\0')
+		h = (h ^ *c++) * 1099511628211ULL;
+
+	return h;
+}
+
+static bool
+hs_compare(const void *previous, const void *compare)
+{
+
+	return strcmp(previous, compare) == 0;
+}
+
+static void *
+test(void *c)
+{
+	ck_barrier_centralized_state_t state = CK_BARRIER_CENTRALIZED_STATE_INITIALIZER;
+	unsigned int tid = *(unsigned int *)c;
+	unsigned long h, i, j;
+	unsigned int n;
+
+	/*
+	 * Every thread races to insert every key, starting at a different
+	 * offset. A put that fails on a present key must observe that key,
+	 * even if its tag has not yet been stored.
+	 */
+	for (n = 0, j = 0; j < KEYS; j++) {
+		i = (j + tid * (KEYS / nthr)) % KEYS;
+		h = CK_HS_HASH(&hs, hs_hash, &keys[i]);
+		if (ck_hs_put(&hs, h, &keys[i]) == true)
+			n++;
+		else if (ck_hs_get(&hs, h, &keys[i]) != &keys[i])
+			ck_error("ERROR: get must observe present key [%lu]\n", i);
+	}
+
+	ck_pr_add_uint(&successes, n);
+	ck_barrier_centralized(&barrier, &state, nthr);
+
+	if (ck_pr_load_uint(&successes) != KEYS)
+		ck_error("ERROR: %u successful puts of %u keys\n", successes, KEYS);
+
+	/* Remove even keys while verifying that odd keys remain visible. */
+	for (i = tid * 2; i < KEYS; i += nthr * 2) {
+		h = CK_HS_HASH(&hs, hs_hash, &keys[i]);
+		if (ck_hs_remove(&hs, h, &keys[i]) != &keys[i])
+			ck_error("ERROR: remove must succeed [%lu]\n", i);
+
+		h = CK_HS_HASH(&hs, hs_hash, &keys[i + 1]);
+		if (ck_hs_get(&hs, h, &keys[i + 1]) != &keys[i + 1])
+			ck_error("ERROR: get must succeed [%lu]\n", i + 1);
+	}
+
+	ck_barrier_centralized(&barrier, &state, nthr);
+	if (tid == 0)
+		ck_pr_store_uint(&successes, 0);
+
+	ck_barrier_centralized(&barrier, &state, nthr);
+
+	/* Removed keys may be inserted again exactly once. */
+	for (n = 0, j = 0; j < KEYS; j += 2) {
+		i = (j + tid * (KEYS / nthr)) % KEYS & ~1UL;
+		h = CK_HS_HASH(&hs, hs_hash, &keys[i]);
+		n += ck_hs_put(&hs, h, &keys[i]);
+
+		h = CK_HS_HASH(&hs, hs_hash, &keys[i + 1]);
+		if (ck_hs_set(&hs, h, &keys[i + 1], (void **)&c) == false ||
+		    c != &keys[i + 1])
+			ck_error("ERROR: set must replace [%lu]\n", i + 1);
+	}
+
+	ck_pr_add_uint(&successes, n);
+	return NULL;
+}
+
+struct executor_task {
+	void (*function)(void *);
+	void *argument;
+};
+
+static void *
+executor_thread(void *c)
+{
+	struct executor_task *task = c;
+
+	task->function(task->argument);
+	return NULL;
+}
+
+static void
+executor(void (*function)(void *), void *argument, unsigned int n)
+{
+	struct executor_task task = { function, argument };
+	pthread_t *workers;
+	unsigned int j;
+
+	workers = malloc(sizeof(pthread_t) * n);
+	if (workers == NULL)
+		ck_error("ERROR: malloc\n");
+
+	for (j = 0; j < n; j++) {
+		if (pthread_create(&workers[j], NULL, executor_thread, &task) != 0)
+			ck_error("ERROR: pthread_create\n");
+	}
+
+	for (j = 0; j < n; j++)
+		pthread_join(workers[j], NULL);
+
+	free(workers);
+	return;
+}
+
+/*
+ * Grows a set with the entries of the global set through the executor
+ * and verifies that every entry survived.
+ */
+static void
+test_grow_parallel(unsigned int mode)
+{
+	unsigned long h, i;
+	ck_hs_t set;
+
+	if (ck_hs_init(&set, mode, hs_hash, hs_compare, &my_allocator,
+	    KEYS * 2, 6602834) == false)
+		ck_error("ERROR: ck_hs_init\n");
+
+	for (i = 0; i < KEYS; i++) {
+		h = CK_HS_HASH(&set, hs_hash, &keys[i]);
+		if (ck_hs_put(&set, h, &keys[i]) == false)
+			ck_error("ERROR: put must succeed [%lu]\n", i);
+
+		/* Leave tombstones behind for the growth to discard. */
+		if ((i & 7) == 7 && ck_hs_remove(&set, h, &keys[i]) != &keys[i])
+			ck_error("ERROR: remove must succeed [%lu]\n", i);
+	}
+
+	if (ck_hs_grow_parallel(&set, KEYS * 8, nthr, executor) == false)
+		ck_error("ERROR: ck_hs_grow_parallel\n");
+
+	if (ck_hs_grow_parallel(&set, KEYS, nthr, executor) == true)
+		ck_error("ERROR: ck_hs_grow_parallel must not shrink\n");
+
+	if (ck_hs_count(&set) != KEYS - KEYS / 8)
+		ck_error("ERROR: count %lu != %u\n", ck_hs_count(&set), KEYS - KEYS / 8);
+
+	for (i = 0; i < KEYS; i++) {
+		h = CK_HS_HASH(&set, hs_hash, &keys[i]);
+		if ((ck_hs_get(&set, h, &keys[i]) == NULL) != ((i & 7) == 7))
+			ck_error("ERROR: get returned wrong result [%lu]\n", i);
+	}
+
+	ck_hs_destroy(&set);
+	return;
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned int *tid;
+	pthread_t *threads;
+	unsigned long h, i;
+	unsigned int j;
+
+	if (argc != 2) {
+		ck_error("Usage: mpmc <number of threads>\n");
+	}
+
+	nthr = atoi(argv[1]);
+	if (nthr < 2)
+		nthr = 2;
+
+	threads = malloc(sizeof(pthread_t) * nthr);
+	tid = malloc(sizeof(unsigned int) * nthr);
+	if (threads == NULL || tid == NULL)
+		ck_error("ERROR: malloc\n");
+
+	for (i = 0; i < KEYS; i++)
+		snprintf(keys[i].value, sizeof(keys[i].value), "%lu", i);
+
+	/* A small initial map forces several concurrent migrations. */
+	if (ck_hs_init(&hs, CK_HS_MODE_MPMC | CK_HS_MODE_OBJECT, hs_hash,
+	    hs_compare, &my_allocator, 8, 6602834) == false)
+		ck_error("ERROR: ck_hs_init\n");
+
+	for (j = 0; j < nthr; j++) {
+		tid[j] = j;
+		if (pthread_create(&threads[j], NULL, test, &tid[j]) != 0)
+			ck_error("ERROR: pthread_create\n");
+	}
+
+	for (j = 0; j < nthr; j++)
+		pthread_join(threads[j], NULL);
+
+	if (successes != KEYS / 2)
+		ck_error("ERROR: %u successful puts of %u removed keys\n",
+		    successes, KEYS / 2);
+
+	if (ck_hs_count(&hs) != KEYS)
+		ck_error("ERROR: count %lu != %u\n", ck_hs_count(&hs), KEYS);
+
+	for (i = 0; i < KEYS; i++) {
+		h = CK_HS_HASH(&hs, hs_hash, &keys[i]);
+		if (ck_hs_get(&hs, h, &keys[i]) != &keys[i])
+			ck_error("ERROR: get must succeed [%lu]\n", i);
+	}
+
+	ck_hs_destroy(&hs);
+
+	test_grow_parallel(CK_HS_MODE_SPMC | CK_HS_MODE_OBJECT);
+	test_grow_parallel(CK_HS_MODE_SPMC | CK_HS_MODE_OBJECT |
+	    CK_HS_MODE_TAG | CK_HS_MODE_HASH);
+	test_grow_parallel(CK_HS_MODE_MPMC | CK_HS_MODE_OBJECT);
+	return 0;
+}
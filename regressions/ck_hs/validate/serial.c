@@ -35,10 +35,22 @@
 
 #include "../../common.h"
 
+static size_t allocated;
+
+/*
+ * Deferred frees are held back while a snapshot may still read the map,
+ * and in multi-producer mode, where a writer may still read a map that it
+ * has just replaced.
+ */
+static bool deferring;
+static void *deferred[1024];
+static unsigned int n_deferred;
+
 static void *
 hs_malloc(size_t r)
 {
 
+	allocated += r;
 	return malloc(r);
 }
 
@@ -46,12 +58,30 @@ static void
 hs_free(void *p, size_t b, bool r)
 {
 
-	(void)b;
-	(void)r;
+	allocated -= b;
+	if (r == true && deferring == true) {
+		if (n_deferred == sizeof(deferred) / sizeof(*deferred))
+			ck_error("ERROR: too many deferred frees\n");
+
+		deferred[n_deferred++] = p;
+		return;
+	}
+
 	free(p);
 	return;
 }
 
+static void
+hs_reclaim(void)
+{
+
+	while (n_deferred > 0)
+		free(deferred[--n_deferred]);
+
+	deferring = false;
+	return;
+}
+
 static struct ck_malloc my_allocator = {
 	.malloc = hs_malloc,
 	.free = hs_free
@@ -77,22 +107,1042 @@ hs_hash(const void *object, unsigned long seed)
 	return h;
 }
 
+static unsigned long hash_calls, compare_calls;
+
 static bool
 hs_compare(const void *previous, const void *compare)
 {
 
+	compare_calls++;
 	return strcmp(previous, compare) == 0;
 }
 
-int
-main(void)
+static unsigned long
+hs_hash_fnv(const void *object, unsigned long seed)
+{
+	const unsigned char *c = object;
+	unsigned long h = 14695981039346656037ULL ^ seed;
+
+	hash_calls++;
+
+	while (*c != '\0')
+		h = (h ^ *c++) * 1099511628211ULL;
+
+	return h;
+}
+
+static unsigned long
+hs_hash_direct(const void *object, unsigned long seed)
+{
+
+	return ((uintptr_t)object ^ seed) * 0x9E3779B97F4A7C15ULL;
+}
+
+static bool
+hs_compare_direct(const void *previous, const void *compare)
+{
+
+	return previous == compare;
+}
+
+CK_HS_PROTOTYPE(direct, hs_hash_direct, hs_compare_direct)
+CK_HS_PROTOTYPE(string, hs_hash_fnv, hs_compare)
+
+struct record {
+	unsigned long key;
+	unsigned long value;
+};
+
+static unsigned long
+hs_hash_record(const void *object, unsigned long seed)
+{
+	const struct record *record = object;
+
+	return (record->key ^ seed) * 0x9E3779B97F4A7C15ULL;
+}
+
+static bool
+hs_compare_record(const void *previous, const void *compare)
+{
+	const struct record *a = previous, *b = compare;
+
+	return a->key == b->key;
+}
+
+CK_HS_COMPACT_PROTOTYPE(compact, struct record, hs_hash_record, hs_compare_record)
+
+/*
+ * Exercises the specialized sets through growth, replacement, removal and
+ * tombstone reclamation.
+ */
+static void
+run_test_prototype(void)
+{
+	const unsigned long n_keys = 4096;
+	ck_hs_iterator_t iterator = CK_HS_ITERATOR_INITIALIZER;
+	CK_HS_INSTANCE(direct) direct;
+	CK_HS_INSTANCE(string) string;
+	unsigned long h, i, n, round;
+	void *key, *r;
+
+	if (CK_HS_INIT(direct, &direct, &my_allocator, 8, 6602834) == false)
+		ck_error("ERROR: CK_HS_INIT\n");
+
+	for (round = 0; round < 4; round++) {
+		for (i = 1; i <= n_keys; i++) {
+			key = (void *)(i << 3);
+			h = CK_HS_HASH(&direct, hs_hash_direct, key);
+			if (CK_HS_PUT(direct, &direct, h, key) == false)
+				ck_error("ERROR [%lu]: Failed to insert %lu\n", round, i);
+
+			if (CK_HS_PUT(direct, &direct, h, key) == true)
+				ck_error("ERROR [%lu]: Duplicate insert of %lu\n", round, i);
+		}
+
+		if (CK_HS_COUNT(direct, &direct) != n_keys)
+			ck_error("ERROR [%lu]: Count %lu\n", round, CK_HS_COUNT(direct, &direct));
+
+		for (i = 1; i <= n_keys; i++) {
+			key = (void *)(i << 3);
+			h = CK_HS_HASH(&direct, hs_hash_direct, key);
+			if (CK_HS_GET(direct, &direct, h, key) != key)
+				ck_error("ERROR [%lu]: Failed to find %lu\n", round, i);
+
+			key = (void *)((i + n_keys) << 3);
+			h = CK_HS_HASH(&direct, hs_hash_direct, key);
+			if (CK_HS_GET(direct, &direct, h, key) != NULL)
+				ck_error("ERROR [%lu]: Found absent %lu\n", round, i);
+		}
+
+		for (i = 1; i <= n_keys; i++) {
+			key = (void *)(i << 3);
+			h = CK_HS_HASH(&direct, hs_hash_direct, key);
+			if (CK_HS_REMOVE(direct, &direct, h, key) != key)
+				ck_error("ERROR [%lu]: Failed to remove %lu\n", round, i);
+		}
+
+		if (CK_HS_COUNT(direct, &direct) != 0)
+			ck_error("ERROR [%lu]: Set not empty\n", round);
+	}
+
+	CK_HS_DESTROY(direct, &direct);
+
+	if (CK_HS_INIT(string, &string, &my_allocator, 8, 6602834) == false)
+		ck_error("ERROR: CK_HS_INIT\n");
+
+	for (i = 0; i < sizeof(test) / sizeof(*test); i++) {
+		h = CK_HS_HASH(&string, hs_hash_fnv, test[i]);
+		r = CK_HS_GET(string, &string, h, test[i]);
+		if (CK_HS_PUT(string, &string, h, test[i]) == (r != NULL))
+			ck_error("ERROR: Unexpected put result for %s\n", test[i]);
+
+		if (CK_HS_GET(string, &string, h, test[i]) == NULL)
+			ck_error("ERROR: Failed to find %s\n", test[i]);
+	}
+
+	key = strdup(test[2]);
+	if (key == NULL)
+		ck_error("ERROR: strdup\n");
+
+	h = CK_HS_HASH(&string, hs_hash_fnv, key);
+	if (CK_HS_SET(string, &string, h, key, &r) == false || r != test[2])
+		ck_error("ERROR: Failed to replace %s\n", test[2]);
+
+	if (CK_HS_GET(string, &string, h, test[2]) != key)
+		ck_error("ERROR: Replacement of %s not visible\n", test[2]);
+
+	if (CK_HS_GROW(string, &string, 512) == false)
+		ck_error("ERROR: CK_HS_GROW\n");
+
+	n = 0;
+	while (CK_HS_NEXT(string, &string, &iterator, &key) == true)
+		n++;
+
+	if (n != CK_HS_COUNT(string, &string))
+		ck_error("ERROR: Iterated %lu of %lu\n", n, CK_HS_COUNT(string, &string));
+
+	h = CK_HS_HASH(&string, hs_hash_fnv, negative);
+	if (CK_HS_GET(string, &string, h, negative) != NULL)
+		ck_error("ERROR: Found %s\n", negative);
+
+	h = CK_HS_HASH(&string, hs_hash_fnv, test[2]);
+	free(CK_HS_REMOVE(string, &string, h, test[2]));
+	CK_HS_DESTROY(string, &string);
+	return;
+}
+
+/*
+ * Exercises index sets over an array of records, including replacement of
+ * a record by another record with the same key.
+ */
+static void
+run_test_compact(void)
+{
+	const uint32_t n_keys = 4096;
+	ck_hs_iterator_t iterator = CK_HS_ITERATOR_INITIALIZER;
+	CK_HS_INSTANCE(compact) compact;
+	struct record *records, probe;
+	uint32_t i, index, n;
+	unsigned long h;
+
+	records = malloc(sizeof(*records) * n_keys * 2);
+	if (records == NULL)
+		ck_error("ERROR: malloc\n");
+
+	/* The second half of the array duplicates the keys of the first. */
+	for (i = 0; i < n_keys * 2; i++) {
+		records[i].key = i % n_keys;
+		records[i].value = i;
+	}
+
+	if (CK_HS_COMPACT_INIT(compact, &compact, &my_allocator, records, 8, 6602834) == false)
+		ck_error("ERROR: CK_HS_COMPACT_INIT\n");
+
+	for (i = 0; i < n_keys; i++) {
+		h = CK_HS_HASH(&compact, hs_hash_record, &records[i]);
+		if (CK_HS_PUT(compact, &compact, h, i) == false)
+			ck_error("ERROR: Failed to insert %u\n", i);
+
+		if (CK_HS_PUT(compact, &compact, h, i + n_keys) == true)
+			ck_error("ERROR: Duplicate insert of %u\n", i);
+	}
+
+	if (CK_HS_COUNT(compact, &compact) != n_keys)
+		ck_error("ERROR: Count %lu\n", CK_HS_COUNT(compact, &compact));
+
+	for (i = 0; i < n_keys; i++) {
+		probe.key = i;
+		h = CK_HS_HASH(&compact, hs_hash_record, &probe);
+		if (CK_HS_GET(compact, &compact, h, &probe) != i)
+			ck_error("ERROR: Failed to find %u\n", i);
+
+		probe.key = i + n_keys;
+		h = CK_HS_HASH(&compact, hs_hash_record, &probe);
+		if (CK_HS_GET(compact, &compact, h, &probe) != CK_HS_COMPACT_NONE)
+			ck_error("ERROR: Found absent %u\n", i);
+	}
+
+	for (i = 0; i < n_keys; i += 2) {
+		h = CK_HS_HASH(&compact, hs_hash_record, &records[i]);
+		if (CK_HS_SET(compact, &compact, h, i + n_keys, &index) == false ||
+		    index != i)
+			ck_error("ERROR: Failed to replace %u\n", i);
+	}
+
+	for (i = 1; i < n_keys; i += 2) {
+		h = CK_HS_HASH(&compact, hs_hash_record, &records[i]);
+		if (CK_HS_REMOVE(compact, &compact, h, &records[i]) != i)
+			ck_error("ERROR: Failed to remove %u\n", i);
+	}
+
+	if (CK_HS_GROW(compact, &compact, n_keys * 4) == false)
+		ck_error("ERROR: CK_HS_GROW\n");
+
+	n = 0;
+	while (CK_HS_NEXT(compact, &compact, &iterator, &index) == true) {
+		if (index < n_keys || (records[index].key & 1) != 0)
+			ck_error("ERROR: Iterated over stale index %u\n", index);
+
+		n++;
+	}
+
+	if (n != n_keys / 2 || n != CK_HS_COUNT(compact, &compact))
+		ck_error("ERROR: Iterated %u of %lu\n", n, CK_HS_COUNT(compact, &compact));
+
+	CK_HS_DESTROY(compact, &compact);
+	free(records);
+	return;
+}
+
+/*
+ * Keys shared by the tests below, the decimal representation of their
+ * index. Multi-producer sets require keys with the low bit clear.
+ */
+#define N_KEYS (1UL << 17)
+static char keys[N_KEYS][16] CK_CC_ALIGN(16);
+
+static void
+keys_init(void)
+{
+	unsigned long i;
+
+	for (i = 0; i < N_KEYS; i++)
+		snprintf(keys[i], sizeof(keys[i]), "%lu", i);
+
+	return;
+}
+
+static void
+insert(ck_hs_t *hs, unsigned long first, unsigned long last)
+{
+	unsigned long h, i;
+
+	for (i = first; i < last; i++) {
+		h = CK_HS_HASH(hs, hs_hash_fnv, keys[i]);
+		if (ck_hs_put(hs, h, keys[i]) == false)
+			ck_error("ERROR: put must succeed [%lu]\n", i);
+	}
+
+	return;
+}
+
+/*
+ * Initializes a set of strings and inserts the first n_keys keys.
+ */
+static void
+populate(ck_hs_t *hs, unsigned int mode, unsigned long n_keys)
+{
+
+	if (ck_hs_init(hs, mode, hs_hash_fnv, hs_compare, &my_allocator, 8, 6602834) == false)
+		ck_error("ERROR: ck_hs_init\n");
+
+	insert(hs, 0, n_keys);
+	return;
+}
+
+/*
+ * Inserts a large number of keys so that several migrations are in
+ * progress while keys are looked up, replaced and removed.
+ */
+static void
+run_test_growth(unsigned int mode)
+{
+	const unsigned long n_keys = 4096;
+	ck_hs_iterator_t iterator = CK_HS_ITERATOR_INITIALIZER;
+	unsigned long h, i, n;
+	void *r;
+	ck_hs_t hs;
+
+	populate(&hs, mode, 0);
+	for (i = 0; i < n_keys; i++) {
+		insert(&hs, i, i + 1);
+		h = CK_HS_HASH(&hs, hs_hash_fnv, keys[i]);
+		if (ck_hs_put(&hs, h, keys[i]) == true)
+			ck_error("ERROR: put must fail on duplicate [%lu]\n", i);
+
+		if (ck_hs_count(&hs) != i + 1)
+			ck_error("ERROR: count %lu != %lu\n", ck_hs_count(&hs), i + 1);
+
+		/* All previously inserted keys must be visible. */
+		if ((i & (i + 1)) == 0 || (i & 63) == 0) {
+			unsigned long j;
+
+			for (j = 0; j <= i; j++) {
+				h = CK_HS_HASH(&hs, hs_hash_fnv, keys[j]);
+				if (ck_hs_get(&hs, h, keys[j]) != keys[j])
+					ck_error("ERROR: get must succeed [%lu, %lu]\n", i, j);
+			}
+		}
+	}
+
+	/* Batched lookups must agree with ck_hs_get. */
+	for (i = 0; i < n_keys; i += 32) {
+		unsigned long hashes[33];
+		const void *batch[33];
+		void *objects[33];
+		unsigned long j;
+
+		for (j = 0; j < 32; j++) {
+			batch[j] = keys[i + j];
+			hashes[j] = CK_HS_HASH(&hs, hs_hash_fnv, batch[j]);
+		}
+
+		batch[j] = negative;
+		hashes[j] = CK_HS_HASH(&hs, hs_hash_fnv, negative);
+
+		if (ck_hs_get_batch(&hs, 33, hashes, batch, objects) != 32)
+			ck_error("ERROR: batch must find 32 keys [%lu]\n", i);
+
+		for (j = 0; j < 32; j++) {
+			if (objects[j] != keys[i + j])
+				ck_error("ERROR: batch returned wrong key [%lu]\n", i + j);
+		}
+
+		if (objects[32] != NULL)
+			ck_error("ERROR: batch returned negative key\n");
+	}
+
+	n = 0;
+	while (ck_hs_next(&hs, &iterator, &r) == true)
+		n++;
+
+	if (n != n_keys)
+		ck_error("ERROR: iteration visited %lu of %lu keys\n", n, n_keys);
+
+	/* Cached hash values make re-hashing independent of the hash function. */
+	n = hash_calls;
+	if (ck_hs_grow(&hs, n_keys << 3) == false)
+		ck_error("ERROR: ck_hs_grow\n");
+
+	if ((mode & CK_HS_MODE_HASH) && hash_calls != n)
+		ck_error("ERROR: grow invoked hash function %lu times\n", hash_calls - n);
+
+	for (i = 0; i < n_keys; i += 2) {
+		h = CK_HS_HASH(&hs, hs_hash_fnv, keys[i]);
+		if (ck_hs_set(&hs, h, keys[i], &r) == false || r != keys[i])
+			ck_error("ERROR: set must replace [%lu]\n", i);
+
+		if (ck_hs_remove(&hs, h, keys[i]) != keys[i])
+			ck_error("ERROR: remove must succeed [%lu]\n", i);
+	}
+
+	for (i = 0; i < n_keys; i++) {
+		h = CK_HS_HASH(&hs, hs_hash_fnv, keys[i]);
+		r = ck_hs_get(&hs, h, keys[i]);
+		if ((i & 1) == 0 && r != NULL)
+			ck_error("ERROR: removed key is visible [%lu]\n", i);
+		else if ((i & 1) == 1 && r != keys[i])
+			ck_error("ERROR: get must succeed [%lu]\n", i);
+	}
+
+	if (ck_hs_count(&hs) != n_keys / 2)
+		ck_error("ERROR: count %lu != %lu\n", ck_hs_count(&hs), n_keys / 2);
+
+	ck_hs_destroy(&hs);
+	return;
+}
+
+/*
+ * Removes most keys from a set and checks that garbage collection reclaims
+ * tombstones without losing any of the remaining keys.
+ */
+static void
+run_test_gc(unsigned int mode)
+{
+	const unsigned long n_keys = 2048;
+	struct ck_hs_stat before, after;
+	unsigned long h, i;
+	ck_hs_t hs;
+
+	populate(&hs, mode, 0);
+	if (ck_hs_grow(&hs, n_keys * 4) == false)
+		ck_error("ERROR: ck_hs_grow\n");
+
+	insert(&hs, 0, n_keys);
+
+	for (i = 0; i < n_keys; i++) {
+		if ((i & 3) == 0)
+			continue;
+
+		h = CK_HS_HASH(&hs, hs_hash_fnv, keys[i]);
+		if (ck_hs_remove(&hs, h, keys[i]) != keys[i])
+			ck_error("ERROR: remove must succeed [%lu]\n", i);
+	}
+
+	ck_hs_stat(&hs, &before);
+
+	/* Bounded passes followed by a full pass. */
+	for (i = 0; i < 8; i++) {
+		if (ck_hs_gc(&hs, 64, i * 1024) == false)
+			ck_error("ERROR: ck_hs_gc must succeed\n");
+	}
+
+	if (ck_hs_gc(&hs, 0, 0) == false)
+		ck_error("ERROR: ck_hs_gc must succeed\n");
+
+	ck_hs_stat(&hs, &after);
+	/* Robin Hood deletion never leaves tombstones. */
+	if (after.tombstones != 0 && after.tombstones >= before.tombstones)
+		ck_error("ERROR: tombstones %lu >= %lu\n", after.tombstones, before.tombstones);
+
+	if (after.probe_maximum > before.probe_maximum)
+		ck_error("ERROR: probe maximum %u > %u\n", after.probe_maximum, before.probe_maximum);
+
+	if (after.n_entries != n_keys / 4 || ck_hs_count(&hs) != n_keys / 4)
+		ck_error("ERROR: count %lu != %lu\n", ck_hs_count(&hs), n_keys / 4);
+
+	for (i = 0; i < n_keys; i++) {
+		void *r;
+
+		h = CK_HS_HASH(&hs, hs_hash_fnv, keys[i]);
+		r = ck_hs_get(&hs, h, keys[i]);
+		if ((i & 3) == 0 && r != keys[i])
+			ck_error("ERROR: get must succeed [%lu]\n", i);
+		else if ((i & 3) != 0 && r != NULL)
+			ck_error("ERROR: removed key is visible [%lu]\n", i);
+	}
+
+	ck_hs_destroy(&hs);
+	return;
+}
+
+/*
+ * A set filled at a high load factor must use less memory than one at the
+ * default load factor, and must give memory back once it drains.
+ */
+static void
+run_test_load(unsigned int mode)
+{
+	const unsigned long n_keys = 3000, n_left = 16;
+	size_t base, peak, peak_default;
+	unsigned long h, i;
+	void *r;
+	ck_hs_t hs;
+
+	base = allocated;
+	populate(&hs, mode, n_keys);
+	peak_default = allocated - base;
+	ck_hs_destroy(&hs);
+
+	populate(&hs, mode, 0);
+
+	if (ck_hs_load_factor_set(&hs, 50, 25) == true)
+		ck_error("ERROR: minimum load factor must be below half of maximum\n");
+
+	if (ck_hs_load_factor_set(&hs, 100, 0) == true)
+		ck_error("ERROR: maximum load factor must be below 100\n");
+
+	if (ck_hs_load_factor_set(&hs, 85, 20) == false)
+		ck_error("ERROR: ck_hs_load_factor_set\n");
+
+	insert(&hs, 0, n_keys);
+
+	peak = allocated - base;
+	if (peak >= peak_default)
+		ck_error("ERROR: %zu bytes at high load >= %zu bytes\n", peak, peak_default);
+
+	for (i = n_left; i < n_keys; i++) {
+		h = CK_HS_HASH(&hs, hs_hash_fnv, keys[i]);
+		if (ck_hs_remove(&hs, h, keys[i]) != keys[i])
+			ck_error("ERROR: remove must succeed [%lu]\n", i);
+	}
+
+	if (allocated - base >= peak / 16)
+		ck_error("ERROR: drained set holds %zu of %zu bytes\n", allocated - base, peak);
+
+	if (ck_hs_count(&hs) != n_left)
+		ck_error("ERROR: count %lu != %lu\n", ck_hs_count(&hs), n_left);
+
+	for (i = 0; i < n_keys; i++) {
+		h = CK_HS_HASH(&hs, hs_hash_fnv, keys[i]);
+		r = ck_hs_get(&hs, h, keys[i]);
+		if (i < n_left && r != keys[i])
+			ck_error("ERROR: get must succeed [%lu]\n", i);
+		else if (i >= n_left && r != NULL)
+			ck_error("ERROR: removed key is visible [%lu]\n", i);
+	}
+
+	ck_hs_destroy(&hs);
+	return;
+}
+
+/*
+ * Statistics must account for every insertion and growth of the set, and
+ * must be zero for sets that do not maintain them.
+ */
+static void
+run_test_stat(unsigned int mode)
+{
+	const unsigned long n_keys = 1024;
+	struct ck_hs_stat st;
+	unsigned long h, i;
+	uint64_t n_probes;
+	size_t base;
+	ck_hs_t hs;
+
+	base = allocated;
+	populate(&hs, mode | CK_HS_MODE_STAT, n_keys);
+
+	/* The counters of readers are on a cache line of their own. */
+	if ((uintptr_t)hs.counters & (CK_MD_CACHELINE - 1))
+		ck_error("ERROR: counters are not aligned\n");
+
+	/* Duplicates are not insertions. */
+	for (i = 0; i < n_keys; i++) {
+		h = CK_HS_HASH(&hs, hs_hash_fnv, keys[i]);
+		if (ck_hs_put(&hs, h, keys[i]) == true)
+			ck_error("ERROR: duplicate put must fail [%lu]\n", i);
+	}
+
+	ck_hs_stat(&hs, &st);
+	for (n_probes = 0, i = 0; i < CK_HS_STAT_PROBES; i++)
+		n_probes += st.probes[i];
+
+	if (n_probes != n_keys)
+		ck_error("ERROR: histogram holds %ju of %lu insertions\n",
+		    (uintmax_t)n_probes, n_keys);
+
+	if (st.grows == 0 || st.grow_entries == 0)
+		ck_error("ERROR: growth was not recorded\n");
+
+	if (st.allocated == 0 || st.allocated >= allocated - base)
+		ck_error("ERROR: %ju bytes recorded of %zu allocated\n",
+		    (uintmax_t)st.allocated, allocated - base);
+
+	ck_hs_destroy(&hs);
+
+	populate(&hs, mode, 1);
+	ck_hs_stat(&hs, &st);
+	if (st.probes[0] != 0 || st.allocated != 0)
+		ck_error("ERROR: statistics maintained without CK_HS_MODE_STAT\n");
+
+	ck_hs_destroy(&hs);
+	return;
+}
+
+/*
+ * Changing the number of generation counters re-hashes the set, which must
+ * preserve its contents.
+ */
+static void
+run_test_generations(unsigned int mode)
+{
+	const unsigned long n_keys = 512;
+	unsigned long h, i;
+	ck_hs_t hs;
+
+	populate(&hs, mode, n_keys / 2);
+	if (ck_hs_generations_set(&hs, 256) == false)
+		ck_error("ERROR: ck_hs_generations_set\n");
+
+	insert(&hs, n_keys / 2, n_keys);
+
+	if (ck_hs_generations_set(&hs, 0) == true ||
+	    ck_hs_generations_set(&hs, 1000) == true)
+		ck_error("ERROR: generation count must be a power of two\n");
+
+	if (ck_hs_generations_set(&hs, 1024) == false)
+		ck_error("ERROR: ck_hs_generations_set\n");
+
+	if (ck_hs_count(&hs) != n_keys)
+		ck_error("ERROR: count %lu != %lu\n", ck_hs_count(&hs), n_keys);
+
+	for (i = 0; i < n_keys; i++) {
+		h = CK_HS_HASH(&hs, hs_hash_fnv, keys[i]);
+		if (ck_hs_get(&hs, h, keys[i]) != keys[i])
+			ck_error("ERROR: get must succeed [%lu]\n", i);
+	}
+
+	ck_hs_destroy(&hs);
+	return;
+}
+
+/*
+ * Rebuilding with a new seed must preserve the contents of the set, both
+ * for hash values derived from the new seed and from the previous one.
+ */
+static void
+run_test_rebuild(unsigned int mode)
+{
+	const unsigned long n_keys = 512;
+	unsigned long h, h_p, i, seed = 6602834;
+	ck_hs_t hs;
+
+	populate(&hs, mode, n_keys);
+
+	if (ck_hs_rebuild(&hs, seed + 1) == false)
+		ck_error("ERROR: ck_hs_rebuild\n");
+
+	if (hs.seed != seed + 1 || ck_hs_count(&hs) != n_keys)
+		ck_error("ERROR: rebuild did not preserve the set\n");
+
+	for (i = 0; i < n_keys; i++) {
+		h = CK_HS_HASH(&hs, hs_hash_fnv, keys[i]);
+		h_p = hs_hash_fnv(keys[i], seed);
+		if (ck_hs_get(&hs, h, keys[i]) != keys[i] ||
+		    ck_hs_get(&hs, h_p, keys[i]) != keys[i])
+			ck_error("ERROR: get must succeed after rebuild [%lu]\n", i);
+
+		if ((i & 1) && ck_hs_remove(&hs, h, keys[i]) != keys[i])
+			ck_error("ERROR: remove must succeed after rebuild [%lu]\n", i);
+	}
+
+	/*
+	 * Maps created before the rebuild ends, such as by a growth, must
+	 * still accept hash values derived from the previous seed.
+	 */
+	if (ck_hs_grow(&hs, n_keys * 4) == false)
+		ck_error("ERROR: ck_hs_grow\n");
+
+	for (i = 0; i < n_keys; i += 2) {
+		h_p = hs_hash_fnv(keys[i], seed);
+		if (ck_hs_get(&hs, h_p, keys[i]) != keys[i])
+			ck_error("ERROR: get must succeed after growth [%lu]\n", i);
+	}
+
+	ck_hs_rebuild_end(&hs);
+	if (hs.reseeded == true)
+		ck_error("ERROR: rebuild did not end\n");
+
+	for (i = 0; i < n_keys; i++) {
+		h = CK_HS_HASH(&hs, hs_hash_fnv, keys[i]);
+		if ((ck_hs_get(&hs, h, keys[i]) == NULL) != ((i & 1) == 1))
+			ck_error("ERROR: get returned wrong result [%lu]\n", i);
+	}
+
+	ck_hs_destroy(&hs);
+	return;
+}
+
+/*
+ * Lookups of absent keys must be rejected by the filter without comparing
+ * against the keys on their probe sequence, including once the filter has
+ * been rebuilt after removals.
+ */
+static void
+run_test_bloom(unsigned int mode)
+{
+	const unsigned long n_keys = 1024;
+	unsigned long h, i;
+	ck_hs_t hs;
+
+	populate(&hs, mode | CK_HS_MODE_BLOOM, n_keys);
+
+	compare_calls = 0;
+	for (i = n_keys; i < n_keys * 2; i++) {
+		h = CK_HS_HASH(&hs, hs_hash_fnv, keys[i]);
+		if (ck_hs_get(&hs, h, keys[i]) != NULL)
+			ck_error("ERROR: found absent key [%lu]\n", i);
+	}
+
+	if (compare_calls > n_keys / 16)
+		ck_error("ERROR: %lu comparisons for %lu absent keys\n",
+		    compare_calls, n_keys);
+
+	for (i = 0; i < n_keys; i += 2) {
+		h = CK_HS_HASH(&hs, hs_hash_fnv, keys[i]);
+		if (ck_hs_remove(&hs, h, keys[i]) != keys[i])
+			ck_error("ERROR: remove must succeed [%lu]\n", i);
+	}
+
+	for (i = 0; i < n_keys; i++) {
+		h = CK_HS_HASH(&hs, hs_hash_fnv, keys[i]);
+		if (ck_hs_get(&hs, h, keys[i]) != ((i & 1) ? keys[i] : NULL))
+			ck_error("ERROR: get after remove [%lu]\n", i);
+	}
+
+	ck_hs_destroy(&hs);
+
+	if (ck_hs_init(&hs, CK_HS_MODE_MPMC | CK_HS_MODE_BLOOM, hs_hash_fnv,
+	    hs_compare, &my_allocator, 8, 6602834) == true)
+		ck_error("ERROR: filters are not supported with multiple writers\n");
+
+	return;
+}
+
+/*
+ * Partitioned iterators must observe every key exactly once between them and
+ * report a scan as stale once the set has grown.
+ */
+static void
+run_test_partition(unsigned int mode)
+{
+	const unsigned long n_keys = 1000;
+	ck_hs_iterator_t iterators[4];
+	unsigned char *seen;
+	unsigned long i, n;
+	unsigned int k;
+	ck_hs_t hs;
+	void *key;
+
+	seen = calloc(n_keys, 1);
+	if (seen == NULL)
+		ck_error("ERROR: malloc\n");
+
+	populate(&hs, mode, n_keys);
+
+	ck_hs_iterator_partition(&hs, iterators, 4);
+	for (n = 0, k = 0; k < 4; k++) {
+		while (ck_hs_next_spmc(&hs, &iterators[k], &key) == true) {
+			i = (unsigned long)((char (*)[16])key - keys);
+			if (i >= n_keys || seen[i]++ != 0)
+				ck_error("ERROR: key observed twice [%lu]\n", i);
+
+			n++;
+		}
+	}
+
+	if (n != ck_hs_count(&hs))
+		ck_error("ERROR: partitions observed %lu of %lu keys\n",
+		    n, ck_hs_count(&hs));
+
+	for (k = 0; k < 4; k++) {
+		if (ck_hs_iterator_stale(&hs, &iterators[k]) == true)
+			ck_error("ERROR: scan without writers is stale\n");
+	}
+
+	if (ck_hs_grow(&hs, n_keys * 8) == false)
+		ck_error("ERROR: ck_hs_grow\n");
+
+	if (ck_hs_iterator_stale(&hs, &iterators[0]) == false)
+		ck_error("ERROR: scan across growth must be stale\n");
+
+	ck_hs_destroy(&hs);
+	free(seen);
+	return;
+}
+
+/*
+ * A snapshot must observe every key that is present for the entire scan
+ * exactly once, even as the writer replaces, removes, inserts and grows.
+ */
+static void
+run_test_snapshot(unsigned int mode)
+{
+	const unsigned long n_keys = 1000;
+	ck_hs_iterator_t iterators[2];
+	unsigned char *seen;
+	unsigned long h, i, j, op;
+	unsigned int k;
+	ck_hs_t hs;
+	void *key, *previous;
+
+	seen = calloc(n_keys, 1);
+	if (seen == NULL)
+		ck_error("ERROR: malloc\n");
+
+	populate(&hs, mode, n_keys);
+
+	/* Tombstones give replacements an earlier slot to relocate into. */
+	for (i = 0; i < n_keys; i += 4) {
+		h = CK_HS_HASH(&hs, hs_hash_fnv, keys[i]);
+		if (ck_hs_remove(&hs, h, keys[i]) == NULL)
+			ck_error("ERROR: remove must succeed [%lu]\n", i);
+	}
+
+	deferring = true;
+	if (ck_hs_snapshot_begin(&hs, iterators, 2) == false)
+		ck_error("ERROR: ck_hs_snapshot_begin\n");
+
+	/*
+	 * Keys 4n + 1 are left alone, keys 4n + 2 are replaced, keys 4n + 3
+	 * are removed and keys 4n are inserted again while the scan runs.
+	 */
+	for (op = 0, k = 0; k < 2; k++) {
+		while (ck_hs_next_spmc(&hs, &iterators[k], &key) == true) {
+			i = (unsigned long)((char (*)[16])key - keys);
+			if (i >= n_keys || seen[i]++ != 0)
+				ck_error("ERROR: snapshot observed key twice [%lu]\n", i);
+
+			j = (op++ * 4) % n_keys;
+			h = CK_HS_HASH(&hs, hs_hash_fnv, keys[j]);
+			ck_hs_put(&hs, h, keys[j]);
+
+			h = CK_HS_HASH(&hs, hs_hash_fnv, keys[j + 3]);
+			ck_hs_remove(&hs, h, keys[j + 3]);
+
+			/* Every replacement may relocate its key into a tombstone. */
+			for (j = 2; j < n_keys; j += 4) {
+				h = CK_HS_HASH(&hs, hs_hash_fnv, keys[j]);
+				if (ck_hs_set(&hs, h, keys[j], &previous) == false)
+					ck_error("ERROR: set must succeed [%lu]\n", j);
+			}
+
+			if (op == n_keys / 2)
+				ck_hs_gc(&hs, 0, 0);
+		}
+	}
+
+	ck_hs_snapshot_end(&hs, iterators);
+	hs_reclaim();
+
+	for (i = 0; i < n_keys; i++) {
+		if ((i & 3) != 1 && (i & 3) != 2)
+			continue;
+
+		if (seen[i] != 1)
+			ck_error("ERROR: snapshot missed key [%lu]\n", i);
+
+		h = CK_HS_HASH(&hs, hs_hash_fnv, keys[i]);
+		if (ck_hs_get(&hs, h, keys[i]) != keys[i])
+			ck_error("ERROR: get after snapshot [%lu]\n", i);
+	}
+
+	ck_hs_destroy(&hs);
+
+	if (ck_hs_init(&hs, CK_HS_MODE_MPMC | CK_HS_MODE_OBJECT, hs_hash_fnv,
+	    hs_compare, &my_allocator, 8, 6602834) == false)
+		ck_error("ERROR: ck_hs_init\n");
+
+	if (ck_hs_snapshot_begin(&hs, iterators, 2) == true)
+		ck_error("ERROR: snapshots are not supported with multiple writers\n");
+
+	ck_hs_destroy(&hs);
+	free(seen);
+	return;
+}
+
+static void *
+hs_apply_insert(void *existing, void *closure)
+{
+
+	return existing != NULL ? existing : closure;
+}
+
+static void *
+hs_apply_replace(void *existing, void *closure)
+{
+
+	return existing != NULL ? closure : NULL;
+}
+
+static void *
+hs_apply_remove(void *existing, void *closure)
+{
+
+	(void)existing;
+	(void)closure;
+	return NULL;
+}
+
+/*
+ * Apply must insert absent keys, return existing keys unmodified, replace
+ * keys with equal objects and remove keys, whether or not they have been
+ * migrated.
+ */
+static void
+run_test_apply(unsigned int mode)
+{
+	const unsigned long n_keys = 1000;
+	char (*copies)[16];
+	unsigned long h, i;
+	ck_hs_t hs;
+
+	copies = malloc(sizeof(*copies) * n_keys);
+	if (copies == NULL)
+		ck_error("ERROR: malloc\n");
+
+	for (i = 0; i < n_keys; i++)
+		memcpy(copies[i], keys[i], sizeof(keys[i]));
+
+	populate(&hs, mode, 0);
+
+	if (mode & CK_HS_MODE_MPMC) {
+		h = CK_HS_HASH(&hs, hs_hash_fnv, keys[0]);
+		if (ck_hs_apply(&hs, h, keys[0], hs_apply_insert, keys[0]) == true)
+			ck_error("ERROR: apply is not supported with multiple writers\n");
+
+		goto leave;
+	}
+
+	for (i = 0; i < n_keys * 2; i++) {
+		h = CK_HS_HASH(&hs, hs_hash_fnv, keys[i % n_keys]);
+		if (ck_hs_apply(&hs, h, keys[i % n_keys], hs_apply_insert, copies[i % n_keys]) == false)
+			ck_error("ERROR: apply must succeed [%lu]\n", i);
+	}
+
+	if (ck_hs_count(&hs) != n_keys)
+		ck_error("ERROR: apply inserted %lu keys\n", ck_hs_count(&hs));
+
+	for (i = 0; i < n_keys; i++) {
+		h = CK_HS_HASH(&hs, hs_hash_fnv, keys[i]);
+		if (ck_hs_get(&hs, h, keys[i]) != copies[i])
+			ck_error("ERROR: apply replaced existing key [%lu]\n", i);
+
+		if (ck_hs_apply(&hs, h, keys[i],
+		    (i & 1) ? hs_apply_replace : hs_apply_remove, keys[i]) == false)
+			ck_error("ERROR: apply must succeed [%lu]\n", i);
+	}
+
+	if (ck_hs_count(&hs) != n_keys / 2)
+		ck_error("ERROR: apply left %lu keys\n", ck_hs_count(&hs));
+
+	for (i = 0; i < n_keys; i++) {
+		h = CK_HS_HASH(&hs, hs_hash_fnv, keys[i]);
+		if (ck_hs_get(&hs, h, keys[i]) != ((i & 1) ? keys[i] : NULL))
+			ck_error("ERROR: get after apply [%lu]\n", i);
+
+		/* Removal of an absent key leaves the set unmodified. */
+		if (ck_hs_apply(&hs, h, keys[i], hs_apply_replace, copies[i]) == false)
+			ck_error("ERROR: apply must succeed [%lu]\n", i);
+	}
+
+	if (ck_hs_count(&hs) != n_keys / 2)
+		ck_error("ERROR: apply left %lu keys\n", ck_hs_count(&hs));
+
+leave:
+	ck_hs_destroy(&hs);
+	free(copies);
+	return;
+}
+
+/*
+ * Releases requested with the defer argument are held back until the end
+ * of the test, as a safe memory reclamation scheme would until readers
+ * are done.
+ */
+static struct {
+	void *p;
+	size_t size;
+} mmap_deferred[64];
+static unsigned int mmap_n_deferred;
+
+static void
+hs_mmap_free(void *p, size_t b, bool r)
+{
+
+	if (r == true) {
+		if (mmap_n_deferred == sizeof(mmap_deferred) / sizeof(*mmap_deferred))
+			ck_error("ERROR: too many deferred frees\n");
+
+		mmap_deferred[mmap_n_deferred].p = p;
+		mmap_deferred[mmap_n_deferred++].size = b;
+		return;
+	}
+
+	ck_malloc_mmap_free(p, b);
+	return;
+}
+
+/*
+ * Sets must be usable with the default allocator, whose maps are large
+ * enough here to be backed by huge pages where the system provides them.
+ */
+static void
+run_test_mmap(unsigned int mode)
+{
+	const unsigned long n_keys = N_KEYS;
+	struct ck_malloc m;
+	unsigned long h, i;
+	ck_hs_t hs;
+	void *p;
+
+	if (ck_malloc_mmap_init(&m, NULL) == true)
+		ck_error("ERROR: ck_malloc_mmap_init must require a free callback\n");
+
+	if (ck_malloc_mmap_init(&m, hs_mmap_free) == false)
+		ck_error("ERROR: ck_malloc_mmap_init\n");
+
+	p = m.aligned(100, 1UL << 16);
+	if (p == NULL || ((uintptr_t)p & ((1UL << 16) - 1)) != 0)
+		ck_error("ERROR: aligned allocation [%p]\n", p);
+
+	m.free(p, 100, false);
+
+	if (ck_hs_init(&hs, mode, hs_hash_fnv, hs_compare, &m, 8, 6602834) == false)
+		ck_error("ERROR: ck_hs_init\n");
+
+	insert(&hs, 0, n_keys);
+
+	for (i = 0; i < n_keys; i++) {
+		h = CK_HS_HASH(&hs, hs_hash_fnv, keys[i]);
+		if (ck_hs_get(&hs, h, keys[i]) != keys[i])
+			ck_error("ERROR: get must succeed [%lu]\n", i);
+	}
+
+	/* Replaced maps may still be read, so their release is deferred. */
+	if (mmap_n_deferred == 0)
+		ck_error("ERROR: growth must defer the release of maps\n");
+
+	ck_hs_destroy(&hs);
+	while (mmap_n_deferred > 0) {
+		mmap_n_deferred--;
+		ck_malloc_mmap_free(mmap_deferred[mmap_n_deferred].p,
+		    mmap_deferred[mmap_n_deferred].size);
+	}
+
+	return;
+}
+
+static void
+run_test(unsigned int mode)
 {
 	const char *blob = "blobs";
 	unsigned long h;
 	ck_hs_t hs;
 	size_t i;
 
-	if (ck_hs_init(&hs, CK_HS_MODE_SPMC | CK_HS_MODE_OBJECT, hs_hash, hs_compare, &my_allocator, 8, 6602834) == false) {
+	if (ck_hs_init(&hs, mode, hs_hash, hs_compare, &my_allocator, 8, 6602834) == false) {
 		perror("ck_hs_init");
 		exit(EXIT_FAILURE);
 	}
@@ -192,6 +1242,55 @@ main(void)
 		}
 	}
 
+	ck_hs_destroy(&hs);
+	return;
+}
+
+int
+main(void)
+{
+	unsigned int mode[] = {
+		CK_HS_MODE_SPMC | CK_HS_MODE_OBJECT,
+		CK_HS_MODE_SPMC | CK_HS_MODE_OBJECT | CK_HS_MODE_INCREMENTAL,
+		CK_HS_MODE_SPMC | CK_HS_MODE_OBJECT | CK_HS_MODE_TAG,
+		CK_HS_MODE_SPMC | CK_HS_MODE_OBJECT | CK_HS_MODE_TAG | CK_HS_MODE_INCREMENTAL,
+		CK_HS_MODE_MPMC | CK_HS_MODE_OBJECT,
+		CK_HS_MODE_MPMC | CK_HS_MODE_OBJECT | CK_HS_MODE_TAG,
+		CK_HS_MODE_SPMC | CK_HS_MODE_OBJECT | CK_HS_MODE_ROBIN_HOOD,
+		CK_HS_MODE_SPMC | CK_HS_MODE_OBJECT | CK_HS_MODE_ROBIN_HOOD | CK_HS_MODE_TAG,
+		CK_HS_MODE_SPMC | CK_HS_MODE_OBJECT | CK_HS_MODE_HASH,
+		CK_HS_MODE_SPMC | CK_HS_MODE_OBJECT | CK_HS_MODE_HASH | CK_HS_MODE_TAG | CK_HS_MODE_INCREMENTAL,
+		CK_HS_MODE_SPMC | CK_HS_MODE_OBJECT | CK_HS_MODE_HASH | CK_HS_MODE_ROBIN_HOOD
+	};
+	size_t i;
+
+	keys_init();
+	for (i = 0; i < sizeof(mode) / sizeof(*mode); i++) {
+		/* Multi-producer sets require keys with the low bit clear. */
+		if ((mode[i] & CK_HS_MODE_MPMC) == 0)
+			run_test(mode[i]);
+
+		deferring = (mode[i] & CK_HS_MODE_MPMC) != 0;
+		run_test_growth(mode[i]);
+		run_test_gc(mode[i]);
+		run_test_load(mode[i]);
+		run_test_stat(mode[i]);
+		run_test_generations(mode[i]);
+		run_test_partition(mode[i]);
+		run_test_apply(mode[i]);
+		hs_reclaim();
+
+		/* Concurrent writers may not be serialized with a rebuild. */
+		if ((mode[i] & CK_HS_MODE_MPMC) == 0) {
+			run_test_rebuild(mode[i]);
+			run_test_bloom(mode[i]);
+			run_test_snapshot(mode[i]);
+		}
+	}
+
+	run_test_mmap(CK_HS_MODE_SPMC | CK_HS_MODE_OBJECT | CK_HS_MODE_BLOOM);
+	run_test_prototype();
+	run_test_compact();
 	return 0;
 }
 
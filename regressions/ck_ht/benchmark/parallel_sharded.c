@@ -0,0 +1,203 @@
+/*
+ * Copyright 2012-2013 Samy Al Bahra.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <ck_ht.h>
+
+#ifdef CK_F_HT
+
+#include <assert.h>
+#include <ck_malloc.h>
+#include <ck_pr.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../../common.h"
+
+static ck_ht_sharded_t ht CK_CC_CACHELINE;
+static size_t keys_length;
+static unsigned int n_threads;
+static unsigned int rounds;
+static struct affinity affinerator = AFFINITY_INITIALIZER;
+static uint64_t accumulator;
+static int barrier;
+
+static void *
+ht_malloc(size_t r)
+{
+
+	return malloc(r);
+}
+
+/*
+ * There are no readers, so memory may be released immediately even if
+ * the hash table requests a deferred release.
+ */
+static void
+ht_free(void *p, size_t b, bool r)
+{
+
+	(void)b;
+	(void)r;
+	free(p);
+	return;
+}
+
+static struct ck_malloc my_allocator = {
+	.malloc = ht_malloc,
+	.free = ht_free
+};
+
+static void *
+ht_writer(void *arg)
+{
+	uintptr_t base = (uintptr_t)arg * keys_length + 1;
+	ck_ht_entry_t entry;
+	ck_ht_hash_t h;
+	uint64_t s, a = 0;
+	unsigned int j;
+	size_t i;
+
+	if (aff_iterate(&affinerator) != 0)
+		perror("WARNING: Failed to affine thread");
+
+	ck_pr_inc_int(&barrier);
+	while (ck_pr_load_int(&barrier) != (int)n_threads)
+		ck_pr_stall();
+
+	for (j = 0; j < rounds; j++) {
+		s = rdtsc();
+		for (i = 0; i < keys_length; i++) {
+			ck_ht_sharded_hash_direct(&h, &ht, base + i);
+			ck_ht_entry_set_direct(&entry, h, base + i, base + i);
+			if (ck_ht_sharded_put_mpmc(&ht, h, &entry) == false)
+				ck_error("ERROR: Failed to insert %zu\n", i);
+		}
+
+		for (i = 0; i < keys_length; i++) {
+			ck_ht_sharded_hash_direct(&h, &ht, base + i);
+			ck_ht_entry_set_direct(&entry, h, base + i, 6605241);
+			ck_ht_sharded_set_mpmc(&ht, h, &entry);
+		}
+
+		for (i = 0; i < keys_length; i++) {
+			ck_ht_sharded_hash_direct(&h, &ht, base + i);
+			ck_ht_entry_key_set_direct(&entry, base + i);
+			if (ck_ht_sharded_remove_mpmc(&ht, h, &entry) == false)
+				ck_error("ERROR: Failed to remove %zu\n", i);
+		}
+		a += rdtsc() - s;
+	}
+
+	ck_pr_add_64(&accumulator, a / (rounds * keys_length * 3));
+	return NULL;
+}
+
+static void
+run(unsigned int n_shards)
+{
+	pthread_t *writers;
+	unsigned int i;
+
+	if (ck_ht_sharded_init(&ht, CK_HT_MODE_DIRECT, NULL, &my_allocator,
+	    keys_length * n_threads * 2, common_lrand48(), n_shards) == false) {
+		perror("ck_ht_sharded_init");
+		exit(EXIT_FAILURE);
+	}
+
+	writers = malloc(sizeof(pthread_t) * n_threads);
+	assert(writers != NULL);
+
+	accumulator = 0;
+	barrier = 0;
+	for (i = 0; i < n_threads; i++) {
+		if (pthread_create(&writers[i], NULL, ht_writer,
+		    (void *)(uintptr_t)i) != 0) {
+			ck_error("ERROR: Failed to create thread %u.\n", i);
+		}
+	}
+
+	for (i = 0; i < n_threads; i++)
+		pthread_join(writers[i], NULL);
+
+	fprintf(stderr, " | %4u shards: %" PRIu64 " ticks per operation\n",
+	    ht.n_shards, accumulator / n_threads);
+
+	if (ck_ht_sharded_count(&ht) != 0)
+		ck_error("ERROR: Table is not empty.\n");
+
+	ck_ht_sharded_destroy(&ht);
+	free(writers);
+	return;
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned int n_shards;
+
+	if (argc < 2) {
+		ck_error("Usage: parallel_sharded <#entries per writer> "
+		    "[<writers> <shards> <rounds>]\n");
+	}
+
+	keys_length = (size_t)atoi(argv[1]);
+	n_threads = CORES;
+	n_shards = CORES * 4;
+	rounds = 16;
+
+	if (argc >= 3)
+		n_threads = atoi(argv[2]);
+
+	if (argc >= 4)
+		n_shards = atoi(argv[3]);
+
+	if (argc >= 5)
+		rounds = atoi(argv[4]);
+
+	if (keys_length == 0 || n_threads == 0 || n_shards == 0 || rounds == 0)
+		ck_error("ERROR: Arguments must be >= 1.\n");
+
+	affinerator.delta = 1;
+	common_srand48((long int)time(NULL));
+
+	fprintf(stderr, " ,- WRITER CONTENTION (%u writers)\n", n_threads);
+	run(1);
+	run(n_shards);
+	fprintf(stderr, " '-\n");
+	return 0;
+}
+#else
+int
+main(void)
+{
+
+	return 0;
+}
+#endif /* CK_F_HT */
@@ -30,6 +30,7 @@
 #include <assert.h>
 #include <ck_malloc.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -71,12 +72,16 @@ const char *negative = "negative";
 int
 main(void)
 {
-	size_t i, l;
+	size_t i, j, l;
 	ck_ht_t ht;
 	ck_ht_entry_t entry;
 	ck_ht_hash_t h;
 	ck_ht_iterator_t iterator = CK_HT_ITERATOR_INITIALIZER;
 	ck_ht_entry_t *cursor;
+	ck_ht_sharded_t sharded;
+	ck_ht_sharded_iterator_t sharded_iterator = CK_HT_SHARDED_ITERATOR_INITIALIZER;
+	struct ck_ht_stat sharded_stat;
+	unsigned int shard;
 
 	if (ck_ht_init(&ht, CK_HT_MODE_BYTESTRING, NULL, &my_allocator, 8, 6602834) == false) {
 		perror("ck_ht_init");
@@ -270,6 +275,430 @@ main(void)
 	}
 
 	ck_ht_destroy(&ht);
+
+	/*
+	 * A key that follows a tombstone in its probe sequence must not be
+	 * inserted a second time into the tombstone. Both keys share a hash
+	 * value so that they collide.
+	 */
+	if (ck_ht_init(&ht, CK_HT_MODE_DIRECT, NULL, &my_allocator, 8, 6602834) == false) {
+		perror("ck_ht_init");
+		exit(EXIT_FAILURE);
+	}
+
+	ck_ht_hash_direct(&h, &ht, 1);
+	for (i = 1; i <= 2; i++) {
+		ck_ht_entry_set_direct(&entry, h, i, i);
+		if (ck_ht_put_spmc(&ht, h, &entry) == false)
+			ck_error("ERROR: Failed to insert [%zu]\n", i);
+	}
+
+	ck_ht_entry_key_set_direct(&entry, 1);
+	if (ck_ht_remove_spmc(&ht, h, &entry) == false)
+		ck_error("ERROR: Failed to remove [1]\n");
+
+	ck_ht_entry_set_direct(&entry, h, 2, 2);
+	if (ck_ht_put_spmc(&ht, h, &entry) == true)
+		ck_error("ERROR: Inserted [2] after a tombstone a second time\n");
+
+	if (ck_ht_count(&ht) != 1)
+		ck_error("ERROR: Expected 1 entry, got %" PRIu64 "\n", ck_ht_count(&ht));
+
+	ck_ht_destroy(&ht);
+
+	/*
+	 * Iteration over a large and sparse table must observe exactly the
+	 * keys that remain after most of the table has been removed.
+	 */
+	if (ck_ht_init(&ht, CK_HT_MODE_DIRECT, NULL, &my_allocator, 8, 6602834) == false) {
+		perror("ck_ht_init");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 1; i <= 4096; i++) {
+		ck_ht_hash_direct(&h, &ht, i);
+		ck_ht_entry_set_direct(&entry, h, i, i);
+		if (ck_ht_put_spmc(&ht, h, &entry) == false)
+			ck_error("ERROR: Failed to insert [%zu]\n", i);
+	}
+
+	for (i = 1; i <= 4096; i++) {
+		if ((i % 512) == 0)
+			continue;
+
+		ck_ht_hash_direct(&h, &ht, i);
+		ck_ht_entry_key_set_direct(&entry, i);
+		if (ck_ht_remove_spmc(&ht, h, &entry) == false)
+			ck_error("ERROR: Failed to remove [%zu]\n", i);
+	}
+
+	l = 0;
+	ck_ht_iterator_init(&iterator);
+	while (ck_ht_next(&ht, &iterator, &cursor) == true) {
+		if ((ck_ht_entry_key_direct(cursor) % 512) != 0)
+			ck_error("ERROR: Iterated over removed key\n");
+
+		l++;
+	}
+
+	if (l != 8)
+		ck_error("ERROR: Iterated over %zu entries rather than 8\n", l);
+
+	/* Partitioned iterators must observe each remaining key exactly once. */
+	{
+		ck_ht_iterator_t iterators[3];
+		uint64_t seen = 0;
+		unsigned int k;
+
+		ck_ht_iterator_partition(&ht, iterators, 3);
+		for (l = 0, k = 0; k < 3; k++) {
+			while (ck_ht_next_spmc(&ht, &iterators[k], &entry) == true) {
+				i = ck_ht_entry_key_direct(&entry);
+				if ((i % 512) != 0 || ck_ht_entry_value_direct(&entry) != i ||
+				    (seen & (1ULL << (i / 512))) != 0)
+					ck_error("ERROR: Invalid partitioned entry [%zu]\n", i);
+
+				seen |= 1ULL << (i / 512);
+				l++;
+			}
+		}
+
+		if (l != 8)
+			ck_error("ERROR: Partitions observed %zu entries rather than 8\n", l);
+
+		if (ck_ht_iterator_stale(&ht, &iterators[0]) == true)
+			ck_error("ERROR: Scan without writers is stale\n");
+
+		ck_ht_hash_direct(&h, &ht, 512);
+		ck_ht_entry_key_set_direct(&entry, 512);
+		if (ck_ht_remove_spmc(&ht, h, &entry) == false)
+			ck_error("ERROR: Failed to remove [512]\n");
+
+		if (ck_ht_iterator_stale(&ht, &iterators[0]) == false)
+			ck_error("ERROR: Scan across removal must be stale\n");
+	}
+
+	ck_ht_destroy(&ht);
+
+	/*
+	 * Statistics must account for every insertion, growth and tombstone.
+	 */
+	if (ck_ht_init(&ht, CK_HT_MODE_DIRECT | CK_HT_MODE_STAT, NULL,
+	    &my_allocator, 8, 6602834) == false) {
+		perror("ck_ht_init");
+		exit(EXIT_FAILURE);
+	}
+
+	/* The counters of readers are on a cache line of their own. */
+	if ((uintptr_t)ht.counters & (CK_MD_CACHELINE - 1))
+		ck_error("ERROR: Counters are not aligned\n");
+
+	for (i = 1; i <= 1024; i++) {
+		ck_ht_hash_direct(&h, &ht, i);
+		ck_ht_entry_set_direct(&entry, h, i, i);
+		if (ck_ht_put_spmc(&ht, h, &entry) == false)
+			ck_error("ERROR: Failed to insert [%zu]\n", i);
+	}
+
+	for (i = 1; i <= 1024; i += 2) {
+		ck_ht_hash_direct(&h, &ht, i);
+		ck_ht_entry_key_set_direct(&entry, i);
+		if (ck_ht_remove_spmc(&ht, h, &entry) == false)
+			ck_error("ERROR: Failed to remove [%zu]\n", i);
+	}
+
+	{
+		struct ck_ht_stat st;
+		uint64_t n = 0;
+
+		ck_ht_stat(&ht, &st);
+		for (i = 0; i < CK_HT_STAT_PROBES; i++)
+			n += st.probes[i];
+
+		if (st.n_entries != 512 || st.tombstones != 512)
+			ck_error("ERROR: Expected 512 entries and tombstones, got %" PRIu64 " and %" PRIu64 "\n",
+			    st.n_entries, st.tombstones);
+
+#ifdef CK_F_PR_INC_64
+		if (n != 1024)
+			ck_error("ERROR: Expected 1024 probe samples, got %" PRIu64 "\n", n);
+
+		if (st.grows == 0 || st.grow_entries == 0)
+			ck_error("ERROR: Growth was not recorded\n");
+
+		if (st.retries != 0)
+			ck_error("ERROR: Serial lookups must not retry\n");
+#endif
+
+		for (i = 1; i <= 1024; i += 2) {
+			ck_ht_hash_direct(&h, &ht, i);
+			ck_ht_entry_set_direct(&entry, h, i, i);
+			if (ck_ht_put_spmc(&ht, h, &entry) == false)
+				ck_error("ERROR: Failed to re-insert [%zu]\n", i);
+		}
+
+		ck_ht_stat(&ht, &st);
+		if (st.n_entries != 1024 || st.tombstones > 512)
+			ck_error("ERROR: Tombstones were not re-used\n");
+	}
+
+	ck_ht_destroy(&ht);
+
+	/*
+	 * Every key must remain visible to lookups, updates, removals and
+	 * iterators while entries are incrementally migrated between maps.
+	 */
+	if (ck_ht_init(&ht, CK_HT_MODE_DIRECT | CK_HT_MODE_INCREMENTAL, NULL,
+	    &my_allocator, 8, 6602834) == false) {
+		perror("ck_ht_init");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 1; i <= 4096; i++) {
+		ck_ht_hash_direct(&h, &ht, i);
+		ck_ht_entry_set_direct(&entry, h, i, i);
+		if (ck_ht_put_spmc(&ht, h, &entry) == false)
+			ck_error("ERROR: Failed to insert [%zu]\n", i);
+
+		if ((i % 61) != 0)
+			continue;
+
+		for (j = 1; j <= i; j++) {
+			ck_ht_hash_direct(&h, &ht, j);
+			ck_ht_entry_key_set_direct(&entry, j);
+			if (ck_ht_get_spmc(&ht, h, &entry) == false ||
+			    ck_ht_entry_value_direct(&entry) != j)
+				ck_error("ERROR: Lost [%zu] after [%zu] insertions\n", j, i);
+		}
+
+		l = 0;
+		ck_ht_iterator_init(&iterator);
+		while (ck_ht_next(&ht, &iterator, &cursor) == true)
+			l += ck_ht_entry_key_direct(cursor);
+
+		if (l != i * (i + 1) / 2)
+			ck_error("ERROR: Iteration after [%zu] insertions\n", i);
+
+		{
+			ck_ht_iterator_t iterators[4];
+
+			l = 0;
+			ck_ht_iterator_partition(&ht, iterators, 4);
+			for (j = 0; j < 4; j++) {
+				while (ck_ht_next_spmc(&ht, &iterators[j], &entry) == true)
+					l += ck_ht_entry_key_direct(&entry);
+			}
+
+			if (l != i * (i + 1) / 2)
+				ck_error("ERROR: Partitioned iteration after [%zu] insertions\n", i);
+		}
+	}
+
+	for (i = 1; i <= 4096; i++) {
+		ck_ht_hash_direct(&h, &ht, i);
+		ck_ht_entry_set_direct(&entry, h, i, i);
+		if (ck_ht_put_spmc(&ht, h, &entry) == true)
+			ck_error("ERROR: Duplicate insertion of [%zu]\n", i);
+
+		if ((i % 3) == 0) {
+			ck_ht_entry_key_set_direct(&entry, i);
+			if (ck_ht_remove_spmc(&ht, h, &entry) == false ||
+			    ck_ht_entry_value_direct(&entry) != i)
+				ck_error("ERROR: Failed to remove [%zu]\n", i);
+		} else if (i & 1) {
+			ck_ht_entry_set_direct(&entry, h, i, i << 1);
+			if (ck_ht_set_spmc(&ht, h, &entry) == false ||
+			    ck_ht_entry_value_direct(&entry) != i)
+				ck_error("ERROR: Failed to replace [%zu]\n", i);
+		}
+	}
+
+	l = 0;
+	for (i = 1; i <= 4096; i++) {
+		ck_ht_hash_direct(&h, &ht, i);
+		ck_ht_entry_key_set_direct(&entry, i);
+		if (ck_ht_get_spmc(&ht, h, &entry) == false) {
+			if ((i % 3) != 0)
+				ck_error("ERROR: Lost [%zu]\n", i);
+
+			continue;
+		}
+
+		if ((i % 3) == 0 ||
+		    ck_ht_entry_value_direct(&entry) != ((i & 1) ? i << 1 : i))
+			ck_error("ERROR: Bad value for [%zu]\n", i);
+
+		l++;
+	}
+
+	if (ck_ht_count(&ht) != l)
+		ck_error("ERROR: Count %" PRIu64 " != %zu\n", ck_ht_count(&ht), l);
+
+	j = 0;
+	ck_ht_iterator_init(&iterator);
+	while (ck_ht_next(&ht, &iterator, &cursor) == true)
+		j += ck_ht_entry_key_direct(cursor);
+
+	if (j != ((size_t)4096 * 4097 / 2) - ((size_t)3 * 1365 * 1366 / 2))
+		ck_error("ERROR: Iteration did not visit every key exactly once\n");
+
+	ck_ht_destroy(&ht);
+
+	/*
+	 * Keys are owned by the table, so the buffer they are built in may be
+	 * re-used. Both inline and out-of-line keys must survive growth,
+	 * removal and re-use of tombstones.
+	 */
+	if (ck_ht_init(&ht, CK_HT_MODE_DIRECT | CK_HT_MODE_INLINE, NULL,
+	    &my_allocator, 8, 6602834) == true)
+		ck_error("ERROR: Inline keys require byte string mode\n");
+
+	if (ck_ht_init(&ht, CK_HT_MODE_BYTESTRING | CK_HT_MODE_INLINE |
+	    CK_HT_MODE_INCREMENTAL, NULL, &my_allocator, 8, 6602834) == false) {
+		perror("ck_ht_init");
+		exit(EXIT_FAILURE);
+	}
+
+	for (j = 0; j < 2; j++) {
+		for (i = 0; i < 2048; i++) {
+			char buffer[64];
+			int n;
+
+			n = sprintf(buffer, (i & 1) ?
+			    "a-long-identifier-that-does-not-fit-into-a-slot-%zu" :
+			    "%zu", i);
+			ck_ht_hash(&h, &ht, buffer, n);
+			ck_ht_entry_set(&entry, h, buffer, n, (void *)(i + 1));
+			if (j == 0 && ck_ht_put_spmc(&ht, h, &entry) == false)
+				ck_error("ERROR: Failed to insert [%s]\n", buffer);
+
+			/* Replace half of the keys, re-insert the others. */
+			if (j == 1 && (i % 4) < 2) {
+				if (ck_ht_set_spmc(&ht, h, &entry) == false ||
+				    ck_ht_entry_value(&entry) != (void *)(i + 1))
+					ck_error("ERROR: Failed to replace [%s]\n", buffer);
+			} else if (j == 1) {
+				if (ck_ht_remove_spmc(&ht, h, &entry) == false ||
+				    ck_ht_entry_key_length(&entry) != n)
+					ck_error("ERROR: Failed to remove [%s]\n", buffer);
+
+				ck_ht_entry_set(&entry, h, buffer, n, (void *)(i + 1));
+				if (ck_ht_put_spmc(&ht, h, &entry) == false)
+					ck_error("ERROR: Failed to re-insert [%s]\n", buffer);
+			}
+
+			memset(buffer, 'X', sizeof(buffer));
+		}
+	}
+
+	for (i = 0; i < 2048; i++) {
+		char buffer[64];
+		int n;
+
+		n = sprintf(buffer, (i & 1) ?
+		    "a-long-identifier-that-does-not-fit-into-a-slot-%zu" :
+		    "%zu", i);
+		ck_ht_hash(&h, &ht, buffer, n);
+		ck_ht_entry_key_set(&entry, buffer, n);
+		if (ck_ht_get_spmc(&ht, h, &entry) == false)
+			ck_error("ERROR: Lost [%s]\n", buffer);
+
+		if (ck_ht_entry_value(&entry) != (void *)(i + 1) ||
+		    ck_ht_entry_key(&entry) == buffer ||
+		    memcmp(ck_ht_entry_key(&entry), buffer, n) != 0)
+			ck_error("ERROR: Bad entry for [%s]\n", buffer);
+	}
+
+	if (ck_ht_count(&ht) != 2048)
+		ck_error("ERROR: Count %" PRIu64 " != 2048\n", ck_ht_count(&ht));
+
+	ck_ht_destroy(&ht);
+
+	/* The number of shards is rounded up to a power of two. */
+	if (ck_ht_sharded_init(&sharded, CK_HT_MODE_DIRECT, NULL, &my_allocator,
+	    64, 6602834, 6) == false) {
+		perror("ck_ht_sharded_init");
+		exit(EXIT_FAILURE);
+	}
+
+	if (sharded.n_shards != 8)
+		ck_error("ERROR: Expected 8 shards, got %u\n", sharded.n_shards);
+
+	/* The allocator does not align memory, so shards are aligned by hand. */
+	if ((uintptr_t)sharded.shards & (CK_MD_CACHELINE - 1))
+		ck_error("ERROR: Shards are not aligned to a cache line\n");
+
+	for (i = 1; i <= 4096; i++) {
+		ck_ht_sharded_hash_direct(&h, &sharded, i);
+		ck_ht_entry_set_direct(&entry, h, i, i);
+		if (ck_ht_sharded_put_mpmc(&sharded, h, &entry) == false)
+			ck_error("ERROR: Failed to insert %zu\n", i);
+
+		if (ck_ht_sharded_put_mpmc(&sharded, h, &entry) == true)
+			ck_error("ERROR: Inserted duplicate %zu\n", i);
+	}
+
+	/* Keys must be routed to every shard and only be found in theirs. */
+	for (shard = 0; shard < sharded.n_shards; shard++) {
+		if (ck_ht_count(&sharded.shards[shard].table) == 0)
+			ck_error("ERROR: Shard %u is empty\n", shard);
+	}
+
+	for (i = 1; i <= 4096; i++) {
+		ck_ht_sharded_hash_direct(&h, &sharded, i);
+		ck_ht_entry_key_set_direct(&entry, i);
+		if (ck_ht_sharded_get_mpmc(&sharded, h, &entry) == false ||
+		    ck_ht_entry_value_direct(&entry) != i)
+			ck_error("ERROR: Failed to find %zu\n", i);
+
+		for (shard = 0; shard < sharded.n_shards; shard++) {
+			if (&sharded.shards[shard] == ck_ht_sharded_shard(&sharded, h))
+				continue;
+
+			ck_ht_entry_key_set_direct(&entry, i);
+			if (ck_ht_get_spmc(&sharded.shards[shard].table, h, &entry) == true)
+				ck_error("ERROR: Found %zu in shard %u\n", i, shard);
+		}
+
+		/* Replace odd keys and remove even keys. */
+		if (i & 1) {
+			ck_ht_entry_set_direct(&entry, h, i, i << 1);
+			if (ck_ht_sharded_set_mpmc(&sharded, h, &entry) == false ||
+			    ck_ht_entry_value_direct(&entry) != i)
+				ck_error("ERROR: Failed to replace %zu\n", i);
+		} else {
+			ck_ht_entry_key_set_direct(&entry, i);
+			if (ck_ht_sharded_remove_mpmc(&sharded, h, &entry) == false)
+				ck_error("ERROR: Failed to remove %zu\n", i);
+		}
+	}
+
+	if (ck_ht_sharded_count(&sharded) != 2048)
+		ck_error("ERROR: Count %" PRIu64 " != 2048\n",
+		    ck_ht_sharded_count(&sharded));
+
+	ck_ht_sharded_stat(&sharded, &sharded_stat);
+	if (sharded_stat.n_entries != 2048)
+		ck_error("ERROR: Stat %" PRIu64 " != 2048\n", sharded_stat.n_entries);
+
+	j = l = 0;
+	while (ck_ht_sharded_next(&sharded, &sharded_iterator, &entry) == true) {
+		if (ck_ht_entry_value_direct(&entry) != ck_ht_entry_key_direct(&entry) << 1)
+			ck_error("ERROR: Bad value for %" PRIuPTR "\n",
+			    ck_ht_entry_key_direct(&entry));
+
+		j += ck_ht_entry_key_direct(&entry);
+		l++;
+	}
+
+	if (l != 2048 || j != (size_t)2048 * 2048)
+		ck_error("ERROR: Iteration visited %zu keys\n", l);
+
+	if (ck_ht_sharded_reset_mpmc(&sharded) == false ||
+	    ck_ht_sharded_count(&sharded) != 0)
+		ck_error("ERROR: Failed to reset\n");
+
+	ck_ht_sharded_destroy(&sharded);
 	return 0;
 }
 #else
@@ -135,7 +135,8 @@ ck_bag_put_spmc(struct ck_bag *bag, void *entry)
 			blocks_alloc = 1;
 
 		for (i = 0; i < blocks_alloc; i++) {
-			new_block = allocator.malloc(bag->info.bytes);
+			new_block = ck_malloc_hinted(&allocator, bag->info.bytes,
+			    CK_MD_CACHELINE, 0);
 
 			if (new_block == NULL)
 				return false;
@@ -275,7 +276,8 @@ found:
 	} else {
 		uintptr_t next_ptr;
 
-		copy = allocator.malloc(bag->info.bytes);
+		copy = ck_malloc_hinted(&allocator, bag->info.bytes,
+		    CK_MD_CACHELINE, 0);
 		if (copy == NULL)
 			return false;
 
@@ -311,7 +313,7 @@ found:
 		CK_LIST_INSERT_HEAD(&bag->avail_blocks, copy, avail_entry);
 	}
 
-	allocator.free(cursor, sizeof(struct ck_bag_block), true);
+	allocator.free(cursor, bag->info.bytes, true);
 	ck_pr_store_uint(&bag->n_entries, bag->n_entries - 1);
 	return true;
 }
@@ -27,8 +27,10 @@
 #include <ck_cc.h>
 #include <ck_hs.h>
 #include <ck_limits.h>
+#include <ck_malloc.h>
 #include <ck_md.h>
 #include <ck_pr.h>
+#include <ck_sequence.h>
 #include <ck_stdint.h>
 #include <stdbool.h>
 #include <string.h>
@@ -45,28 +47,281 @@
 
 #define CK_HS_EMPTY     NULL
 #define CK_HS_TOMBSTONE ((void *)~(uintptr_t)0)
+
+/* Number of probe groups summarized by a word of the occupancy bitmap. */
+#define CK_HS_OCCUPIED_BITS (sizeof(unsigned int) * CHAR_BIT)
+
+/*
+ * In CK_HS_MODE_MPMC, slots of a map that is being migrated are frozen
+ * before being copied. A frozen entry has its least significant bit set
+ * until it has been copied into the next map, at which point the slot
+ * transitions to CK_HS_MOVED. Free slots transition to CK_HS_MOVED_EMPTY
+ * which, like CK_HS_EMPTY, terminates probe sequences.
+ */
+#define CK_HS_FROZEN		((uintptr_t)1)
+#define CK_HS_MOVED		((void *)~(uintptr_t)1)
+#define CK_HS_MOVED_EMPTY	((void *)~(uintptr_t)2)
+
+/*
+ * Tag bytes are matched a probe group (one cache line of slots) at a
+ * time with a single word-wide comparison.
+ */
+#if defined(CK_F_PR_LOAD_64) && defined(CK_F_PR_STORE_8) && CK_HS_PROBE_L1 == 8
+#define CK_HS_TAG
+#endif
+/*
+ * Cached hash values are stored as one 64-bit word per slot.
+ */
+#if defined(CK_F_PR_LOAD_64) && defined(CK_F_PR_STORE_64)
+#define CK_HS_CACHE
+#endif
+
+/*
+ * Robin Hood displacements are stored as one byte per slot.
+ */
+#if defined(CK_F_PR_LOAD_8) && defined(CK_F_PR_STORE_8)
+#define CK_HS_RH
+#endif
+
+#define CK_HS_RH_LIMIT	UINT8_MAX
+
+/*
+ * Statistics are maintained as 64-bit counters shared by all threads.
+ */
+#if defined(CK_F_PR_INC_64) && defined(CK_F_PR_ADD_64) && \
+    defined(CK_F_PR_SUB_64) && defined(CK_F_PR_LOAD_64)
+#define CK_HS_COUNTERS
+#endif
+
+/*
+ * Negative lookup filters are blocked Bloom filters. All CK_HS_BLOOM_K
+ * bits of a hash value lie in a single cache line, and the filter holds
+ * CK_HS_BLOOM_RATIO bits for every slot of the map.
+ */
+#define CK_HS_BLOOM_WORDS (CK_MD_CACHELINE / sizeof(unsigned int))
+#define CK_HS_BLOOM_WORD_BITS (sizeof(unsigned int) * CHAR_BIT)
+#define CK_HS_BLOOM_BITS (CK_HS_BLOOM_WORDS * CK_HS_BLOOM_WORD_BITS)
+#define CK_HS_BLOOM_K 4
+#define CK_HS_BLOOM_RATIO 8
+
+/*
+ * Default and maximum number of generation counters of a map. Every
+ * counter occupies its own cache line, so that a writer bumping one
+ * counter does not invalidate the lines of readers validating another.
+ */
 #define CK_HS_G		(2)
-#define CK_HS_G_MASK	(CK_HS_G - 1)
+#define CK_HS_G_MAXIMUM	(1U << 16)
+#define CK_HS_G_STRIDE	(CK_MD_CACHELINE / sizeof(unsigned int))
+
+/*
+ * Number of slots claimed at a time by every thread of a parallel growth.
+ */
+#ifndef CK_HS_GROW_CHUNK
+#define CK_HS_GROW_CHUNK (CK_HS_PROBE_L1 << 9)
+#endif
+
+/*
+ * Default maximum occupancy, in percent, of a map before it is grown.
+ * Maps are not shrunk unless a minimum occupancy has been configured.
+ */
+#define CK_HS_LOAD_MAXIMUM_DEFAULT 50
+#define CK_HS_LOAD_MINIMUM_DEFAULT 0
+
+/*
+ * Number of slots of the previous map that are migrated by every write
+ * operation on a set in CK_HS_MODE_INCREMENTAL mode.
+ */
+#ifndef CK_HS_MIGRATE_DEFAULT
+#define CK_HS_MIGRATE_DEFAULT (CK_HS_PROBE_L1 << 3)
+#endif
+
+/*
+ * Entry counts and migration cursors that are updated by concurrent
+ * writers. They are 64-bit where the target provides 64-bit atomic
+ * operations, and as wide as an unsigned long otherwise.
+ */
+#if defined(CK_F_PR_FAA_64) && defined(CK_F_PR_INC_64) && \
+    defined(CK_F_PR_DEC_64) && defined(CK_F_PR_LOAD_64)
+typedef uint64_t ck_hs_word_t;
+#define ck_hs_word_faa(x, d)	ck_pr_faa_64(x, d)
+#define ck_hs_word_inc(x)	ck_pr_inc_64(x)
+#define ck_hs_word_dec(x)	ck_pr_dec_64(x)
+#define ck_hs_word_load(x)	ck_pr_load_64(x)
+#else
+typedef unsigned int ck_hs_word_t;
+#define ck_hs_word_faa(x, d)	ck_pr_faa_uint(x, d)
+#define ck_hs_word_inc(x)	ck_pr_inc_uint(x)
+#define ck_hs_word_dec(x)	ck_pr_dec_uint(x)
+#define ck_hs_word_load(x)	ck_pr_load_uint(x)
+#endif
+
+struct ck_hs_bloom {
+	unsigned long n_blocks;
+	unsigned long size;
+	unsigned int *words;
+};
 
 struct ck_hs_map {
-	unsigned int generation[CK_HS_G];
+	unsigned int *generation;
+	unsigned long generation_mask;
 	unsigned int probe_maximum;
 	unsigned long mask;
 	unsigned long step;
 	unsigned int probe_limit;
 	unsigned int tombstones;
-	unsigned long n_entries;
+	ck_hs_word_t n_entries;
 	unsigned long capacity;
 	unsigned long size;
+
+	/* Entry counts above and below which the map is resized. */
+	unsigned long maximum;
+	unsigned long minimum;
+
 	void **entries;
+
+	/*
+	 * If non-NULL, then a hash fragment is stored for every slot in
+	 * entries. Tags are only meaningful for occupied slots.
+	 */
+	uint8_t *tags;
+
+	/*
+	 * If non-NULL, then the full hash value of every occupied slot in
+	 * entries is stored here.
+	 */
+	uint64_t *hashes;
+
+	/*
+	 * If non-NULL, then the set is in CK_HS_MODE_ROBIN_HOOD mode and the
+	 * distance of every occupied slot from the home slot of its entry is
+	 * stored here. The sequence counter is odd while entries are shifted.
+	 */
+	uint8_t *distances;
+	ck_sequence_t sequence;
+
+	/*
+	 * One bit for every probe group of entries, which is clear only if
+	 * the group holds no entries. Iterators skip groups with a clear bit.
+	 */
+	unsigned int *occupied;
+
+	/*
+	 * If non-NULL, then entries are being migrated into this map. A
+	 * lookup that misses in this map must also probe the next map.
+	 * The next map is never unlinked during the lifetime of this map.
+	 */
+	struct ck_hs_map *next;
+
+	/* Offset of the next slot to be migrated into the next map. */
+	ck_hs_word_t cursor;
+
+	/* Number of slots migrated by concurrent writers in MPMC mode. */
+	ck_hs_word_t migrated;
+
+	/*
+	 * Seed that entries of the map are hashed with. Between a rebuild
+	 * and the following ck_hs_rebuild_end, lookups may be given hash
+	 * values derived from another seed, and maps are reseeded so that
+	 * a miss is confirmed with the seed of the map.
+	 */
+	unsigned long seed;
+	unsigned int reseeded;
+
+	/*
+	 * Negative lookup filter in CK_HS_MODE_BLOOM. Bits are never cleared,
+	 * so the filter is replaced once enough keys have been removed.
+	 */
+	struct ck_hs_bloom *bloom;
+	unsigned long bloom_stale;
+
+	/*
+	 * Number of snapshots that pin this map. Entries of a pinned map are
+	 * never relocated, so a snapshot observes every key exactly once.
+	 */
+	unsigned int snapshots;
+};
+
+struct ck_hs_counters {
+	/* Allocation that the counters are aligned within. */
+	void *memory;
+
+	uint64_t probes[CK_HS_STAT_PROBES];
+	uint64_t grows;
+	uint64_t grow_entries;
+	uint64_t allocated;
+
+	/* Updated by readers, so kept apart from the counters of writers. */
+	uint64_t retries CK_CC_CACHELINE;
 };
 
+static bool ck_hs_mpmc_grow(struct ck_hs *, unsigned long);
+
+/*
+ * The counters of readers are on a cache line of their own, so the
+ * counters are aligned by hand within a larger allocation.
+ */
+static struct ck_hs_counters *
+ck_hs_counters_create(struct ck_malloc *m)
+{
+	struct ck_hs_counters *counters;
+	void *memory;
+
+	memory = ck_malloc_hinted(m, sizeof(struct ck_hs_counters) +
+	    CK_MD_CACHELINE - 1, CK_MD_CACHELINE, 0);
+	if (memory == NULL)
+		return NULL;
+
+	counters = (void *)(((uintptr_t)memory + CK_MD_CACHELINE - 1) &
+	    ~(uintptr_t)(CK_MD_CACHELINE - 1));
+	memset(counters, 0, sizeof(struct ck_hs_counters));
+	counters->memory = memory;
+	return counters;
+}
+
+static void
+ck_hs_counters_destroy(struct ck_malloc *m, struct ck_hs_counters *counters)
+{
+
+	m->free(counters->memory, sizeof(struct ck_hs_counters) +
+	    CK_MD_CACHELINE - 1, false);
+	return;
+}
+
+/*
+ * Returns the first slot at or after offset whose probe group may hold
+ * entries, or the capacity of the map if there is none.
+ */
+static unsigned long
+ck_hs_map_scan(struct ck_hs_map *map, unsigned long offset)
+{
+	unsigned long group = offset >> CK_HS_PROBE_L1_SHIFT;
+	unsigned long w = group / CK_HS_OCCUPIED_BITS, slot;
+	unsigned long n = ((map->capacity + CK_HS_PROBE_L1 - 1) >> CK_HS_PROBE_L1_SHIFT);
+	unsigned int word;
+
+	n = (n + CK_HS_OCCUPIED_BITS - 1) / CK_HS_OCCUPIED_BITS;
+	word = ck_pr_load_uint(&map->occupied[w]) & (~0U << (group % CK_HS_OCCUPIED_BITS));
+
+	while (word == 0) {
+		if (++w == n)
+			return map->capacity;
+
+		word = ck_pr_load_uint(&map->occupied[w]);
+	}
+
+	slot = (w * CK_HS_OCCUPIED_BITS + ck_cc_ffs(word) - 1) << CK_HS_PROBE_L1_SHIFT;
+	return slot > offset ? slot : offset;
+}
+
 void
 ck_hs_iterator_init(struct ck_hs_iterator *iterator)
 {
 
 	iterator->cursor = NULL;
 	iterator->offset = 0;
+	iterator->map = NULL;
+	iterator->limit = 0;
+	iterator->version = 0;
 	return;
 }
 
@@ -74,248 +329,2777 @@ bool
 ck_hs_next(struct ck_hs *hs, struct ck_hs_iterator *i, void **key)
 {
 	struct ck_hs_map *map = hs->map;
+	unsigned long offset = i->offset;
 	void *value;
 
-	if (i->offset >= map->capacity)
-		return false;
+	/*
+	 * If a migration is in progress, then the iteration space spans
+	 * the slots of the current map followed by those of the next map.
+	 */
+	if (offset >= map->capacity) {
+		if (map->next == NULL)
+			return false;
+
+		offset -= map->capacity;
+		map = map->next;
+	}
+
+	for (;;) {
+		while (offset < map->capacity) {
+			/* Skip over probe groups that hold no entries. */
+			if ((offset & CK_HS_PROBE_L1_MASK) == 0) {
+				unsigned long skip = ck_hs_map_scan(map, offset) - offset;
+
+				i->offset += skip;
+				offset += skip;
+				if (offset == map->capacity)
+					break;
+			}
+
+			value = map->entries[offset];
+			i->offset++;
+			offset++;
+
+			if (value != CK_HS_EMPTY && value != CK_HS_TOMBSTONE) {
+				if (hs->mode & CK_HS_MODE_MPMC) {
+					if (value == CK_HS_MOVED || value == CK_HS_MOVED_EMPTY)
+						continue;
+
+					value = (void *)((uintptr_t)value & ~CK_HS_FROZEN);
+				}
 
-	do {
-		value = map->entries[i->offset];
-		if (value != CK_HS_EMPTY && value != CK_HS_TOMBSTONE) {
 #ifdef CK_HS_PP
-			if (hs->mode & CK_HS_MODE_OBJECT)
-				value = (void *)((uintptr_t)value & (((uintptr_t)1 << CK_MD_VMA_BITS) - 1));
+				if (hs->mode & CK_HS_MODE_OBJECT)
+					value = (void *)((uintptr_t)value & (((uintptr_t)1 << CK_MD_VMA_BITS) - 1));
 #endif
-			i->offset++;
-			*key = value;
-			return true;
+				*key = value;
+				return true;
+			}
 		}
-	} while (++i->offset < map->capacity);
 
-	return false;
-}
+		if (map != hs->map || map->next == NULL)
+			break;
 
-void
-ck_hs_stat(struct ck_hs *hs, struct ck_hs_stat *st)
-{
-	struct ck_hs_map *map = hs->map;
+		map = map->next;
+		offset = 0;
+	}
 
-	st->n_entries = map->n_entries;
-	st->tombstones = map->tombstones;
-	st->probe_maximum = map->probe_maximum;
-	return;
+	return false;
 }
 
-unsigned long
-ck_hs_count(struct ck_hs *hs)
+/*
+ * Returns a value that changes whenever entries of a map, or of the map it
+ * is being migrated into, may have been relocated.
+ */
+static unsigned long
+ck_hs_map_version(struct ck_hs_map *map)
 {
+	struct ck_hs_map *next;
+	unsigned long version, i;
 
-	return hs->map->n_entries;
-}
+	for (version = 0; map != NULL; map = next) {
+		next = ck_pr_load_ptr(&map->next);
+		version += (uintptr_t)next;
+		version += (unsigned long)ck_hs_word_load(&map->cursor);
+		version += ck_pr_load_uint(&map->sequence.sequence);
 
-static void
-ck_hs_map_destroy(struct ck_malloc *m, struct ck_hs_map *map, bool defer)
-{
+		for (i = 0; i <= map->generation_mask; i++)
+			version += ck_pr_load_uint(&map->generation[i * CK_HS_G_STRIDE]);
+	}
 
-	m->free(map, map->size, defer);
-	return;
+	return version;
 }
 
 void
-ck_hs_destroy(struct ck_hs *hs)
+ck_hs_iterator_partition(struct ck_hs *hs, struct ck_hs_iterator *iterators, unsigned int n)
 {
+	struct ck_hs_map *map, *next;
+	unsigned long version, slots, k;
+
+	/* The version is read first, so that a racing update marks it stale. */
+	map = ck_pr_load_ptr(&hs->map);
+	version = ck_hs_map_version(map);
+	ck_pr_fence_load();
+
+	next = ck_pr_load_ptr(&map->next);
+	slots = map->capacity + (next != NULL ? next->capacity : 0);
+
+	/* Ranges are aligned to probe groups so that each may skip groups. */
+	for (k = 0; k < n; k++) {
+		iterators[k].cursor = NULL;
+		iterators[k].offset = k == 0 ? 0 : iterators[k - 1].limit;
+		iterators[k].limit = k + 1 == n ? slots :
+		    (slots * (k + 1) / n) & ~(unsigned long)CK_HS_PROBE_L1_MASK;
+		iterators[k].map = map;
+		iterators[k].version = version;
+	}
 
-	ck_hs_map_destroy(hs->m, hs->map, false);
 	return;
 }
 
-static struct ck_hs_map *
-ck_hs_map_create(struct ck_hs *hs, unsigned long entries)
+bool
+ck_hs_next_spmc(struct ck_hs *hs, struct ck_hs_iterator *i, void **key)
 {
 	struct ck_hs_map *map;
-	unsigned long size, n_entries, limit;
+	unsigned long offset;
+	void *value;
 
-	n_entries = ck_internal_power_2(entries);
-	size = sizeof(struct ck_hs_map) + (sizeof(void *) * n_entries + CK_MD_CACHELINE - 1);
+	if (i->map == NULL)
+		ck_hs_iterator_partition(hs, i, 1);
 
-	map = hs->m->malloc(size);
-	if (map == NULL)
-		return NULL;
+	while (i->offset < i->limit) {
+		/* Slots beyond the current map belong to the map being migrated into. */
+		map = i->map;
+		offset = i->offset;
+		if (offset >= map->capacity) {
+			offset -= map->capacity;
+			map = ck_pr_load_ptr(&map->next);
+		}
 
-	map->size = size;
+		if ((offset & CK_HS_PROBE_L1_MASK) == 0) {
+			unsigned long skip = ck_hs_map_scan(map, offset) - offset;
 
-	/* We should probably use a more intelligent heuristic for default probe length. */
-	limit = ck_internal_max(n_entries >> (CK_HS_PROBE_L1_SHIFT + 2), CK_HS_PROBE_L1_DEFAULT);
-	if (limit > UINT_MAX)
-		limit = UINT_MAX;
+			if (skip != 0) {
+				i->offset += skip;
+				if (i->offset > i->limit)
+					i->offset = i->limit;
 
-	map->probe_limit = (unsigned int)limit;
-	map->probe_maximum = 0;
-	map->capacity = n_entries;
-	map->step = ck_internal_bsf(n_entries);
-	map->mask = n_entries - 1;
-	map->n_entries = 0;
+				continue;
+			}
+		}
 
-	/* Align map allocation to cache line. */
-	map->entries = (void *)(((uintptr_t)(map + 1) + CK_MD_CACHELINE - 1) & ~(CK_MD_CACHELINE - 1));
-	memset(map->entries, 0, sizeof(void *) * n_entries);
-	memset(map->generation, 0, sizeof map->generation);
+		value = ck_pr_load_ptr(&map->entries[offset]);
+		i->offset++;
 
-	/* Commit entries purge with respect to map publication. */
-	ck_pr_fence_store();
-	return map;
+		if (value == CK_HS_EMPTY || value == CK_HS_TOMBSTONE)
+			continue;
+
+		if (hs->mode & CK_HS_MODE_MPMC) {
+			if (value == CK_HS_MOVED || value == CK_HS_MOVED_EMPTY)
+				continue;
+
+			value = (void *)((uintptr_t)value & ~CK_HS_FROZEN);
+		}
+
+#ifdef CK_HS_PP
+		if (hs->mode & CK_HS_MODE_OBJECT)
+			value = (void *)((uintptr_t)value & (((uintptr_t)1 << CK_MD_VMA_BITS) - 1));
+#endif
+		*key = value;
+		return true;
+	}
+
+	return false;
 }
 
 bool
-ck_hs_reset_size(struct ck_hs *hs, unsigned long capacity)
+ck_hs_iterator_stale(struct ck_hs *hs, struct ck_hs_iterator *i)
 {
-	struct ck_hs_map *map, *previous;
 
-	previous = hs->map;
-	map = ck_hs_map_create(hs, capacity);
-	if (map == NULL)
+	if (i->map == NULL)
 		return false;
 
-	ck_pr_store_ptr(&hs->map, map);
-	ck_hs_map_destroy(hs->m, previous, true);
-	return true;
+	ck_pr_fence_load();
+	return ck_pr_load_ptr(&hs->map) != i->map ||
+	    ck_hs_map_version(i->map) != i->version;
 }
 
+/*
+ * A snapshot pins the current map, and any map it is being migrated into,
+ * until ck_hs_snapshot_end. Writers do not relocate the entries of pinned
+ * maps: replacements are made in place, migration is suspended, and Robin
+ * Hood sets shift entries in a copy of the map.
+ */
 bool
-ck_hs_reset(struct ck_hs *hs)
+ck_hs_snapshot_begin(struct ck_hs *hs, struct ck_hs_iterator *iterators, unsigned int n)
 {
-	struct ck_hs_map *previous;
+	struct ck_hs_map *map = hs->map;
 
-	previous = hs->map;
-	return ck_hs_reset_size(hs, previous->capacity);
+	if (hs->mode & CK_HS_MODE_MPMC)
+		return false;
+
+	ck_pr_inc_uint(&map->snapshots);
+	if (map->next != NULL)
+		ck_pr_inc_uint(&map->next->snapshots);
+
+	ck_pr_fence_store();
+	ck_hs_iterator_partition(hs, iterators, n);
+	return true;
 }
 
-static inline unsigned long
-ck_hs_map_probe_next(struct ck_hs_map *map,
-    unsigned long offset,
-    unsigned long h,
-    unsigned long level,
-    unsigned long probes)
+void
+ck_hs_snapshot_end(struct ck_hs *hs, struct ck_hs_iterator *iterators)
 {
-	unsigned long r;
-	unsigned long stride;
+	struct ck_hs_map *map = iterators->map;
 
-	(void)probes;
-	(void)level;
+	(void)hs;
 
-	r = h >> map->step;
-	stride = (r & ~CK_HS_PROBE_L1_MASK) << 1 | (r & CK_HS_PROBE_L1_MASK);
+	/* Migration into a new map never begins while a map is pinned. */
+	if (map->next != NULL)
+		ck_pr_dec_uint(&map->next->snapshots);
 
-	return (offset + (stride | CK_HS_PROBE_L1)) & map->mask;
+	ck_pr_dec_uint(&map->snapshots);
+	return;
 }
 
-bool
-ck_hs_grow(struct ck_hs *hs,
-    unsigned long capacity)
+unsigned long
+ck_hs_count(struct ck_hs *hs)
 {
-	struct ck_hs_map *map, *update;
-	void **bucket, *previous;
-	unsigned long k, i, j, offset, probes;
+	struct ck_hs_map *map = hs->map;
 
-restart:
-	map = hs->map;
+	if (map->next != NULL)
+		return map->n_entries + map->next->n_entries;
 
-	if (map->capacity > capacity)
-		return false;
+	return map->n_entries;
+}
 
-	update = ck_hs_map_create(hs, capacity);
-	if (update == NULL)
-		return false;
+static struct ck_hs_bloom *
+ck_hs_bloom_create(struct ck_hs *hs, unsigned long capacity)
+{
+	struct ck_hs_bloom *bloom;
+	unsigned long n_blocks, size;
 
-	for (k = 0; k < map->capacity; k++) {
-		unsigned long h;
+	n_blocks = (capacity * CK_HS_BLOOM_RATIO) / CK_HS_BLOOM_BITS;
+	if (n_blocks == 0)
+		n_blocks = 1;
 
-		previous = map->entries[k];
-		if (previous == CK_HS_EMPTY || previous == CK_HS_TOMBSTONE)
-			continue;
+	size = sizeof(struct ck_hs_bloom) + CK_MD_CACHELINE - 1 +
+	    n_blocks * CK_MD_CACHELINE;
 
-#ifdef CK_HS_PP
-		if (hs->mode & CK_HS_MODE_OBJECT)
-			previous = (void *)((uintptr_t)previous & (((uintptr_t)1 << CK_MD_VMA_BITS) - 1));
+	bloom = ck_malloc_hinted(hs->m, size, CK_MD_CACHELINE, CK_MALLOC_HINT_RANDOM);
+	if (bloom == NULL)
+		return NULL;
+
+#ifdef CK_HS_COUNTERS
+	if (hs->counters != NULL)
+		ck_pr_add_64(&hs->counters->allocated, size);
 #endif
 
-		h = hs->hf(previous, hs->seed);
-		offset = h & update->mask;
-		i = probes = 0;
+	bloom->n_blocks = n_blocks;
+	bloom->size = size;
+	bloom->words = (void *)(((uintptr_t)(bloom + 1) + CK_MD_CACHELINE - 1) &
+	    ~(uintptr_t)(CK_MD_CACHELINE - 1));
+	memset(bloom->words, 0, n_blocks * CK_MD_CACHELINE);
+	return bloom;
+}
 
-		for (;;) {
-			bucket = (void *)((uintptr_t)&update->entries[offset] & ~(CK_MD_CACHELINE - 1));
+static void
+ck_hs_bloom_destroy(struct ck_hs *hs, struct ck_hs_bloom *bloom, bool defer)
+{
 
-			for (j = 0; j < CK_HS_PROBE_L1; j++) {
-				void **cursor = bucket + ((j + offset) & (CK_HS_PROBE_L1 - 1));
+#ifdef CK_HS_COUNTERS
+	if (hs->counters != NULL)
+		ck_pr_sub_64(&hs->counters->allocated, bloom->size);
+#endif
 
-				if (probes++ == update->probe_limit)
-					break;
+	hs->m->free(bloom, bloom->size, defer);
+	return;
+}
 
-				if (CK_CC_LIKELY(*cursor == CK_HS_EMPTY)) {
-					*cursor = map->entries[k];
-					update->n_entries++;
+/*
+ * Returns the block of the filter covering a hash value, along with the
+ * bits from which the positions of its bits in the block are taken.
+ */
+static inline unsigned int *
+ck_hs_bloom_block(const struct ck_hs_bloom *bloom, unsigned long h, uint64_t *bits)
+{
+	uint64_t x = (uint64_t)h * 0x9e3779b97f4a7c15ULL;
 
-					if (probes > update->probe_maximum)
-						update->probe_maximum = probes;
+	*bits = x * 0xbf58476d1ce4e5b9ULL;
+	return bloom->words + ((x >> 32) * bloom->n_blocks >> 32) * CK_HS_BLOOM_WORDS;
+}
 
-					break;
-				}
-			}
+/*
+ * Adds a hash value to a filter. Returns true if any bit was set, in which
+ * case the bits must be made visible before the key they cover.
+ */
+static bool
+ck_hs_bloom_add(struct ck_hs_bloom *bloom, unsigned long h)
+{
+	unsigned int *block, *word, mask;
+	unsigned long bit;
+	uint64_t bits;
+	bool update = false;
+	int i;
 
-			if (j < CK_HS_PROBE_L1)
-				break;
+	if (bloom == NULL)
+		return false;
 
-			offset = ck_hs_map_probe_next(update, offset, h, i++, probes);
-		}
+	block = ck_hs_bloom_block(bloom, h, &bits);
+	for (i = 0; i < CK_HS_BLOOM_K; i++, bits >>= 16) {
+		bit = (unsigned long)bits & (CK_HS_BLOOM_BITS - 1);
+		word = &block[bit / CK_HS_BLOOM_WORD_BITS];
+		mask = 1U << (bit % CK_HS_BLOOM_WORD_BITS);
 
-		if (probes > update->probe_limit) {
-			/*
-			 * We have hit the probe limit, map needs to be even larger.
-			 */
-			ck_hs_map_destroy(hs->m, update, false);
-			capacity <<= 1;
-			goto restart;
+		/* Parallel growth may add to the same word concurrently. */
+		if ((ck_pr_load_uint(word) & mask) == 0) {
+			ck_pr_or_uint(word, mask);
+			update = true;
 		}
 	}
 
-	ck_pr_fence_store();
-	ck_pr_store_ptr(&hs->map, update);
-	ck_hs_map_destroy(hs->m, map, true);
-	return true;
+	return update;
 }
 
-static void **
-ck_hs_map_probe(struct ck_hs *hs,
-    struct ck_hs_map *map,
-    unsigned long *n_probes,
-    void ***priority,
-    unsigned long h,
-    const void *key,
-    void **object,
-    unsigned long probe_limit)
+/*
+ * Returns false if no key of the specified hash value is in the map.
+ */
+static inline bool
+ck_hs_bloom_member(struct ck_hs_map *map, unsigned long h)
 {
-	void **bucket, **cursor, *k;
-	const void *compare;
-	void **pr = NULL;
+	struct ck_hs_bloom *bloom;
+	unsigned int *block;
+	unsigned long bit;
+	uint64_t bits;
+	int i;
+
+	bloom = ck_pr_load_ptr(&map->bloom);
+	if (bloom == NULL)
+		return true;
+
+	ck_pr_fence_load_depends();
+	block = ck_hs_bloom_block(bloom, h, &bits);
+	for (i = 0; i < CK_HS_BLOOM_K; i++, bits >>= 16) {
+		bit = (unsigned long)bits & (CK_HS_BLOOM_BITS - 1);
+		if ((ck_pr_load_uint(&block[bit / CK_HS_BLOOM_WORD_BITS]) &
+		    (1U << (bit % CK_HS_BLOOM_WORD_BITS))) == 0)
+			return false;
+	}
+
+	return true;
+}
+
+static void
+ck_hs_map_destroy(struct ck_hs *hs, struct ck_hs_map *map, bool defer)
+{
+
+	if (map->bloom != NULL)
+		ck_hs_bloom_destroy(hs, map->bloom, defer);
+
+#ifdef CK_HS_COUNTERS
+	if (hs->counters != NULL)
+		ck_pr_sub_64(&hs->counters->allocated, map->size);
+#endif
+
+	hs->m->free(map, map->size, defer);
+	return;
+}
+
+void
+ck_hs_destroy(struct ck_hs *hs)
+{
+
+	if (hs->map->next != NULL)
+		ck_hs_map_destroy(hs, hs->map->next, false);
+
+	ck_hs_map_destroy(hs, hs->map, false);
+
+	if (hs->counters != NULL)
+		ck_hs_counters_destroy(hs->m, hs->counters);
+
+	return;
+}
+
+/*
+ * Records the probe length of an insertion.
+ */
+static inline void
+ck_hs_counter_probe(struct ck_hs *hs, unsigned long n_probes)
+{
+#ifdef CK_HS_COUNTERS
+	unsigned int i = 0;
+
+	if (hs->counters == NULL)
+		return;
+
+	while ((n_probes >>= 1) != 0 && i < CK_HS_STAT_PROBES - 1)
+		i++;
+
+	ck_pr_inc_64(&hs->counters->probes[i]);
+#else
+	(void)hs;
+	(void)n_probes;
+#endif
+	return;
+}
+
+/*
+ * Records a lookup that was restarted due to a concurrent write.
+ */
+static inline void
+ck_hs_counter_retry(struct ck_hs *hs)
+{
+#ifdef CK_HS_COUNTERS
+	if (hs->counters != NULL)
+		ck_pr_inc_64(&hs->counters->retries);
+#else
+	(void)hs;
+#endif
+	return;
+}
+
+/*
+ * Records a growth of the set that migrates the specified number of entries.
+ */
+static inline void
+ck_hs_counter_grow(struct ck_hs *hs, unsigned long n_entries)
+{
+#ifdef CK_HS_COUNTERS
+	if (hs->counters == NULL)
+		return;
+
+	ck_pr_inc_64(&hs->counters->grows);
+	ck_pr_add_64(&hs->counters->grow_entries, n_entries);
+#else
+	(void)hs;
+	(void)n_entries;
+#endif
+	return;
+}
+
+void
+ck_hs_stat(struct ck_hs *hs, struct ck_hs_stat *st)
+{
+	struct ck_hs_map *map = hs->map;
+	unsigned int i;
+
+	st->n_entries = map->n_entries;
+	st->tombstones = map->tombstones;
+	st->probe_maximum = map->probe_maximum;
+
+	if (map->next != NULL) {
+		st->n_entries += map->next->n_entries;
+		st->tombstones += map->next->tombstones;
+		if (map->next->probe_maximum > st->probe_maximum)
+			st->probe_maximum = map->next->probe_maximum;
+	}
+
+	memset(st->probes, 0, sizeof st->probes);
+	st->retries = st->grows = st->grow_entries = st->allocated = 0;
+
+#ifdef CK_HS_COUNTERS
+	if (hs->counters == NULL)
+		return;
+
+	for (i = 0; i < CK_HS_STAT_PROBES; i++)
+		st->probes[i] = ck_pr_load_64(&hs->counters->probes[i]);
+
+	st->retries = ck_pr_load_64(&hs->counters->retries);
+	st->grows = ck_pr_load_64(&hs->counters->grows);
+	st->grow_entries = ck_pr_load_64(&hs->counters->grow_entries);
+	st->allocated = ck_pr_load_64(&hs->counters->allocated);
+#else
+	(void)i;
+#endif
+	return;
+}
+
+/*
+ * Returns the specified percentage of capacity without overflowing.
+ */
+static unsigned long
+ck_hs_map_threshold(unsigned long capacity, unsigned int percent)
+{
+
+	return capacity / 100 * percent + capacity % 100 * percent / 100;
+}
+
+static void
+ck_hs_map_load(struct ck_hs *hs, struct ck_hs_map *map)
+{
+
+	map->maximum = ck_hs_map_threshold(map->capacity, hs->load_maximum);
+	map->minimum = ck_hs_map_threshold(map->capacity, hs->load_minimum);
+	return;
+}
+
+static struct ck_hs_map *
+ck_hs_map_create(struct ck_hs *hs, unsigned long entries)
+{
+	struct ck_hs_map *map;
+	unsigned long size, n_entries, limit, n_tags = 0, n_hashes = 0;
+	unsigned long n_distances = 0, n_occupied, n_generations;
+	uint8_t *end;
+
+	n_entries = ck_internal_power_2(entries);
+	size = sizeof(struct ck_hs_map) + (sizeof(void *) * n_entries + CK_MD_CACHELINE - 1);
+
+#ifdef CK_HS_TAG
+	if (hs->mode & CK_HS_MODE_TAG)
+		n_tags = ck_internal_max(n_entries, CK_HS_PROBE_L1);
+#endif
+
+#ifdef CK_HS_CACHE
+	if (hs->mode & CK_HS_MODE_HASH)
+		n_hashes = n_entries;
+#endif
+
+	if (hs->mode & CK_HS_MODE_ROBIN_HOOD)
+		n_distances = n_entries;
+
+	n_occupied = ((n_entries + CK_HS_PROBE_L1 - 1) >> CK_HS_PROBE_L1_SHIFT);
+	n_occupied = (n_occupied + CK_HS_OCCUPIED_BITS - 1) / CK_HS_OCCUPIED_BITS;
+
+	size += sizeof(uint64_t) * n_hashes;
+	size += sizeof(uint8_t) * n_tags;
+	size += sizeof(uint8_t) * n_distances;
+	size += sizeof(unsigned int) * n_occupied + sizeof(unsigned int) - 1;
+
+	n_generations = hs->generations;
+	size += sizeof(unsigned int) * CK_HS_G_STRIDE * n_generations + CK_MD_CACHELINE - 1;
+
+	map = ck_malloc_hinted(hs->m, size, CK_MD_CACHELINE,
+	    CK_MALLOC_HINT_RANDOM | CK_MALLOC_HINT_SHARED);
+	if (map == NULL)
+		return NULL;
+
+#ifdef CK_HS_COUNTERS
+	if (hs->counters != NULL)
+		ck_pr_add_64(&hs->counters->allocated, size);
+#endif
+
+	map->size = size;
+
+	/* We should probably use a more intelligent heuristic for default probe length. */
+	limit = ck_internal_max(n_entries >> (CK_HS_PROBE_L1_SHIFT + 2), CK_HS_PROBE_L1_DEFAULT);
+	if (limit > UINT_MAX)
+		limit = UINT_MAX;
+
+	map->probe_limit = (unsigned int)limit;
+	map->probe_maximum = 0;
+	map->capacity = n_entries;
+	map->step = ck_internal_bsf(n_entries);
+	map->mask = n_entries - 1;
+	map->n_entries = 0;
+	map->tombstones = 0;
+	map->next = NULL;
+	ck_hs_map_load(hs, map);
+	map->cursor = 0;
+	map->migrated = 0;
+	map->seed = hs->seed;
+	map->reseeded = hs->reseeded;
+	map->bloom_stale = 0;
+	map->snapshots = 0;
+
+	map->bloom = NULL;
+	if (hs->mode & CK_HS_MODE_BLOOM) {
+		map->bloom = ck_hs_bloom_create(hs, n_entries);
+		if (map->bloom == NULL) {
+			ck_hs_map_destroy(hs, map, false);
+			return NULL;
+		}
+	}
+
+	/* Align map allocation to cache line. */
+	map->entries = (void *)(((uintptr_t)(map + 1) + CK_MD_CACHELINE - 1) & ~(CK_MD_CACHELINE - 1));
+	memset(map->entries, 0, sizeof(void *) * n_entries);
+
+	map->hashes = NULL;
+	if (n_hashes != 0)
+		map->hashes = (uint64_t *)(void *)(map->entries + n_entries);
+
+	map->tags = NULL;
+	if (n_tags != 0) {
+		map->tags = (uint8_t *)(map->entries + n_entries) +
+		    sizeof(uint64_t) * n_hashes;
+		memset(map->tags, 0, sizeof(uint8_t) * n_tags);
+	}
+
+	map->distances = NULL;
+	if (n_distances != 0) {
+		map->distances = (uint8_t *)(map->entries + n_entries) +
+		    sizeof(uint64_t) * n_hashes + n_tags;
+		memset(map->distances, 0, sizeof(uint8_t) * n_distances);
+	}
+
+	end = (uint8_t *)(map->entries + n_entries) +
+	    sizeof(uint64_t) * n_hashes + n_tags + n_distances;
+	map->occupied = (unsigned int *)(((uintptr_t)end + sizeof(unsigned int) - 1) &
+	    ~(uintptr_t)(sizeof(unsigned int) - 1));
+	memset(map->occupied, 0, sizeof(unsigned int) * n_occupied);
+
+	end = (uint8_t *)(map->occupied + n_occupied);
+	map->generation = (unsigned int *)(((uintptr_t)end + CK_MD_CACHELINE - 1) &
+	    ~(uintptr_t)(CK_MD_CACHELINE - 1));
+	map->generation_mask = n_generations - 1;
+	memset(map->generation, 0, sizeof(unsigned int) * CK_HS_G_STRIDE * n_generations);
+
+	ck_sequence_init(&map->sequence);
+
+	/* Commit entries purge with respect to map publication. */
+	ck_pr_fence_store();
+	return map;
+}
+
+/*
+ * Returns the generation counter covering the probe sequence of a hash value.
+ */
+static inline unsigned int *
+ck_hs_map_generation(struct ck_hs_map *map, unsigned long h)
+{
+
+	return &map->generation[(h & map->generation_mask) * CK_HS_G_STRIDE];
+}
+
+static inline bool
+ck_hs_map_pinned(struct ck_hs_map *map)
+{
+
+	return ck_pr_load_uint(&map->snapshots) != 0;
+}
+
+/*
+ * Publishes a map in place of the current map and any map it is being
+ * migrated into, both of which are destroyed once readers are done.
+ */
+static void
+ck_hs_map_replace(struct ck_hs *hs, struct ck_hs_map *map)
+{
+	struct ck_hs_map *previous = hs->map;
+
+	ck_pr_fence_store();
+	ck_pr_store_ptr(&hs->map, map);
+
+	if (previous->next != NULL)
+		ck_hs_map_destroy(hs, previous->next, true);
+
+	ck_hs_map_destroy(hs, previous, true);
+	return;
+}
+
+bool
+ck_hs_reset_size(struct ck_hs *hs, unsigned long capacity)
+{
+	struct ck_hs_map *map;
+
+	map = ck_hs_map_create(hs, capacity);
+	if (map == NULL)
+		return false;
+
+	ck_hs_map_replace(hs, map);
+	return true;
+}
+
+bool
+ck_hs_reset(struct ck_hs *hs)
+{
+	struct ck_hs_map *previous;
+
+	previous = hs->map;
+	if (previous->next != NULL)
+		previous = previous->next;
+
+	return ck_hs_reset_size(hs, previous->capacity);
+}
+
+/*
+ * Tag 0 is never computed. It is the tag of a slot whose tag has not yet
+ * been stored, which must be compared in full.
+ */
+#define CK_HS_TAG_UNSET 0
+
+static inline uint8_t
+ck_hs_map_tag(unsigned long h)
+{
+	uint8_t tag;
+
+	/* Fold all bits of the hash value into the tag. */
+	h *= (unsigned long)0x9E3779B97F4A7C15ULL;
+	tag = (uint8_t)(h >> (sizeof(unsigned long) * 8 - 8));
+	return tag != CK_HS_TAG_UNSET ? tag : 1;
+}
+
+#ifdef CK_HS_TAG
+union ck_hs_tag_group {
+	uint64_t word;
+	uint8_t slot[CK_HS_PROBE_L1];
+};
+
+/*
+ * Returns a word whose byte i has its most significant bit set if the tag
+ * of slot i of the probe group starting at offset may be equal to tag, or
+ * is unset. False positives are possible, false negatives are not.
+ */
+static inline uint64_t
+ck_hs_map_tag_match(struct ck_hs_map *map, unsigned long offset, uint8_t tag)
+{
+	const uint64_t lsb = 0x0101010101010101ULL;
+	uint64_t x, y;
+
+	x = ck_pr_load_64((uint64_t *)(void *)&map->tags[offset]);
+	y = x ^ (lsb * tag);
+	return (((y - lsb) & ~y) | ((x - lsb) & ~x)) & (lsb << 7);
+}
+
+/*
+ * Returns false if the tag of a slot rules out a match with tag.
+ */
+static inline bool
+ck_hs_map_tag_candidate(struct ck_hs_map *map, unsigned long slot, uint8_t tag)
+{
+	uint8_t t = ck_pr_load_8(&map->tags[slot]);
+
+	return t == tag || t == CK_HS_TAG_UNSET;
+}
+#endif
+
+/*
+ * Returns the hash value of the entry stored in a slot of a map owned by
+ * the writer, from the cache if the map has one.
+ */
+static inline unsigned long
+ck_hs_map_hash(struct ck_hs *hs, struct ck_hs_map *map, unsigned long slot, const void *entry)
+{
+
+#ifdef CK_HS_CACHE
+	if (map->hashes != NULL)
+		return (unsigned long)map->hashes[slot];
+#else
+	(void)map;
+	(void)slot;
+#endif
+
+	return hs->hf(entry, map->seed);
+}
+
+/*
+ * Returns false if the cached hash value of a slot rules out a match with
+ * h. The entry of the slot must have been loaded prior to the call, so the
+ * hash value observed is at least as recent as the entry.
+ */
+static inline bool
+ck_hs_map_hash_match(struct ck_hs_map *map, unsigned long slot, unsigned long h)
+{
+
+#ifdef CK_HS_CACHE
+	if (map->hashes != NULL) {
+		ck_pr_fence_load();
+		return ck_pr_load_64(&map->hashes[slot]) == (uint64_t)h;
+	}
+#else
+	(void)map;
+	(void)slot;
+	(void)h;
+#endif
+
+	return true;
+}
+
+/*
+ * Marks the probe group of a slot as holding entries. Must precede the
+ * publication of an entry into the slot.
+ */
+static inline void
+ck_hs_map_occupy(struct ck_hs_map *map, unsigned long slot)
+{
+	unsigned long group = slot >> CK_HS_PROBE_L1_SHIFT;
+	unsigned int *word = &map->occupied[group / CK_HS_OCCUPIED_BITS];
+	unsigned int bit = 1U << (group % CK_HS_OCCUPIED_BITS);
+
+	if ((ck_pr_load_uint(word) & bit) == 0)
+		ck_pr_or_uint(word, bit);
+
+	return;
+}
+
+/*
+ * Clears the occupancy bit of the probe group of a slot if the group no
+ * longer holds any entries. Must be serialized with respect to insertions.
+ */
+static inline void
+ck_hs_map_vacate(struct ck_hs_map *map, unsigned long slot)
+{
+	unsigned long group = slot >> CK_HS_PROBE_L1_SHIFT;
+	void **bucket = map->entries + (group << CK_HS_PROBE_L1_SHIFT);
+	unsigned int j;
+
+	for (j = 0; j < CK_HS_PROBE_L1 && j < map->capacity; j++) {
+		if (bucket[j] != CK_HS_EMPTY && bucket[j] != CK_HS_TOMBSTONE)
+			return;
+	}
+
+	ck_pr_and_uint(&map->occupied[group / CK_HS_OCCUPIED_BITS],
+	    ~(1U << (group % CK_HS_OCCUPIED_BITS)));
+	return;
+}
+
+/*
+ * Stores the tag and hash value of a slot, if the map has them. Returns
+ * true if anything was stored.
+ */
+static inline bool
+ck_hs_map_slot_meta(struct ck_hs_map *map, unsigned long slot, unsigned long h)
+{
+	bool stored = false;
+
+#ifdef CK_HS_CACHE
+	if (map->hashes != NULL) {
+		ck_pr_store_64(&map->hashes[slot], (uint64_t)h);
+		stored = true;
+	}
+#endif
+
+#ifdef CK_HS_TAG
+	if (map->tags != NULL) {
+		ck_pr_store_8(&map->tags[slot], ck_hs_map_tag(h));
+		stored = true;
+	}
+#endif
+
+	(void)map;
+	(void)slot;
+	(void)h;
+	return stored;
+}
+
+/*
+ * Publishes an entry into a slot. The tag and hash value of the slot are
+ * made visible before the entry itself.
+ */
+static inline void
+ck_hs_map_slot_set(struct ck_hs_map *map, void **slot, void *entry, unsigned long h)
+{
+	bool fence;
+
+	fence = ck_hs_map_slot_meta(map, slot - map->entries, h);
+	ck_hs_map_occupy(map, slot - map->entries);
+
+	if (ck_hs_bloom_add(map->bloom, h) == true)
+		fence = true;
+
+	if (fence == true)
+		ck_pr_fence_store();
+
+	ck_pr_store_ptr(slot, entry);
+	return;
+}
+
+static inline unsigned long
+ck_hs_map_probe_next(struct ck_hs_map *map,
+    unsigned long offset,
+    unsigned long h,
+    unsigned long level,
+    unsigned long probes)
+{
+	unsigned long r;
+	unsigned long stride;
+
+	(void)probes;
+	(void)level;
+
+	r = h >> map->step;
+	stride = (r & ~CK_HS_PROBE_L1_MASK) << 1 | (r & CK_HS_PROBE_L1_MASK);
+
+	return (offset + (stride | CK_HS_PROBE_L1)) & map->mask;
+}
+
+/*
+ * Robin Hood hashing. Entries are placed by linear probing and kept ordered
+ * by home slot within a cluster, so a lookup stops at the first slot whose
+ * entry is closer to its home slot than the key would be. Insertion shifts
+ * the remainder of a cluster forward by one slot and deletion shifts it
+ * backward, so no tombstones are ever left.
+ *
+ * A shift may cause a concurrent reader to miss an entry, but never to
+ * observe one that does not exist. Writers hold the sequence counter of the
+ * map odd while shifting, and readers only validate misses against it.
+ */
+static inline unsigned int
+ck_hs_rh_distance(struct ck_hs_map *map, unsigned long slot)
+{
+
+#ifdef CK_HS_RH
+	return ck_pr_load_8(&map->distances[slot]);
+#else
+	return map->distances[slot];
+#endif
+}
+
+static inline void
+ck_hs_rh_distance_set(struct ck_hs_map *map, unsigned long slot, unsigned int distance)
+{
+
+#ifdef CK_HS_RH
+	ck_pr_store_8(&map->distances[slot], (uint8_t)distance);
+#else
+	map->distances[slot] = (uint8_t)distance;
+#endif
+	return;
+}
+
+/*
+ * Copies the entry of a slot into a neighbouring slot, adjusting its
+ * distance by delta.
+ */
+static inline void
+ck_hs_rh_move(struct ck_hs_map *map, unsigned long destination, unsigned long source, int delta)
+{
+
+	ck_hs_rh_distance_set(map, destination, map->distances[source] + delta);
+	ck_hs_map_occupy(map, destination);
+
+#ifdef CK_HS_CACHE
+	if (map->hashes != NULL)
+		ck_pr_store_64(&map->hashes[destination], map->hashes[source]);
+#endif
+
+#ifdef CK_HS_TAG
+	if (map->tags != NULL)
+		ck_pr_store_8(&map->tags[destination], map->tags[source]);
+#endif
+
+	ck_pr_fence_store();
+	ck_pr_store_ptr(&map->entries[destination], map->entries[source]);
+	return;
+}
+
+/*
+ * Inserts an entry at the specified slot and distance, shifting the rest
+ * of the cluster forward. Returns false if a distance would overflow or
+ * exceed the probe limit of the map.
+ */
+static bool
+ck_hs_rh_insert(struct ck_hs_map *map,
+    unsigned long slot,
+    unsigned long distance,
+    void *entry,
+    unsigned long h)
+{
+	unsigned long i, previous, limit, maximum;
+
+	limit = map->probe_limit;
+	if (limit > CK_HS_RH_LIMIT)
+		limit = CK_HS_RH_LIMIT;
+
+	if (distance >= limit)
+		return false;
+
+	maximum = distance;
+	for (i = slot; map->entries[i] != CK_HS_EMPTY; i = (i + 1) & map->mask) {
+		if (map->distances[i] + 1UL >= limit)
+			return false;
+
+		if (map->distances[i] + 1UL > maximum)
+			maximum = map->distances[i] + 1UL;
+	}
+
+	/* Lookups must observe the new bound before any shifted entry. */
+	if (maximum + 1 > map->probe_maximum)
+		ck_pr_store_uint(&map->probe_maximum, maximum + 1);
+
+	ck_sequence_write_begin(&map->sequence);
+
+	for (; i != slot; i = previous) {
+		previous = (i - 1) & map->mask;
+		ck_hs_rh_move(map, i, previous, 1);
+	}
+
+	ck_hs_rh_distance_set(map, slot, distance);
+	ck_hs_map_slot_set(map, &map->entries[slot], entry, h);
+
+	ck_sequence_write_end(&map->sequence);
+	map->n_entries++;
+	return true;
+}
+
+/*
+ * Removes the entry at the specified slot, shifting the rest of the
+ * cluster backward.
+ */
+static void
+ck_hs_rh_delete(struct ck_hs_map *map, unsigned long slot)
+{
+	unsigned long next;
+
+	ck_sequence_write_begin(&map->sequence);
+
+	for (;;) {
+		next = (slot + 1) & map->mask;
+		if (map->entries[next] == CK_HS_EMPTY || map->distances[next] == 0)
+			break;
+
+		ck_hs_rh_move(map, slot, next, -1);
+		slot = next;
+	}
+
+	ck_pr_store_ptr(&map->entries[slot], CK_HS_EMPTY);
+	ck_sequence_write_end(&map->sequence);
+	ck_hs_map_vacate(map, slot);
+	map->n_entries--;
+	return;
+}
+
+/*
+ * Inserts an entry known to be absent from the map into the first empty
+ * slot of its probe sequence. Returns false if the probe limit of the map
+ * has been exceeded.
+ */
+static bool
+ck_hs_map_insert(struct ck_hs_map *map, unsigned long h, void *entry)
+{
+	void **bucket, **cursor;
+	unsigned long i, j, offset, probes;
+
+	if (map->distances != NULL) {
+		for (probes = 0;; probes++) {
+			offset = (h + probes) & map->mask;
+			if (map->entries[offset] == CK_HS_EMPTY ||
+			    map->distances[offset] < probes)
+				break;
+		}
+
+		return ck_hs_rh_insert(map, offset, probes, entry, h);
+	}
+
+	offset = h & map->mask;
+	i = probes = 0;
+
+	for (;;) {
+		bucket = (void *)((uintptr_t)&map->entries[offset] & ~(CK_MD_CACHELINE - 1));
+
+		for (j = 0; j < CK_HS_PROBE_L1; j++) {
+			cursor = bucket + ((j + offset) & (CK_HS_PROBE_L1 - 1));
+
+			if (probes++ == map->probe_limit)
+				return false;
+
+			if (CK_CC_LIKELY(*cursor == CK_HS_EMPTY)) {
+				if (probes > map->probe_maximum)
+					ck_pr_store_uint(&map->probe_maximum, probes);
+
+				ck_hs_map_slot_set(map, cursor, entry, h);
+				map->n_entries++;
+				return true;
+			}
+		}
+
+		offset = ck_hs_map_probe_next(map, offset, h, i++, probes);
+	}
+}
+
+/*
+ * Re-hashes all entries of source into destination. Returns false if
+ * destination is too small to hold the entries of source.
+ */
+static bool
+ck_hs_map_copy(struct ck_hs *hs, struct ck_hs_map *destination, struct ck_hs_map *source)
+{
+	void *previous, *entry;
+	unsigned long k, h;
+
+	for (k = 0; k < source->capacity; k++) {
+		entry = previous = source->entries[k];
+		if (previous == CK_HS_EMPTY || previous == CK_HS_TOMBSTONE)
+			continue;
+
+#ifdef CK_HS_PP
+		if (hs->mode & CK_HS_MODE_OBJECT)
+			previous = (void *)((uintptr_t)previous & (((uintptr_t)1 << CK_MD_VMA_BITS) - 1));
+#endif
+
+		h = ck_hs_map_hash(hs, source, k, previous);
+		if (ck_hs_map_insert(destination, h, entry) == false)
+			return false;
+	}
+
+	return true;
+}
+
+bool
+ck_hs_grow(struct ck_hs *hs,
+    unsigned long capacity)
+{
+	struct ck_hs_map *map, *next, *update;
+
+	if (hs->mode & CK_HS_MODE_MPMC)
+		return ck_hs_mpmc_grow(hs, capacity);
+
+restart:
+	map = hs->map;
+	next = map->next;
+
+	/*
+	 * If a migration is in progress, then it is completed as part of
+	 * this operation. The capacity of the in-progress migration target
+	 * is the effective capacity of the set.
+	 */
+	if (next != NULL) {
+		if (next->capacity > capacity)
+			capacity = next->capacity;
+	} else if (map->capacity > capacity) {
+		return false;
+	}
+
+	update = ck_hs_map_create(hs, capacity);
+	if (update == NULL)
+		return false;
+
+	if (ck_hs_map_copy(hs, update, map) == false ||
+	    (next != NULL && ck_hs_map_copy(hs, update, next) == false)) {
+		/*
+		 * We have hit the probe limit, map needs to be even larger.
+		 */
+		ck_hs_map_destroy(hs, update, false);
+		capacity <<= 1;
+		goto restart;
+	}
+
+	ck_hs_counter_grow(hs, update->n_entries);
+	ck_hs_map_replace(hs, update);
+	return true;
+}
+
+/*
+ * Halves the capacity of a map whose occupancy has dropped below the
+ * minimum load factor. Sets are never shrunk below the capacity they were
+ * initialized with, nor while a migration is in progress.
+ */
+static void
+ck_hs_shrink(struct ck_hs *hs)
+{
+	struct ck_hs_map *map = hs->map, *update;
+	unsigned long capacity;
+
+	if (map->next != NULL || map->n_entries >= map->minimum)
+		return;
+
+	capacity = map->capacity >> 1;
+	if (capacity < hs->capacity)
+		return;
+
+	update = ck_hs_map_create(hs, capacity);
+	if (update == NULL)
+		return;
+
+	if (ck_hs_map_copy(hs, update, map) == false) {
+		ck_hs_map_destroy(hs, update, false);
+		return;
+	}
+
+	ck_hs_map_replace(hs, update);
+	return;
+}
+
+/*
+ * Migrates up to n slots of the current map into the next map. Once the
+ * last slot has been migrated, the next map is published and the previous
+ * map is scheduled for destruction.
+ */
+static void
+ck_hs_migrate(struct ck_hs *hs, struct ck_hs_map *map, unsigned long n)
+{
+	struct ck_hs_map *update = map->next;
+	unsigned long limit, h;
+	void *previous, *entry;
+
+	limit = map->capacity - map->cursor;
+	if (n > limit)
+		n = limit;
+
+	for (limit = map->cursor + n; map->cursor < limit; map->cursor++) {
+		entry = previous = map->entries[map->cursor];
+		if (previous == CK_HS_EMPTY || previous == CK_HS_TOMBSTONE)
+			continue;
+
+#ifdef CK_HS_PP
+		if (hs->mode & CK_HS_MODE_OBJECT)
+			previous = (void *)((uintptr_t)previous & (((uintptr_t)1 << CK_MD_VMA_BITS) - 1));
+#endif
+
+		h = ck_hs_map_hash(hs, map, map->cursor, previous);
+		if (ck_hs_map_insert(update, h, entry) == false) {
+			/*
+			 * The next map is too small to complete the migration,
+			 * fall back to a complete re-hash into a larger map.
+			 */
+			ck_hs_grow(hs, update->capacity << 1);
+			return;
+		}
+
+		/*
+		 * Readers probe the current map before the next map, so the
+		 * entry must be visible in the next map before it is removed
+		 * from the current map.
+		 */
+		ck_pr_fence_store();
+		ck_pr_store_ptr(&map->entries[map->cursor], CK_HS_TOMBSTONE);
+		map->n_entries--;
+	}
+
+	if (map->cursor == map->capacity) {
+		ck_pr_fence_store();
+		ck_pr_store_ptr(&hs->map, update);
+		ck_hs_map_destroy(hs, map, true);
+	}
+
+	return;
+}
+
+/*
+ * Begins an incremental migration into a map of the specified capacity.
+ * Sets that are not in incremental mode are grown immediately.
+ */
+static bool
+ck_hs_grow_incremental(struct ck_hs *hs, unsigned long capacity)
+{
+	struct ck_hs_map *map, *update;
+
+	map = hs->map;
+	if ((hs->mode & CK_HS_MODE_INCREMENTAL) == 0 || map->next != NULL ||
+	    ck_hs_map_pinned(map) == true)
+		return ck_hs_grow(hs, capacity);
+
+	update = ck_hs_map_create(hs, capacity);
+	if (update == NULL)
+		return false;
+
+	ck_hs_counter_grow(hs, map->n_entries);
+	map->cursor = 0;
+	ck_pr_fence_store();
+	ck_pr_store_ptr(&map->next, update);
+	return true;
+}
+
+/*
+ * Returns the map that write operations must target. If a migration is
+ * in progress, then a bounded number of slots is migrated and the map
+ * being migrated from is returned through previous.
+ */
+static struct ck_hs_map *
+ck_hs_map_writer(struct ck_hs *hs, struct ck_hs_map **previous)
+{
+	struct ck_hs_map *map = hs->map;
+
+	*previous = NULL;
+	if (map->next == NULL)
+		return map;
+
+	/* Migration is suspended while a snapshot pins either map. */
+	if (ck_hs_map_pinned(map) == false && ck_hs_map_pinned(map->next) == false)
+		ck_hs_migrate(hs, map, CK_HS_MIGRATE_DEFAULT);
+
+	map = hs->map;
+	if (map->next == NULL)
+		return map;
+
+	*previous = map;
+	return map->next;
+}
+
+static void **
+ck_hs_map_probe(struct ck_hs *hs,
+    struct ck_hs_map *map,
+    unsigned long *n_probes,
+    void ***priority,
+    unsigned long h,
+    const void *key,
+    void **object,
+    unsigned long probe_limit)
+{
+	void **bucket, **cursor, *k;
+	const void *compare;
+	void **pr = NULL;
 	unsigned long offset, j, i, probes;
 
-#ifdef CK_HS_PP
-	/* If we are storing object pointers, then we may leverage pointer packing. */
-	unsigned long hv = 0;
+#ifdef CK_HS_TAG
+	union ck_hs_tag_group match;
+	uint8_t tag = 0;
+
+	if (map->tags != NULL)
+		tag = ck_hs_map_tag(h);
+#endif
+
+#ifdef CK_HS_PP
+	/* If we are storing object pointers, then we may leverage pointer packing. */
+	unsigned long hv = 0;
+
+	if (hs->mode & CK_HS_MODE_OBJECT) {
+		hv = (h >> 25) & CK_HS_KEY_MASK;
+		compare = (void *)((uintptr_t)key | (hv << CK_MD_VMA_BITS));
+	} else {
+		compare = key;
+	}
+#else
+	compare = key;
+#endif
+
+	offset = h & map->mask;
+	*object = NULL;
+	i = probes = 0;
+
+	for (;;) {
+		bucket = (void **)((uintptr_t)&map->entries[offset] & ~(CK_MD_CACHELINE - 1));
+
+#ifdef CK_HS_TAG
+		/*
+		 * A tag may only be stale with respect to an entry that is
+		 * concurrently inserted into a free slot, which is either a
+		 * new key or covered by the generation counter protocol. In
+		 * MPMC mode, the tag of a new entry is unset until stored.
+		 */
+		if (map->tags != NULL) {
+			match.word = ck_hs_map_tag_match(map,
+			    (unsigned long)(bucket - map->entries), tag);
+		}
+#endif
+
+		for (j = 0; j < CK_HS_PROBE_L1; j++) {
+			cursor = bucket + ((j + offset) & (CK_HS_PROBE_L1 - 1));
+
+			if (probes++ == probe_limit) {
+				k = CK_HS_EMPTY;
+				goto leave;
+			}
+
+			k = ck_pr_load_ptr(cursor);
+			if (k == CK_HS_EMPTY)
+				goto leave;
+
+			if (k == CK_HS_TOMBSTONE) {
+				if (pr == NULL) {
+					pr = cursor;
+					*n_probes = probes;
+				}
+
+				continue;
+			}
+
+			if (hs->mode & CK_HS_MODE_MPMC) {
+				/*
+				 * Moved entries are visible in the next map
+				 * and frozen entries remain valid until then.
+				 */
+				if (k == CK_HS_MOVED)
+					continue;
+
+				if (k == CK_HS_MOVED_EMPTY) {
+					k = CK_HS_EMPTY;
+					goto leave;
+				}
+
+				k = (void *)((uintptr_t)k & ~CK_HS_FROZEN);
+			}
+
+#ifdef CK_HS_PP
+			if (hs->mode & CK_HS_MODE_OBJECT) {
+				if (((uintptr_t)k >> CK_MD_VMA_BITS) != hv)
+					continue;
+
+				k = (void *)((uintptr_t)k & (((uintptr_t)1 << CK_MD_VMA_BITS) - 1));
+			}
+#endif
+
+			if (k == compare)
+				goto leave;
+
+			if (hs->compare == NULL)
+				continue;
+
+#ifdef CK_HS_TAG
+			/* Only dereference objects with a matching tag. */
+			if (map->tags != NULL && match.slot[cursor - bucket] == 0)
+				continue;
+#endif
+
+			if (ck_hs_map_hash_match(map, cursor - map->entries, h) == false)
+				continue;
+
+			if (hs->compare(k, key) == true)
+				goto leave;
+		}
+
+		offset = ck_hs_map_probe_next(map, offset, h, i++, probes);
+	}
+
+leave:
+	if (probes > probe_limit) {
+		cursor = NULL;
+	} else {
+		*object = k;
+	}
+
+	if (pr == NULL)
+		*n_probes = probes;
+
+	*priority = pr;
+	return cursor;
+}
+
+static inline void *
+ck_hs_marshal(unsigned int mode, const void *key, unsigned long h)
+{
+	void *insert;
+
+#ifdef CK_HS_PP
+	if (mode & CK_HS_MODE_OBJECT) {
+		insert = (void *)((uintptr_t)key | ((h >> 25) << CK_MD_VMA_BITS));
+	} else {
+		insert = (void *)key;
+	}
+#else
+	(void)mode;
+	(void)h;
+	insert = (void *)key;
+#endif
+
+	return insert;
+}
+
+static inline void *
+ck_hs_map_unmarshal(struct ck_hs *hs, const void *v)
+{
+	uintptr_t k = (uintptr_t)v;
+
+#ifdef CK_HS_PP
+	if (hs->mode & CK_HS_MODE_OBJECT)
+		k &= ((uintptr_t)1 << CK_MD_VMA_BITS) - 1;
+#else
+	(void)hs;
+#endif
+
+	return (void *)k;
+}
+
+static inline bool
+ck_hs_map_match(struct ck_hs *hs, const void *v, unsigned long h, const void *key)
+{
+	void *k;
+
+#ifdef CK_HS_PP
+	if (hs->mode & CK_HS_MODE_OBJECT) {
+		if (((uintptr_t)v >> CK_MD_VMA_BITS) != ((h >> 25) & CK_HS_KEY_MASK))
+			return false;
+	}
+#else
+	(void)h;
+#endif
+
+	k = ck_hs_map_unmarshal(hs, v);
+	if (k == key)
+		return true;
+
+	return hs->compare != NULL && hs->compare(k, key) == true;
+}
+
+/*
+ * Accounts for the removal of a key from a map. Once the number of keys
+ * removed since the filter of the map was built reaches a quarter of its
+ * capacity, a new filter is built from the remaining keys and the stale
+ * filter is destroyed once readers are done with it.
+ */
+static void
+ck_hs_bloom_remove(struct ck_hs *hs, struct ck_hs_map *map)
+{
+	struct ck_hs_bloom *bloom, *previous = map->bloom;
+	unsigned long k;
+	void *entry;
+
+	if (previous == NULL || ++map->bloom_stale < (map->capacity >> 2))
+		return;
+
+	bloom = ck_hs_bloom_create(hs, map->capacity);
+	if (bloom == NULL)
+		return;
+
+	for (k = 0; k < map->capacity; k++) {
+		entry = map->entries[k];
+		if (entry == CK_HS_EMPTY || entry == CK_HS_TOMBSTONE)
+			continue;
+
+		entry = ck_hs_map_unmarshal(hs, entry);
+		ck_hs_bloom_add(bloom, ck_hs_map_hash(hs, map, k, entry));
+	}
+
+	ck_pr_fence_store();
+	ck_pr_store_ptr(&map->bloom, bloom);
+	map->bloom_stale = 0;
+	ck_hs_bloom_destroy(hs, previous, true);
+	return;
+}
+
+/*
+ * Multi-producer support. Writers claim slots with atomic compare-and-swap
+ * operations and never re-use tombstones, so a slot holds at most one key
+ * over the lifetime of a map. This guarantees that concurrent insertions of
+ * the same key race for the same free slot. Tombstones are reclaimed when
+ * the map is migrated.
+ *
+ * Growth is cooperative. The writer that detects the need for a larger map
+ * links it from the current map, after which every writer migrates a chunk
+ * of slots and freezes the probe sequence of its own key before operating
+ * on the next map. A writer that encounters a slot frozen by another writer
+ * waits for that single slot to be copied. The writer that completes the
+ * last chunk publishes the next map.
+ */
+static inline bool
+ck_hs_mpmc_frozen(const void *v)
+{
+
+	return v == CK_HS_MOVED || v == CK_HS_MOVED_EMPTY ||
+	    ((uintptr_t)v & CK_HS_FROZEN) != 0;
+}
+
+static inline void *
+ck_hs_mpmc_unmarshal(struct ck_hs *hs, const void *v)
+{
+
+	return ck_hs_map_unmarshal(hs, (void *)((uintptr_t)v & ~CK_HS_FROZEN));
+}
+
+static inline bool
+ck_hs_mpmc_match(struct ck_hs *hs, const void *v, unsigned long h, const void *key)
+{
+
+	return ck_hs_map_match(hs, (void *)((uintptr_t)v & ~CK_HS_FROZEN), h, key);
+}
+
+static void
+ck_hs_mpmc_bound(struct ck_hs_map *map, unsigned long n_probes)
+{
+	unsigned int bound;
+
+	/* Probe bound must be visible before the entry it covers. */
+	for (;;) {
+		bound = ck_pr_load_uint(&map->probe_maximum);
+		if (bound >= n_probes)
+			break;
+
+		if (ck_pr_cas_uint(&map->probe_maximum, bound, n_probes) == true)
+			break;
+	}
+
+	ck_pr_fence_store_atomic();
+	return;
+}
+
+static void
+ck_hs_mpmc_tag(struct ck_hs_map *map, void **slot, unsigned long h)
+{
+
+#ifdef CK_HS_TAG
+	/*
+	 * Slots are never re-used, so only the writer that claimed the slot
+	 * stores its tag, which transitions from unset exactly once. Until
+	 * then, readers compare the entry in full.
+	 */
+	if (map->tags != NULL)
+		ck_pr_store_8(&map->tags[slot - map->entries], ck_hs_map_tag(h));
+#else
+	(void)map;
+	(void)slot;
+	(void)h;
+#endif
+
+	return;
+}
+
+/*
+ * Walks the probe sequence of a key. Returns the slot holding a matching
+ * entry, the first free slot or the first frozen slot, with the observed
+ * value stored in value. Slots that have already been migrated are skipped
+ * if moved is true. Returns NULL if limit probes were exceeded.
+ */
+static void **
+ck_hs_mpmc_probe(struct ck_hs *hs,
+    struct ck_hs_map *map,
+    unsigned long h,
+    const void *key,
+    void **value,
+    unsigned long *n_probes,
+    unsigned long limit,
+    bool moved)
+{
+	void **bucket, **cursor, *k;
+	unsigned long offset, i, j, probes;
+
+	offset = h & map->mask;
+	i = probes = 0;
+
+	for (;;) {
+		bucket = (void **)((uintptr_t)&map->entries[offset] & ~(CK_MD_CACHELINE - 1));
+
+		for (j = 0; j < CK_HS_PROBE_L1; j++) {
+			cursor = bucket + ((j + offset) & (CK_HS_PROBE_L1 - 1));
+
+			if (probes++ == limit)
+				return NULL;
+
+			k = ck_pr_load_ptr(cursor);
+			if (k == CK_HS_TOMBSTONE || (moved == true && k == CK_HS_MOVED))
+				continue;
+
+			if (k == CK_HS_EMPTY || ck_hs_mpmc_frozen(k) == true ||
+			    (key != NULL && ck_hs_mpmc_match(hs, k, h, key) == true)) {
+				*value = k;
+				*n_probes = probes;
+				return cursor;
+			}
+		}
+
+		offset = ck_hs_map_probe_next(map, offset, h, i++, probes);
+	}
+}
+
+/*
+ * Inserts an entry known to be absent from the map into the first free
+ * slot of its probe sequence.
+ */
+static void
+ck_hs_mpmc_insert(struct ck_hs *hs, struct ck_hs_map *map, unsigned long h, void *entry)
+{
+	unsigned long n_probes;
+	void **slot, *k;
+
+	/* Entries are counted before they are visible so counts never underflow. */
+	ck_hs_word_inc(&map->n_entries);
+
+	for (;;) {
+		/*
+		 * The map holds fewer entries than the map being migrated has
+		 * slots, and this many probes visit every group of the map.
+		 */
+		slot = ck_hs_mpmc_probe(hs, map, h, NULL, &k, &n_probes,
+		    map->capacity << CK_HS_PROBE_L1_SHIFT, false);
+		if (slot == NULL || k != CK_HS_EMPTY)
+			continue;
+
+		ck_hs_mpmc_bound(map, n_probes);
+		ck_hs_map_occupy(map, slot - map->entries);
+		if (ck_pr_cas_ptr(slot, CK_HS_EMPTY, entry) == true)
+			break;
+	}
+
+	ck_hs_mpmc_tag(map, slot, h);
+	return;
+}
+
+/*
+ * Freezes a slot of a map that is being migrated. If the slot contains an
+ * entry, then it is copied into the next map.
+ */
+static void
+ck_hs_mpmc_freeze(struct ck_hs *hs, struct ck_hs_map *map, void **slot)
+{
+	void *k;
+
+	for (;;) {
+		k = ck_pr_load_ptr(slot);
+
+		if (k == CK_HS_MOVED || k == CK_HS_MOVED_EMPTY || k == CK_HS_TOMBSTONE)
+			return;
+
+		if (k == CK_HS_EMPTY) {
+			if (ck_pr_cas_ptr(slot, CK_HS_EMPTY, CK_HS_MOVED_EMPTY) == true)
+				return;
+
+			continue;
+		}
+
+		if ((uintptr_t)k & CK_HS_FROZEN) {
+			/* Another writer is copying this entry. */
+			ck_pr_stall();
+			continue;
+		}
+
+		if (ck_pr_cas_ptr(slot, k, (void *)((uintptr_t)k | CK_HS_FROZEN)) == true)
+			break;
+	}
+
+	ck_hs_mpmc_insert(hs, map->next, hs->hf(ck_hs_mpmc_unmarshal(hs, k), hs->seed), k);
+	ck_pr_fence_store();
+	ck_pr_store_ptr(slot, CK_HS_MOVED);
+	ck_hs_word_dec(&map->n_entries);
+	return;
+}
+
+/*
+ * Claims and migrates a chunk of slots. Returns false if every chunk has
+ * already been claimed.
+ */
+static bool
+ck_hs_mpmc_migrate(struct ck_hs *hs, struct ck_hs_map *map)
+{
+	unsigned long offset, limit, n;
+
+	if (ck_pr_load_ptr(&map->next) == NULL)
+		return false;
+
+	offset = (unsigned long)ck_hs_word_faa(&map->cursor, CK_HS_MIGRATE_DEFAULT);
+	if (offset >= map->capacity)
+		return false;
+
+	limit = offset + CK_HS_MIGRATE_DEFAULT;
+	if (limit > map->capacity)
+		limit = map->capacity;
+
+	for (n = offset; n < limit; n++)
+		ck_hs_mpmc_freeze(hs, map, &map->entries[n]);
+
+	n = limit - offset;
+	if ((unsigned long)ck_hs_word_faa(&map->migrated, n) + n == map->capacity) {
+		if (ck_pr_cas_ptr(&hs->map, map, map->next) == true)
+			ck_hs_map_destroy(hs, map, true);
+	}
+
+	return true;
+}
+
+/*
+ * Returns the map that a write operation on the specified key must target,
+ * helping any migrations in progress.
+ */
+static struct ck_hs_map *
+ck_hs_mpmc_writer(struct ck_hs *hs, unsigned long h, const void *key)
+{
+	struct ck_hs_map *map, *next;
+	unsigned long n_probes;
+	void **slot, *k;
+
+	map = ck_pr_load_ptr(&hs->map);
+	while ((next = ck_pr_load_ptr(&map->next)) != NULL) {
+		ck_hs_mpmc_migrate(hs, map);
+
+		/*
+		 * Freeze the probe sequence of the key up to and including a
+		 * matching or free slot, so that the state of the key in this
+		 * map is final and reflected in the next map.
+		 */
+		for (;;) {
+			slot = ck_hs_mpmc_probe(hs, map, h, key, &k, &n_probes,
+			    map->capacity, true);
+			if (slot == NULL || k == CK_HS_MOVED_EMPTY)
+				break;
+
+			ck_hs_mpmc_freeze(hs, map, slot);
+		}
+
+		map = next;
+	}
+
+	return map;
+}
+
+/*
+ * Begins a cooperative migration of the current map into a map of the
+ * specified capacity.
+ */
+static bool
+ck_hs_mpmc_grow_begin(struct ck_hs *hs, struct ck_hs_map *map, unsigned long capacity)
+{
+	struct ck_hs_map *update;
+
+	if (ck_pr_load_ptr(&map->next) != NULL)
+		return true;
+
+	/* Migration may only begin once previous migrations have completed. */
+	if (ck_pr_load_ptr(&hs->map) != map)
+		return true;
+
+	update = ck_hs_map_create(hs, capacity);
+	if (update == NULL)
+		return false;
+
+	if (ck_pr_cas_ptr(&map->next, NULL, update) == false) {
+		ck_hs_map_destroy(hs, update, false);
+		return true;
+	}
+
+	ck_hs_counter_grow(hs, (unsigned long)ck_hs_word_load(&map->n_entries));
+	return true;
+}
+
+static void
+ck_hs_mpmc_grow_check(struct ck_hs *hs, struct ck_hs_map *map)
+{
+	unsigned long n_entries, tombstones;
+
+	n_entries = (unsigned long)ck_hs_word_load(&map->n_entries);
+	tombstones = ck_pr_load_uint(&map->tombstones);
+
+	/* Tombstones are purged by migrating into a map of equal capacity. */
+	if (n_entries + tombstones > map->maximum) {
+		ck_hs_mpmc_grow_begin(hs, map, (n_entries << 1) > map->maximum ?
+		    map->capacity << 1 : map->capacity);
+	} else if (n_entries < map->minimum && (map->capacity >> 1) >= hs->capacity) {
+		ck_hs_mpmc_grow_begin(hs, map, map->capacity >> 1);
+	}
+
+	return;
+}
+
+static bool
+ck_hs_mpmc_grow(struct ck_hs *hs, unsigned long capacity)
+{
+	struct ck_hs_map *map;
+
+	map = ck_pr_load_ptr(&hs->map);
+	if (ck_pr_load_ptr(&map->next) == NULL && map->capacity > capacity)
+		return false;
+
+	if (ck_hs_mpmc_grow_begin(hs, map, capacity) == false)
+		return false;
+
+	/* Help until the migration has been published. */
+	while (ck_pr_load_ptr(&hs->map) == map) {
+		if (ck_hs_mpmc_migrate(hs, map) == false)
+			ck_pr_stall();
+	}
+
+	return true;
+}
+
+/*
+ * Helps migrations until the specified map is published. Returns false if
+ * the map has since been superseded by another migration.
+ */
+static bool
+ck_hs_mpmc_wait(struct ck_hs *hs, struct ck_hs_map *map)
+{
+	struct ck_hs_map *current;
+
+	while ((current = ck_pr_load_ptr(&hs->map)) != map) {
+		if (ck_pr_load_ptr(&map->next) != NULL)
+			return false;
+
+		if (ck_hs_mpmc_migrate(hs, current) == false)
+			ck_pr_stall();
+	}
+
+	return true;
+}
+
+static bool
+ck_hs_mpmc_put(struct ck_hs *hs, unsigned long h, const void *key, bool replace, void **previous)
+{
+	struct ck_hs_map *map;
+	unsigned long n_probes;
+	void **slot, *k, *insert;
+
+	/* The low bit of a key is reserved for migration. */
+	if ((uintptr_t)key & CK_HS_FROZEN)
+		return false;
+
+	insert = ck_hs_marshal(hs->mode, key, h);
+
+	for (;;) {
+		map = ck_hs_mpmc_writer(hs, h, key);
+
+		slot = ck_hs_mpmc_probe(hs, map, h, key, &k, &n_probes,
+		    map->probe_limit, false);
+		if (slot == NULL) {
+			/* The probe limit has been exceeded, so the map is grown. */
+			if (ck_hs_mpmc_wait(hs, map) == true &&
+			    ck_hs_mpmc_grow_begin(hs, map, map->capacity << 1) == false)
+				return false;
+
+			continue;
+		}
+
+		if (k == CK_HS_EMPTY) {
+			/*
+			 * New keys are only inserted into published maps, which
+			 * bounds the number of entries a migration must copy.
+			 */
+			if (ck_pr_load_ptr(&hs->map) != map) {
+				ck_hs_mpmc_wait(hs, map);
+				continue;
+			}
+
+			ck_hs_mpmc_bound(map, n_probes);
+			ck_hs_map_occupy(map, slot - map->entries);
+			ck_hs_word_inc(&map->n_entries);
+			if (ck_pr_cas_ptr(slot, CK_HS_EMPTY, insert) == false) {
+				ck_hs_word_dec(&map->n_entries);
+				continue;
+			}
+
+			ck_hs_mpmc_tag(map, slot, h);
+			ck_hs_counter_probe(hs, n_probes);
+			ck_hs_mpmc_grow_check(hs, map);
+
+			if (previous != NULL)
+				*previous = NULL;
+
+			return true;
+		}
+
+		/* A migration has begun. */
+		if (ck_hs_mpmc_frozen(k) == true)
+			continue;
+
+		if (replace == false)
+			return false;
+
+		if (ck_pr_cas_ptr(slot, k, insert) == true) {
+			*previous = ck_hs_mpmc_unmarshal(hs, k);
+			return true;
+		}
+	}
+}
+
+static bool
+ck_hs_mpmc_fas(struct ck_hs *hs, unsigned long h, const void *key, void **previous)
+{
+	struct ck_hs_map *map;
+	unsigned long n_probes;
+	void **slot, *k, *insert;
+
+	if ((uintptr_t)key & CK_HS_FROZEN)
+		return false;
+
+	insert = ck_hs_marshal(hs->mode, key, h);
+
+	for (;;) {
+		map = ck_hs_mpmc_writer(hs, h, key);
+
+		slot = ck_hs_mpmc_probe(hs, map, h, key, &k, &n_probes,
+		    map->probe_limit, false);
+		if (slot == NULL || k == CK_HS_EMPTY)
+			return false;
+
+		if (ck_hs_mpmc_frozen(k) == true)
+			continue;
+
+		if (ck_pr_cas_ptr(slot, k, insert) == true) {
+			*previous = ck_hs_mpmc_unmarshal(hs, k);
+			return true;
+		}
+	}
+}
+
+static void *
+ck_hs_mpmc_remove(struct ck_hs *hs, unsigned long h, const void *key)
+{
+	struct ck_hs_map *map;
+	unsigned long n_probes;
+	void **slot, *k;
+
+	for (;;) {
+		map = ck_hs_mpmc_writer(hs, h, key);
+
+		slot = ck_hs_mpmc_probe(hs, map, h, key, &k, &n_probes,
+		    map->probe_limit, false);
+		if (slot == NULL || k == CK_HS_EMPTY)
+			return NULL;
+
+		if (ck_hs_mpmc_frozen(k) == true)
+			continue;
+
+		if (ck_pr_cas_ptr(slot, k, CK_HS_TOMBSTONE) == true) {
+			ck_hs_word_dec(&map->n_entries);
+			ck_pr_inc_uint(&map->tombstones);
+			ck_hs_mpmc_grow_check(hs, map);
+			return ck_hs_mpmc_unmarshal(hs, k);
+		}
+	}
+}
+
+/*
+ * Returns the slot index holding a matching entry or, if none is found,
+ * the slot index that the key would be inserted into. The distance of the
+ * returned slot from the home slot is stored in distance.
+ */
+static unsigned long
+ck_hs_rh_probe(struct ck_hs *hs,
+    struct ck_hs_map *map,
+    unsigned long h,
+    const void *key,
+    void **object,
+    unsigned long *distance)
+{
+	unsigned long d, slot;
+	void *k;
+
+	*object = NULL;
+
+	for (d = 0;; d++) {
+		slot = (h + d) & map->mask;
+		k = map->entries[slot];
+
+		if (k == CK_HS_EMPTY || map->distances[slot] < d)
+			break;
+
+		if (ck_hs_map_hash_match(map, slot, h) == true &&
+		    ck_hs_map_match(hs, k, h, key) == true) {
+			*object = ck_hs_map_unmarshal(hs, k);
+			break;
+		}
+	}
+
+	*distance = d;
+	return slot;
+}
+
+static void *
+ck_hs_rh_get(struct ck_hs *hs, struct ck_hs_map *map, unsigned long h, const void *key)
+{
+	unsigned long d, slot, bound;
+	unsigned int version;
+	void *k;
+
+#if defined(CK_HS_TAG) && defined(CK_HS_RH)
+	uint8_t tag = 0;
+
+	if (map->tags != NULL)
+		tag = ck_hs_map_tag(h);
+#endif
+
+	/* Hits are never validated, so a first attempt does not wait for writers. */
+	version = ck_pr_load_uint(&map->sequence.sequence);
+	ck_pr_fence_load();
+
+	for (;;) {
+		bound = ck_pr_load_uint(&map->probe_maximum);
+
+		for (d = 0; d < bound; d++) {
+			slot = (h + d) & map->mask;
+			k = ck_pr_load_ptr(&map->entries[slot]);
+
+			if (k == CK_HS_EMPTY || ck_hs_rh_distance(map, slot) < d)
+				break;
+
+#if defined(CK_HS_TAG) && defined(CK_HS_RH)
+			if (map->tags != NULL &&
+			    ck_hs_map_tag_candidate(map, slot, tag) == false)
+				continue;
+#endif
+
+			if (ck_hs_map_hash_match(map, slot, h) == true &&
+			    ck_hs_map_match(hs, k, h, key) == true)
+				return ck_hs_map_unmarshal(hs, k);
+		}
+
+		if ((version & 1) == 0 &&
+		    ck_sequence_read_retry(&map->sequence, version) == false)
+			break;
+
+		ck_hs_counter_retry(hs);
+		version = ck_sequence_read_begin(&map->sequence);
+	}
+
+	return NULL;
+}
+
+static bool
+ck_hs_rh_put(struct ck_hs *hs, unsigned long h, const void *key, bool replace, void **previous)
+{
+	struct ck_hs_map *map;
+	unsigned long slot, distance;
+	void *object, *insert;
+
+	insert = ck_hs_marshal(hs->mode, key, h);
+
+restart:
+	map = hs->map;
+	slot = ck_hs_rh_probe(hs, map, h, key, &object, &distance);
+
+	if (object != NULL) {
+		if (replace == false)
+			return false;
+
+		/* A replacement with the same hash value is a single store. */
+		ck_hs_map_slot_set(map, &map->entries[slot], insert, h);
+		*previous = object;
+		return true;
+	}
+
+	/* Entries of a pinned map are shifted in a copy of the map instead. */
+	if (ck_hs_map_pinned(map) == true) {
+		if (ck_hs_grow(hs, map->capacity) == false)
+			return false;
+
+		goto restart;
+	}
+
+	if (ck_hs_rh_insert(map, slot, distance, insert, h) == false) {
+		if (ck_hs_grow(hs, map->capacity << 1) == false)
+			return false;
+
+		goto restart;
+	}
+
+	ck_hs_counter_probe(hs, distance + 1);
+	if (map->n_entries > map->maximum)
+		ck_hs_grow(hs, map->capacity << 1);
+
+	if (previous != NULL)
+		*previous = NULL;
+
+	return true;
+}
+
+static bool
+ck_hs_rh_fas(struct ck_hs *hs, unsigned long h, const void *key, void **previous)
+{
+	struct ck_hs_map *map = hs->map;
+	unsigned long slot, distance;
+	void *object;
+
+	slot = ck_hs_rh_probe(hs, map, h, key, &object, &distance);
+	if (object == NULL)
+		return false;
+
+	ck_hs_map_slot_set(map, &map->entries[slot],
+	    ck_hs_marshal(hs->mode, key, h), h);
+	*previous = object;
+	return true;
+}
+
+static void *
+ck_hs_rh_remove(struct ck_hs *hs, unsigned long h, const void *key)
+{
+	struct ck_hs_map *map;
+	unsigned long slot, distance;
+	void *object;
+
+restart:
+	map = hs->map;
+	slot = ck_hs_rh_probe(hs, map, h, key, &object, &distance);
+	if (object != NULL) {
+		if (ck_hs_map_pinned(map) == true) {
+			if (ck_hs_grow(hs, map->capacity) == false)
+				return NULL;
+
+			goto restart;
+		}
+
+		ck_hs_rh_delete(map, slot);
+		ck_hs_bloom_remove(hs, map);
+		ck_hs_shrink(hs);
+	}
+
+	return object;
+}
+
+/*
+ * Robin Hood maps have no tombstones, so collection only recomputes the
+ * probe bound.
+ */
+static void
+ck_hs_rh_gc(struct ck_hs_map *map)
+{
+	unsigned long i;
+	unsigned int maximum = 0;
+
+	for (i = 0; i < map->capacity; i++) {
+		if (map->entries[i] != CK_HS_EMPTY &&
+		    map->distances[i] + 1U > maximum)
+			maximum = map->distances[i] + 1U;
+	}
+
+	if (maximum != map->probe_maximum)
+		ck_pr_store_uint(&map->probe_maximum, maximum);
+
+	return;
+}
+
+bool
+ck_hs_fas(struct ck_hs *hs,
+    unsigned long h,
+    const void *key,
+    void **previous)
+{
+	void **slot, **first, *object, *insert;
+	unsigned long n_probes;
+	struct ck_hs_map *map, *old;
+
+	*previous = NULL;
+	if (hs->mode & CK_HS_MODE_MPMC)
+		return ck_hs_mpmc_fas(hs, h, key, previous);
+
+	if (hs->mode & CK_HS_MODE_ROBIN_HOOD)
+		return ck_hs_rh_fas(hs, h, key, previous);
+
+	map = ck_hs_map_writer(hs, &old);
+
+	insert = ck_hs_marshal(hs->mode, key, h);
+
+	if (old != NULL) {
+		/*
+		 * If the key has yet to be migrated, then it is replaced
+		 * in the map being migrated from.
+		 */
+		slot = ck_hs_map_probe(hs, old, &n_probes, &first, h, key,
+		    &object, old->probe_maximum);
+		if (object != NULL) {
+			ck_pr_store_ptr(slot, insert);
+			*previous = object;
+			return true;
+		}
+	}
+
+	slot = ck_hs_map_probe(hs, map, &n_probes, &first, h, key, &object, map->probe_maximum);
+
+	/* Replacement semantics presume existence. */
+	if (object == NULL)
+		return false;
+
+	if (first != NULL && ck_hs_map_pinned(map) == false) {
+		ck_hs_map_slot_set(map, first, insert, h);
+		ck_pr_inc_uint(ck_hs_map_generation(map, h));
+		ck_pr_fence_atomic_store();
+		ck_pr_store_ptr(slot, CK_HS_TOMBSTONE);
+	} else {
+		ck_pr_store_ptr(slot, insert);
+	}
+
+	*previous = object;
+	return true;
+}
+
+bool
+ck_hs_set(struct ck_hs *hs,
+    unsigned long h,
+    const void *key,
+    void **previous)
+{
+	void **slot, **first, *object, *insert;
+	void **migrate = NULL;
+	unsigned long n_probes;
+	struct ck_hs_map *map, *old;
+
+	*previous = NULL;
+	if (hs->mode & CK_HS_MODE_MPMC)
+		return ck_hs_mpmc_put(hs, h, key, true, previous);
+
+	if (hs->mode & CK_HS_MODE_ROBIN_HOOD)
+		return ck_hs_rh_put(hs, h, key, true, previous);
+
+restart:
+	map = ck_hs_map_writer(hs, &old);
+
+	slot = ck_hs_map_probe(hs, map, &n_probes, &first, h, key, &object, map->probe_limit);
+	if (slot == NULL && first == NULL) {
+		if (ck_hs_grow(hs, map->capacity << 1) == false)
+			return false;
+
+		goto restart;
+	}
+
+	if (object == NULL && old != NULL) {
+		void **old_first;
+		unsigned long old_probes;
+
+		/*
+		 * The key may not have been migrated yet. If so, it is
+		 * inserted into the next map and the stale slot is removed
+		 * from the previous map afterwards.
+		 */
+		migrate = ck_hs_map_probe(hs, old, &old_probes, &old_first, h, key,
+		    previous, old->probe_maximum);
+		if (*previous == NULL)
+			migrate = NULL;
+
+		/* A key of a pinned map is replaced where it is. */
+		if (migrate != NULL && ck_hs_map_pinned(old) == true) {
+			ck_pr_store_ptr(migrate, ck_hs_marshal(hs->mode, key, h));
+			return true;
+		}
+	}
+
+	if (n_probes > map->probe_maximum)
+		ck_pr_store_uint(&map->probe_maximum, n_probes);
+
+	insert = ck_hs_marshal(hs->mode, key, h);
+
+	/* A key of a pinned map is replaced where it is. */
+	if (object != NULL && ck_hs_map_pinned(map) == true)
+		first = NULL;
+
+	if (first != NULL) {
+		/* If an earlier bucket was found, then store entry there. */
+		ck_hs_map_slot_set(map, first, insert, h);
+
+		/*
+		 * If a duplicate key was found, then delete it after
+		 * signaling concurrent probes to restart. Optionally,
+		 * it is possible to install tombstone after grace
+		 * period if we can guarantee earlier position of
+		 * duplicate key.
+		 */
+		if (object != NULL) {
+			ck_pr_inc_uint(ck_hs_map_generation(map, h));
+			ck_pr_fence_atomic_store();
+			ck_pr_store_ptr(slot, CK_HS_TOMBSTONE);
+		}
+	} else {
+		/*
+		 * If we are storing into same slot, then atomic store is sufficient
+		 * for replacement.
+		 */
+		ck_hs_map_slot_set(map, slot, insert, h);
+	}
+
+	if (migrate != NULL) {
+		ck_pr_fence_store();
+		ck_pr_store_ptr(migrate, CK_HS_TOMBSTONE);
+		old->n_entries--;
+		old->tombstones++;
+	}
+
+	if (object == NULL) {
+		ck_hs_counter_probe(hs, n_probes);
+		map->n_entries++;
+		if (map->n_entries + (old != NULL ? old->n_entries : 0) > map->maximum)
+			ck_hs_grow_incremental(hs, map->capacity << 1);
+	}
+
+	if (migrate == NULL)
+		*previous = object;
+
+	return true;
+}
+
+bool
+ck_hs_put(struct ck_hs *hs,
+    unsigned long h,
+    const void *key)
+{
+	void **slot, **first, *object, *insert;
+	unsigned long n_probes;
+	struct ck_hs_map *map, *old;
+
+	if (hs->mode & CK_HS_MODE_MPMC)
+		return ck_hs_mpmc_put(hs, h, key, false, NULL);
+
+	if (hs->mode & CK_HS_MODE_ROBIN_HOOD)
+		return ck_hs_rh_put(hs, h, key, false, NULL);
+
+restart:
+	map = ck_hs_map_writer(hs, &old);
+
+	if (old != NULL) {
+		/* Fail operation if the key has yet to be migrated. */
+		ck_hs_map_probe(hs, old, &n_probes, &first, h, key, &object,
+		    old->probe_maximum);
+		if (object != NULL)
+			return false;
+	}
+
+	slot = ck_hs_map_probe(hs, map, &n_probes, &first, h, key, &object, map->probe_limit);
+	if (slot == NULL && first == NULL) {
+		if (ck_hs_grow(hs, map->capacity << 1) == false)
+			return false;
+
+		goto restart;
+	}
+
+	/* Fail operation if a match was found. */
+	if (object != NULL)
+		return false;
+
+	if (n_probes > map->probe_maximum)
+		ck_pr_store_uint(&map->probe_maximum, n_probes);
+
+	insert = ck_hs_marshal(hs->mode, key, h);
+
+	if (first != NULL) {
+		/* Insert key into first bucket in probe sequence. */
+		ck_hs_map_slot_set(map, first, insert, h);
+	} else {
+		/* An empty slot was found. */
+		ck_hs_map_slot_set(map, slot, insert, h);
+	}
+
+	ck_hs_counter_probe(hs, n_probes);
+	map->n_entries++;
+	if (map->n_entries + (old != NULL ? old->n_entries : 0) > map->maximum)
+		ck_hs_grow_incremental(hs, map->capacity << 1);
+
+	return true;
+}
+
+static bool
+ck_hs_rh_apply(struct ck_hs *hs,
+    unsigned long h,
+    const void *key,
+    ck_hs_apply_fn_t *fn,
+    void *cl)
+{
+	struct ck_hs_map *map = hs->map;
+	unsigned long slot, distance;
+	void *object, *delta, *insert;
+
+	slot = ck_hs_rh_probe(hs, map, h, key, &object, &distance);
+	delta = fn(object, cl);
+	if (delta == object)
+		return true;
+
+	/* Entries of a pinned map are shifted by the copying slow paths. */
+	if (delta == NULL) {
+		if (ck_hs_map_pinned(map) == true) {
+			ck_hs_rh_remove(hs, h, key);
+			return true;
+		}
+
+		ck_hs_rh_delete(map, slot);
+		ck_hs_bloom_remove(hs, map);
+		ck_hs_shrink(hs);
+		return true;
+	}
 
-	if (hs->mode & CK_HS_MODE_OBJECT) {
-		hv = (h >> 25) & CK_HS_KEY_MASK;
-		compare = (void *)((uintptr_t)key | (hv << CK_MD_VMA_BITS));
+	insert = ck_hs_marshal(hs->mode, delta, h);
+	if (object != NULL) {
+		ck_hs_map_slot_set(map, &map->entries[slot], insert, h);
+		return true;
+	}
+
+	if (ck_hs_map_pinned(map) == true ||
+	    ck_hs_rh_insert(map, slot, distance, insert, h) == false)
+		return ck_hs_rh_put(hs, h, delta, false, NULL);
+
+	ck_hs_counter_probe(hs, distance + 1);
+	if (map->n_entries > map->maximum)
+		ck_hs_grow(hs, map->capacity << 1);
+
+	return true;
+}
+
+bool
+ck_hs_apply(struct ck_hs *hs,
+    unsigned long h,
+    const void *key,
+    ck_hs_apply_fn_t *fn,
+    void *cl)
+{
+	void **slot, **first, *object, *delta, *insert;
+	void **migrate = NULL;
+	unsigned long n_probes;
+	struct ck_hs_map *map, *old;
+
+	/* The function may not be applied atomically with concurrent writers. */
+	if (hs->mode & CK_HS_MODE_MPMC)
+		return false;
+
+	if (hs->mode & CK_HS_MODE_ROBIN_HOOD)
+		return ck_hs_rh_apply(hs, h, key, fn, cl);
+
+restart:
+	map = ck_hs_map_writer(hs, &old);
+
+	slot = ck_hs_map_probe(hs, map, &n_probes, &first, h, key, &object, map->probe_limit);
+	if (slot == NULL && first == NULL) {
+		if (ck_hs_grow(hs, map->capacity << 1) == false)
+			return false;
+
+		goto restart;
+	}
+
+	if (object == NULL && old != NULL) {
+		void **old_first;
+		unsigned long old_probes;
+
+		/* The key may not have been migrated yet. */
+		migrate = ck_hs_map_probe(hs, old, &old_probes, &old_first, h, key,
+		    &object, old->probe_maximum);
+		if (object == NULL)
+			migrate = NULL;
+	}
+
+	delta = fn(object, cl);
+	if (delta == object)
+		return true;
+
+	if (delta == NULL) {
+		/* Removal of an absent object succeeds trivially. */
+		if (object == NULL)
+			return true;
+
+		if (migrate != NULL) {
+			map = old;
+			slot = migrate;
+		}
+
+		ck_pr_store_ptr(slot, CK_HS_TOMBSTONE);
+		ck_hs_map_vacate(map, slot - map->entries);
+		map->n_entries--;
+		map->tombstones++;
+		ck_hs_bloom_remove(hs, map);
+		ck_hs_shrink(hs);
+		return true;
+	}
+
+	insert = ck_hs_marshal(hs->mode, delta, h);
+
+	/* A key of a pinned map is replaced where it is. */
+	if (migrate != NULL && ck_hs_map_pinned(old) == true) {
+		ck_pr_store_ptr(migrate, insert);
+		return true;
+	}
+
+	if (object != NULL && migrate == NULL && ck_hs_map_pinned(map) == true)
+		first = NULL;
+
+	if (n_probes > map->probe_maximum)
+		ck_pr_store_uint(&map->probe_maximum, n_probes);
+
+	if (first != NULL) {
+		ck_hs_map_slot_set(map, first, insert, h);
+
+		/* Concurrent probes must restart before the duplicate is removed. */
+		if (object != NULL && migrate == NULL) {
+			ck_pr_inc_uint(ck_hs_map_generation(map, h));
+			ck_pr_fence_atomic_store();
+			ck_pr_store_ptr(slot, CK_HS_TOMBSTONE);
+		}
 	} else {
-		compare = key;
+		ck_hs_map_slot_set(map, slot, insert, h);
 	}
-#else
-	compare = key;
+
+	if (migrate != NULL) {
+		ck_pr_fence_store();
+		ck_pr_store_ptr(migrate, CK_HS_TOMBSTONE);
+		old->n_entries--;
+		old->tombstones++;
+	}
+
+	if (object == NULL || migrate != NULL) {
+		ck_hs_counter_probe(hs, n_probes);
+		map->n_entries++;
+		if (map->n_entries + (old != NULL ? old->n_entries : 0) > map->maximum)
+			ck_hs_grow_incremental(hs, map->capacity << 1);
+	}
+
+	return true;
+}
+
+static void *
+ck_hs_map_lookup(struct ck_hs *hs,
+    struct ck_hs_map *map,
+    unsigned long h,
+    const void *key)
+{
+	void **first, *object;
+	unsigned long n_probes;
+	unsigned int g, g_p, probe;
+	unsigned int *generation;
+
+	if (ck_hs_bloom_member(map, h) == false)
+		return NULL;
+
+	if (map->distances != NULL)
+		return ck_hs_rh_get(hs, map, h, key);
+
+	generation = ck_hs_map_generation(map, h);
+
+	do {
+		g = ck_pr_load_uint(generation);
+		probe = ck_pr_load_uint(&map->probe_maximum);
+		ck_pr_fence_load();
+
+		ck_hs_map_probe(hs, map, &n_probes, &first, h, key, &object, probe);
+
+		ck_pr_fence_load();
+		g_p = ck_pr_load_uint(generation);
+		if (g != g_p)
+			ck_hs_counter_retry(hs);
+	} while (g != g_p);
+
+	return object;
+}
+
+static void *
+ck_hs_map_get(struct ck_hs *hs,
+    struct ck_hs_map *map,
+    unsigned long h,
+    const void *key)
+{
+	unsigned long h_p;
+	void *object;
+
+	object = ck_hs_map_lookup(hs, map, h, key);
+	if (object != NULL)
+		return object;
+
+	/*
+	 * Around a rebuild, the hash value may have been derived from the
+	 * seed of another map, so misses are confirmed with the seed of
+	 * this map. The mark is stored before the seed of the set, which
+	 * the hash value was derived from.
+	 */
+	ck_pr_fence_load();
+	if (ck_pr_load_uint(&map->reseeded) == false)
+		return NULL;
+
+	h_p = hs->hf(key, map->seed);
+	if (h_p == h)
+		return NULL;
+
+	return ck_hs_map_lookup(hs, map, h_p, key);
+}
+
+void *
+ck_hs_get(struct ck_hs *hs,
+    unsigned long h,
+    const void *key)
+{
+	struct ck_hs_map *map, *next;
+	void *object;
+
+	map = ck_pr_load_ptr(&hs->map);
+	object = ck_hs_map_get(hs, map, h, key);
+
+	/*
+	 * Entries are published into the next map before they are removed
+	 * from the current map, so a miss in the current map followed by a
+	 * probe of the next map will observe any entry being migrated. A
+	 * stale map may be followed by more than one migration.
+	 */
+	while (object == NULL) {
+		next = ck_pr_load_ptr(&map->next);
+		if (next == NULL)
+			break;
+
+		map = next;
+		object = ck_hs_map_get(hs, map, h, key);
+	}
+
+	return object;
+}
+
+unsigned long
+ck_hs_get_batch(struct ck_hs *hs,
+    unsigned long n,
+    const unsigned long *hashes,
+    const void *const *keys,
+    void **objects)
+{
+	struct ck_hs_map *map, *next;
+	unsigned long i, offset, found = 0;
+
+	map = ck_pr_load_ptr(&hs->map);
+
+	/*
+	 * Issue prefetches for the first probe group of every key so that
+	 * the resulting cache misses overlap.
+	 */
+	for (i = 0; i < n; i++) {
+		offset = hashes[i] & map->mask;
+		CK_CC_PREFETCH(&map->entries[offset]);
+
+#ifdef CK_HS_TAG
+		if (map->tags != NULL)
+			CK_CC_PREFETCH(&map->tags[offset]);
+#endif
+	}
+
+	/*
+	 * If the first slot of a probe sequence is occupied by a candidate
+	 * that requires a full comparison, then prefetch the object as well.
+	 */
+	if (hs->compare != NULL) {
+		for (i = 0; i < n; i++) {
+			void *k;
+
+			offset = hashes[i] & map->mask;
+			k = ck_pr_load_ptr(&map->entries[offset]);
+			if (k == CK_HS_EMPTY || k == CK_HS_TOMBSTONE || k == keys[i])
+				continue;
+
+#ifdef CK_HS_TAG
+			if (map->tags != NULL && ck_hs_map_tag_candidate(map,
+			    offset, ck_hs_map_tag(hashes[i])) == false)
+				continue;
+#endif
+
+			if (ck_hs_map_hash_match(map, offset, hashes[i]) == false)
+				continue;
+
+#ifdef CK_HS_PP
+			if (hs->mode & CK_HS_MODE_OBJECT)
+				k = (void *)((uintptr_t)k & (((uintptr_t)1 << CK_MD_VMA_BITS) - 1));
 #endif
 
+			CK_CC_PREFETCH(k);
+		}
+	}
+
+	/* Resolve every probe with the same semantics as ck_hs_get. */
+	for (i = 0; i < n; i++) {
+		objects[i] = ck_hs_map_get(hs, map, hashes[i], keys[i]);
+
+		for (next = map; objects[i] == NULL;) {
+			next = ck_pr_load_ptr(&next->next);
+			if (next == NULL)
+				break;
+
+			objects[i] = ck_hs_map_get(hs, next, hashes[i], keys[i]);
+		}
+
+		found += objects[i] != NULL;
+	}
+
+	return found;
+}
+
+void *
+ck_hs_remove(struct ck_hs *hs,
+    unsigned long h,
+    const void *key)
+{
+	void **slot, **first, *object;
+	struct ck_hs_map *map, *old;
+	unsigned long n_probes;
+
+	if (hs->mode & CK_HS_MODE_MPMC)
+		return ck_hs_mpmc_remove(hs, h, key);
+
+	if (hs->mode & CK_HS_MODE_ROBIN_HOOD)
+		return ck_hs_rh_remove(hs, h, key);
+
+	map = ck_hs_map_writer(hs, &old);
+
+	if (old != NULL) {
+		slot = ck_hs_map_probe(hs, old, &n_probes, &first, h, key,
+		    &object, old->probe_maximum);
+		if (object != NULL) {
+			map = old;
+			goto leave;
+		}
+	}
+
+	slot = ck_hs_map_probe(hs, map, &n_probes, &first, h, key, &object, map->probe_maximum);
+	if (object == NULL)
+		return NULL;
+
+leave:
+	ck_pr_store_ptr(slot, CK_HS_TOMBSTONE);
+	ck_hs_map_vacate(map, slot - map->entries);
+	map->n_entries--;
+	map->tombstones++;
+	ck_hs_bloom_remove(hs, map);
+	ck_hs_shrink(hs);
+	return object;
+}
+
+/*
+ * Parallel growth. The slots of the current map, followed by those of a map
+ * it is being incrementally migrated into, are split into chunks that are
+ * claimed by the threads of the executor. Entries are inserted into the new
+ * map with atomic compare-and-swap operations, and the new map is published
+ * once every thread has returned.
+ */
+struct ck_hs_grow_task {
+	struct ck_hs *hs;
+	struct ck_hs_map *update;
+	struct ck_hs_map *source[2];
+	unsigned long limit;
+	ck_hs_word_t cursor;
+	unsigned int failed;
+};
+
+/*
+ * Inserts an entry known to be absent into an unpublished map that is
+ * shared by concurrent inserters. Returns false if the probe limit of the
+ * map has been exceeded.
+ */
+static bool
+ck_hs_map_insert_atomic(struct ck_hs_map *map, unsigned long h, void *entry)
+{
+	void **bucket, **cursor;
+	unsigned long i, j, offset, probes;
+
 	offset = h & map->mask;
-	*object = NULL;
 	i = probes = 0;
 
 	for (;;) {
@@ -324,262 +3108,386 @@ ck_hs_map_probe(struct ck_hs *hs,
 		for (j = 0; j < CK_HS_PROBE_L1; j++) {
 			cursor = bucket + ((j + offset) & (CK_HS_PROBE_L1 - 1));
 
-			if (probes++ == probe_limit) {
-				k = CK_HS_EMPTY;
-				goto leave;
-			}
-
-			k = ck_pr_load_ptr(cursor);
-			if (k == CK_HS_EMPTY)
-				goto leave;
+			if (probes++ == map->probe_limit)
+				return false;
 
-			if (k == CK_HS_TOMBSTONE) {
-				if (pr == NULL) {
-					pr = cursor;
-					*n_probes = probes;
-				}
+			if (ck_pr_load_ptr(cursor) != CK_HS_EMPTY)
+				continue;
 
+			ck_hs_map_occupy(map, cursor - map->entries);
+			if (ck_pr_cas_ptr(cursor, CK_HS_EMPTY, entry) == false)
 				continue;
+
+			/* The map is ordered with respect to readers by its publication. */
+			ck_hs_map_slot_meta(map, cursor - map->entries, h);
+			ck_hs_bloom_add(map->bloom, h);
+			ck_hs_mpmc_bound(map, probes);
+			return true;
+		}
+
+		offset = ck_hs_map_probe_next(map, offset, h, i++, probes);
+	}
+}
+
+static void
+ck_hs_grow_worker(void *argument)
+{
+	struct ck_hs_grow_task *task = argument;
+	struct ck_hs *hs = task->hs;
+	struct ck_hs_map *map;
+	unsigned long offset, limit, k, n, h;
+	void *entry;
+
+	for (;;) {
+		offset = (unsigned long)ck_hs_word_faa(&task->cursor, CK_HS_GROW_CHUNK);
+		if (offset >= task->limit || ck_pr_load_uint(&task->failed) != 0)
+			break;
+
+		limit = offset + CK_HS_GROW_CHUNK;
+		if (limit > task->limit)
+			limit = task->limit;
+
+		for (n = 0; offset < limit; offset++) {
+			map = task->source[0];
+			k = offset;
+			if (k >= map->capacity) {
+				k -= map->capacity;
+				map = task->source[1];
 			}
 
-#ifdef CK_HS_PP
-			if (hs->mode & CK_HS_MODE_OBJECT) {
-				if (((uintptr_t)k >> CK_MD_VMA_BITS) != hv)
-					continue;
+			entry = map->entries[k];
+			if (entry == CK_HS_EMPTY || entry == CK_HS_TOMBSTONE)
+				continue;
 
-				k = (void *)((uintptr_t)k & (((uintptr_t)1 << CK_MD_VMA_BITS) - 1));
+			h = ck_hs_map_hash(hs, map, k, ck_hs_map_unmarshal(hs, entry));
+			if (ck_hs_map_insert_atomic(task->update, h, entry) == false) {
+				ck_pr_store_uint(&task->failed, 1);
+				break;
 			}
-#endif
 
-			if (k == compare)
-				goto leave;
+			n++;
+		}
 
-			if (hs->compare == NULL)
-				continue;
+		ck_hs_word_faa(&task->update->n_entries, n);
+	}
+
+	return;
+}
+
+static void
+ck_hs_grow_mpmc_worker(void *argument)
+{
+	struct ck_hs_grow_task *task = argument;
+
+	while (ck_hs_mpmc_migrate(task->hs, task->source[0]) == true);
+	return;
+}
+
+bool
+ck_hs_grow_parallel(struct ck_hs *hs,
+    unsigned long capacity,
+    unsigned int n_threads,
+    ck_hs_executor_cb_t *executor)
+{
+	struct ck_hs_grow_task task;
+	struct ck_hs_map *map, *next, *update;
+
+	/* Robin Hood maps are grown serially, as insertion shifts entries. */
+	if (executor == NULL || n_threads < 2 || (hs->mode & CK_HS_MODE_ROBIN_HOOD))
+		return ck_hs_grow(hs, capacity);
+
+	task.hs = hs;
+
+	if (hs->mode & CK_HS_MODE_MPMC) {
+		map = ck_pr_load_ptr(&hs->map);
+		if (ck_pr_load_ptr(&map->next) == NULL && map->capacity > capacity)
+			return false;
+
+		if (ck_hs_mpmc_grow_begin(hs, map, capacity) == false)
+			return false;
+
+		/* Concurrent writers help migrate chunks as usual. */
+		task.source[0] = map;
+		executor(ck_hs_grow_mpmc_worker, &task, n_threads);
+
+		while (ck_pr_load_ptr(&hs->map) == map) {
+			if (ck_hs_mpmc_migrate(hs, map) == false)
+				ck_pr_stall();
+		}
+
+		return true;
+	}
+
+	map = hs->map;
+	next = map->next;
+
+	if (next != NULL) {
+		if (next->capacity > capacity)
+			capacity = next->capacity;
+	} else if (map->capacity > capacity) {
+		return false;
+	}
+
+	task.source[0] = map;
+	task.source[1] = next;
+	task.limit = map->capacity + (next != NULL ? next->capacity : 0);
+
+restart:
+	update = ck_hs_map_create(hs, capacity);
+	if (update == NULL)
+		return false;
 
-			if (hs->compare(k, key) == true)
-				goto leave;
-		}
+	task.update = update;
+	task.cursor = 0;
+	task.failed = 0;
+	executor(ck_hs_grow_worker, &task, n_threads);
 
-		offset = ck_hs_map_probe_next(map, offset, h, i++, probes);
+	if (task.failed != 0) {
+		/* We have hit the probe limit, map needs to be even larger. */
+		ck_hs_map_destroy(hs, update, false);
+		capacity <<= 1;
+		goto restart;
 	}
 
-leave:
-	if (probes > probe_limit) {
-		cursor = NULL;
-	} else {
-		*object = k;
-	}
+	ck_hs_counter_grow(hs, update->n_entries);
+	ck_hs_map_replace(hs, update);
+	return true;
+}
 
-	if (pr == NULL)
-		*n_probes = probes;
+/*
+ * Copies all entries of source into destination, hashing every entry with
+ * the seed of destination. Returns false if destination is too small.
+ */
+static bool
+ck_hs_map_rehash(struct ck_hs *hs, struct ck_hs_map *destination, struct ck_hs_map *source)
+{
+	void *previous;
+	unsigned long k, h;
 
-	*priority = pr;
-	return cursor;
+	for (k = 0; k < source->capacity; k++) {
+		previous = source->entries[k];
+		if (previous == CK_HS_EMPTY || previous == CK_HS_TOMBSTONE)
+			continue;
+
+		previous = ck_hs_map_unmarshal(hs, previous);
+		h = hs->hf(previous, destination->seed);
+		if (ck_hs_map_insert(destination, h, ck_hs_marshal(hs->mode, previous, h)) == false)
+			return false;
+	}
+
+	return true;
 }
 
-static inline void *
-ck_hs_marshal(unsigned int mode, const void *key, unsigned long h)
+/*
+ * Marks a map whose entries are hashed with a seed other than the seed of
+ * the hash set, so that lookups which miss in it confirm the miss with its
+ * own seed.
+ */
+static void
+ck_hs_map_reseed(struct ck_hs_map *map)
 {
-	void *insert;
 
-#ifdef CK_HS_PP
-	if (mode & CK_HS_MODE_OBJECT) {
-		insert = (void *)((uintptr_t)key | ((h >> 25) << CK_MD_VMA_BITS));
-	} else {
-		insert = (void *)key;
-	}
-#else
-	(void)mode;
-	(void)h;
-	insert = (void *)key;
-#endif
+	for (; map != NULL; map = map->next)
+		ck_pr_store_uint(&map->reseeded, true);
 
-	return insert;
+	return;
 }
 
 bool
-ck_hs_fas(struct ck_hs *hs,
-    unsigned long h,
-    const void *key,
-    void **previous)
+ck_hs_rebuild(struct ck_hs *hs, unsigned long seed)
 {
-	void **slot, **first, *object, *insert;
-	unsigned long n_probes;
-	struct ck_hs_map *map = hs->map;
+	struct ck_hs_map *map, *next, *update;
+	unsigned long capacity;
 
-	*previous = NULL;
-	slot = ck_hs_map_probe(hs, map, &n_probes, &first, h, key, &object, map->probe_maximum);
+	/* Concurrent writers may hold hash values derived from either seed. */
+	if (hs->mode & CK_HS_MODE_MPMC)
+		return false;
 
-	/* Replacement semantics presume existence. */
-	if (object == NULL)
+	map = hs->map;
+	next = map->next;
+
+	capacity = map->capacity;
+	if (next != NULL && next->capacity > capacity)
+		capacity = next->capacity;
+
+restart:
+	update = ck_hs_map_create(hs, capacity);
+	if (update == NULL)
 		return false;
 
-	insert = ck_hs_marshal(hs->mode, key, h);
+	update->seed = seed;
+	update->reseeded = true;
 
-	if (first != NULL) {
-		ck_pr_store_ptr(first, insert);
-		ck_pr_inc_uint(&map->generation[h & CK_HS_G_MASK]);
-		ck_pr_fence_atomic_store();
-		ck_pr_store_ptr(slot, CK_HS_TOMBSTONE);
-	} else {
-		ck_pr_store_ptr(slot, insert);
+	if (ck_hs_map_rehash(hs, update, map) == false ||
+	    (next != NULL && ck_hs_map_rehash(hs, update, next) == false)) {
+		ck_hs_map_destroy(hs, update, false);
+		capacity <<= 1;
+		goto restart;
 	}
 
-	*previous = object;
+	/*
+	 * Readers may observe the new map with a hash value derived from the
+	 * previous seed, or the previous maps with a hash value derived from
+	 * the new seed. Both are marked before the seed is replaced, and maps
+	 * created until ck_hs_rebuild_end inherit the mark.
+	 */
+	ck_hs_map_reseed(map);
+	ck_hs_map_replace(hs, update);
+	hs->reseeded = true;
+
+	ck_pr_fence_store();
+	hs->seed = seed;
 	return true;
 }
 
-bool
-ck_hs_set(struct ck_hs *hs,
-    unsigned long h,
-    const void *key,
-    void **previous)
+void
+ck_hs_rebuild_end(struct ck_hs *hs)
 {
-	void **slot, **first, *object, *insert;
-	unsigned long n_probes;
 	struct ck_hs_map *map;
 
-	*previous = NULL;
+	if (hs->reseeded == false)
+		return;
 
-restart:
-	map = hs->map;
+	hs->reseeded = false;
+	for (map = hs->map; map != NULL; map = map->next)
+		ck_pr_store_uint(&map->reseeded, false);
 
-	slot = ck_hs_map_probe(hs, map, &n_probes, &first, h, key, &object, map->probe_limit);
-	if (slot == NULL && first == NULL) {
-		if (ck_hs_grow(hs, map->capacity << 1) == false)
-			return false;
+	return;
+}
 
-		goto restart;
-	}
+/*
+ * Marks every slot on the probe sequence of an entry that precedes the slot
+ * holding it. Tombstones that are not marked for any entry are not needed
+ * to reach an entry and may be reclaimed.
+ */
+static void
+ck_hs_map_mark(struct ck_hs_map *map, unsigned long h, void **slot, unsigned char *marks)
+{
+	void **bucket, **cursor;
+	unsigned long offset, i, j, n;
 
-	if (n_probes > map->probe_maximum)
-		ck_pr_store_uint(&map->probe_maximum, n_probes);
+	offset = h & map->mask;
+	i = 0;
 
-	insert = ck_hs_marshal(hs->mode, key, h);
+	for (;;) {
+		bucket = (void **)((uintptr_t)&map->entries[offset] & ~(CK_MD_CACHELINE - 1));
 
-	if (first != NULL) {
-		/* If an earlier bucket was found, then store entry there. */
-		ck_pr_store_ptr(first, insert);
+		for (j = 0; j < CK_HS_PROBE_L1; j++) {
+			cursor = bucket + ((j + offset) & (CK_HS_PROBE_L1 - 1));
+			if (cursor == slot)
+				return;
 
-		/*
-		 * If a duplicate key was found, then delete it after
-		 * signaling concurrent probes to restart. Optionally,
-		 * it is possible to install tombstone after grace
-		 * period if we can guarantee earlier position of
-		 * duplicate key.
-		 */
-		if (object != NULL) {
-			ck_pr_inc_uint(&map->generation[h & CK_HS_G_MASK]);
-			ck_pr_fence_atomic_store();
-			ck_pr_store_ptr(slot, CK_HS_TOMBSTONE);
+			n = cursor - map->entries;
+			marks[n / CHAR_BIT] |= 1U << (n % CHAR_BIT);
 		}
-	} else {
-		/*
-		 * If we are storing into same slot, then atomic store is sufficient
-		 * for replacement.
-		 */
-		ck_pr_store_ptr(slot, insert);
-	}
 
-	if (object == NULL) {
-		map->n_entries++;
-		if ((map->n_entries << 1) > map->capacity)
-			ck_hs_grow(hs, map->capacity << 1);
+		offset = ck_hs_map_probe_next(map, offset, h, i++, 0);
 	}
-
-	*previous = object;
-	return true;
 }
 
 bool
-ck_hs_put(struct ck_hs *hs,
-    unsigned long h,
-    const void *key)
+ck_hs_gc(struct ck_hs *hs, unsigned long cycles, unsigned long seed)
 {
-	void **slot, **first, *object, *insert;
-	unsigned long n_probes;
 	struct ck_hs_map *map;
+	unsigned char *marks = NULL;
+	unsigned long i, n, h, n_probes, size = 0, tombstones;
+	unsigned int maximum = 0;
+	void **slot, **first, *object, *entry;
 
-restart:
 	map = hs->map;
 
-	slot = ck_hs_map_probe(hs, map, &n_probes, &first, h, key, &object, map->probe_limit);
-	if (slot == NULL && first == NULL) {
-		if (ck_hs_grow(hs, map->capacity << 1) == false)
-			return false;
+	/* Migrating into a map of equal capacity purges every tombstone. */
+	if (hs->mode & CK_HS_MODE_MPMC)
+		return ck_hs_mpmc_grow(hs, map->capacity);
 
-		goto restart;
+	if (hs->mode & CK_HS_MODE_ROBIN_HOOD) {
+		ck_hs_rh_gc(map);
+		return true;
 	}
 
-	/* Fail operation if a match was found. */
-	if (object != NULL)
-		return false;
-
-	if (n_probes > map->probe_maximum)
-		ck_pr_store_uint(&map->probe_maximum, n_probes);
+	/* Entries of a map being migrated are collected by the migration. */
+	while (map->next != NULL)
+		map = map->next;
 
-	insert = ck_hs_marshal(hs->mode, key, h);
+	if (cycles == 0) {
+		size = (map->capacity + CHAR_BIT - 1) / CHAR_BIT;
+		marks = hs->m->malloc(size);
+		if (marks == NULL)
+			return false;
 
-	if (first != NULL) {
-		/* Insert key into first bucket in probe sequence. */
-		ck_pr_store_ptr(first, insert);
-	} else {
-		/* An empty slot was found. */
-		ck_pr_store_ptr(slot, insert);
+		memset(marks, 0, size);
 	}
 
-	map->n_entries++;
-	if ((map->n_entries << 1) > map->capacity)
-		ck_hs_grow(hs, map->capacity << 1);
+	for (i = 0; i < map->capacity; i++) {
+		n = (i + seed) & map->mask;
+		entry = map->entries[n];
+		if (entry == CK_HS_EMPTY || entry == CK_HS_TOMBSTONE)
+			continue;
 
-	return true;
-}
+#ifdef CK_HS_PP
+		if (hs->mode & CK_HS_MODE_OBJECT)
+			entry = (void *)((uintptr_t)entry & (((uintptr_t)1 << CK_MD_VMA_BITS) - 1));
+#endif
 
-void *
-ck_hs_get(struct ck_hs *hs,
-    unsigned long h,
-    const void *key)
-{
-	void **first, *object;
-	struct ck_hs_map *map;
-	unsigned long n_probes;
-	unsigned int g, g_p, probe;
-	unsigned int *generation;
+		h = ck_hs_map_hash(hs, map, n, entry);
+		slot = ck_hs_map_probe(hs, map, &n_probes, &first, h, entry,
+		    &object, map->probe_maximum);
 
-	do { 
-		map = ck_pr_load_ptr(&hs->map);
-		generation = &map->generation[h & CK_HS_G_MASK];
-		g = ck_pr_load_uint(generation);
-		probe = ck_pr_load_uint(&map->probe_maximum);
-		ck_pr_fence_load();
+		/*
+		 * Move the entry into the earliest tombstone of its sequence.
+		 * Entries of a pinned map stay put, and n_probes only counts
+		 * the probes up to that tombstone, so the bound is retained.
+		 */
+		if (slot != NULL && first != NULL && ck_hs_map_pinned(map) == true) {
+			n_probes = map->probe_maximum;
+		} else if (slot != NULL && first != NULL) {
+			ck_hs_map_slot_set(map, first, ck_hs_marshal(hs->mode, entry, h), h);
+			ck_pr_inc_uint(ck_hs_map_generation(map, h));
+			ck_pr_fence_atomic_store();
+			ck_pr_store_ptr(slot, CK_HS_TOMBSTONE);
+			ck_hs_map_vacate(map, slot - map->entries);
+			slot = first;
+		}
 
-		ck_hs_map_probe(hs, map, &n_probes, &first, h, key, &object, probe);
+		if (cycles == 0) {
+			if (slot == NULL) {
+				hs->m->free(marks, size, false);
+				return false;
+			}
 
-		ck_pr_fence_load();
-		g_p = ck_pr_load_uint(generation);
-	} while (g != g_p);
+			if (n_probes > maximum)
+				maximum = n_probes;
 
-	return object;
-}
+			ck_hs_map_mark(map, h, slot, marks);
+		} else if (--cycles == 0) {
+			break;
+		}
+	}
 
-void *
-ck_hs_remove(struct ck_hs *hs,
-    unsigned long h,
-    const void *key)
-{
-	void **slot, **first, *object;
-	struct ck_hs_map *map = hs->map;
-	unsigned long n_probes;
+	/*
+	 * The following only apply to garbage collection involving a full
+	 * scan of all entries.
+	 */
+	if (marks == NULL)
+		return true;
 
-	slot = ck_hs_map_probe(hs, map, &n_probes, &first, h, key, &object, map->probe_maximum);
-	if (object == NULL)
-		return NULL;
+	tombstones = 0;
+	for (i = 0; i < map->capacity; i++) {
+		if (map->entries[i] != CK_HS_TOMBSTONE)
+			continue;
 
-	ck_pr_store_ptr(slot, CK_HS_TOMBSTONE);
-	map->n_entries--;
-	map->tombstones++;
-	return object;
+		if (marks[i / CHAR_BIT] & (1U << (i % CHAR_BIT)))
+			tombstones++;
+		else
+			ck_pr_store_ptr(&map->entries[i], CK_HS_EMPTY);
+	}
+
+	map->tombstones = tombstones;
+	if (maximum != map->probe_maximum)
+		ck_pr_store_uint(&map->probe_maximum, maximum);
+
+	hs->m->free(marks, size, false);
+	return true;
 }
 
 bool
@@ -595,13 +3503,102 @@ ck_hs_init(struct ck_hs *hs,
 	if (m == NULL || m->malloc == NULL || m->free == NULL || hf == NULL)
 		return false;
 
+	/* Shifting entries is incompatible with concurrent or deferred migration. */
+	if ((mode & CK_HS_MODE_ROBIN_HOOD) &&
+	    (mode & (CK_HS_MODE_MPMC | CK_HS_MODE_INCREMENTAL)))
+		return false;
+
+	/* Concurrent writers claim slots before their hash value is known. */
+	if ((mode & CK_HS_MODE_HASH) && (mode & CK_HS_MODE_MPMC))
+		return false;
+
+	/* Filters are maintained and replaced by a single writer. */
+	if ((mode & CK_HS_MODE_BLOOM) && (mode & CK_HS_MODE_MPMC))
+		return false;
+
+#ifndef CK_HS_RH
+	mode &= ~CK_HS_MODE_ROBIN_HOOD;
+#endif
+
+#ifndef CK_HS_CACHE
+	mode &= ~CK_HS_MODE_HASH;
+#endif
+
+#ifndef CK_HS_COUNTERS
+	mode &= ~CK_HS_MODE_STAT;
+#endif
+
 	hs->m = m;
 	hs->mode = mode;
 	hs->seed = seed;
 	hs->hf = hf;
 	hs->compare = compare;
+	hs->load_maximum = CK_HS_LOAD_MAXIMUM_DEFAULT;
+	hs->load_minimum = CK_HS_LOAD_MINIMUM_DEFAULT;
+	hs->generations = CK_HS_G;
+	hs->reseeded = false;
+	hs->counters = NULL;
+
+	if (mode & CK_HS_MODE_STAT) {
+		hs->counters = ck_hs_counters_create(m);
+		if (hs->counters == NULL)
+			return false;
+	}
 
 	hs->map = ck_hs_map_create(hs, n_entries);
-	return hs->map != NULL;
+	if (hs->map == NULL) {
+		if (hs->counters != NULL)
+			ck_hs_counters_destroy(m, hs->counters);
+
+		return false;
+	}
+
+	hs->capacity = hs->map->capacity;
+	return true;
+}
+
+bool
+ck_hs_load_factor_set(struct ck_hs *hs, unsigned int maximum, unsigned int minimum)
+{
+	struct ck_hs_map *map;
+
+	/* Shrinking must leave the map below the maximum load factor. */
+	if (maximum == 0 || maximum >= 100 || (minimum << 1) >= maximum)
+		return false;
+
+	hs->load_maximum = maximum;
+	hs->load_minimum = minimum;
+
+	for (map = hs->map; map != NULL; map = map->next)
+		ck_hs_map_load(hs, map);
+
+	return true;
+}
+
+bool
+ck_hs_generations_set(struct ck_hs *hs, unsigned int n)
+{
+	struct ck_hs_map *map = hs->map;
+	unsigned int previous = hs->generations;
+	unsigned long capacity;
+
+	if (n == 0 || n > CK_HS_G_MAXIMUM || (n & (n - 1)) != 0)
+		return false;
+
+	if (n == previous)
+		return true;
+
+	/* Counters belong to a map, so the set is re-hashed into a new one. */
+	capacity = map->capacity;
+	if (map->next != NULL && map->next->capacity > capacity)
+		capacity = map->next->capacity;
+
+	hs->generations = n;
+	if (ck_hs_grow(hs, capacity) == false) {
+		hs->generations = previous;
+		return false;
+	}
+
+	return true;
 }
 
@@ -35,8 +35,12 @@
  * We can address 32-bit platforms in a future release.
  */
 #include <ck_cc.h>
+#include <ck_limits.h>
+#include <ck_malloc.h>
 #include <ck_md.h>
 #include <ck_pr.h>
+#include <ck_sequence.h>
+#include <ck_spinlock.h>
 #include <ck_stdint.h>
 #include <stdbool.h>
 #include <string.h>
@@ -60,6 +64,33 @@
 #define CK_HT_PROBE_DEFAULT 64ULL
 #endif
 
+/* Number of buckets summarized by a word of the occupancy bitmap. */
+#define CK_HT_OCCUPIED_BITS (sizeof(unsigned int) * CHAR_BIT)
+
+/*
+ * Number of slots of the previous map that are migrated by every write
+ * operation on a table in CK_HT_MODE_INCREMENTAL mode.
+ */
+#ifndef CK_HT_MIGRATE_DEFAULT
+#define CK_HT_MIGRATE_DEFAULT 64ULL
+#endif
+
+/*
+ * In CK_HT_MODE_INLINE mode, every slot of a map is as wide as a bucket,
+ * so that an entry shares its cache line with the key storage that follows
+ * it. Keys of up to this many bytes are stored inline.
+ */
+#define CK_HT_KEY_INLINE (sizeof(struct ck_ht_entry) * CK_HT_BUCKET_MASK)
+
+/* Upper bound on the number of version counters of a map. */
+#ifndef CK_HT_VERSION_MAXIMUM
+#define CK_HT_VERSION_MAXIMUM 1024ULL
+#endif
+
+#if defined(CK_F_PR_INC_64) && defined(CK_F_PR_ADD_64)
+#define CK_HT_COUNTERS
+#endif
+
 struct ck_ht_map {
 	enum ck_ht_mode mode;
 	uint64_t deletions;
@@ -68,20 +99,185 @@ struct ck_ht_map {
 	uint64_t probe_limit;
 	uint64_t size;
 	uint64_t n_entries;
+	uint64_t tombstones;
 	uint64_t mask;
 	uint64_t capacity;
 	uint64_t step;
 	struct ck_ht_entry *entries;
+
+	/*
+	 * Slots are (1 << slot_shift) entries wide. Only the first entry of
+	 * a slot is used as such, the remainder holds inline key storage.
+	 */
+	uint64_t slot_shift;
+
+	/*
+	 * Version counters striped by the home bucket of a key. Removal or
+	 * relocation of a key increments the version of its stripe, so only
+	 * lookups of keys sharing that stripe are restarted. The deletions
+	 * counter above is only consulted by iterators.
+	 */
+	uint64_t *versions;
+	uint64_t versions_mask;
+
+	/*
+	 * In CK_HT_MODE_INLINE mode, the inline key storage of a slot is only
+	 * re-written while it holds a tombstone, within a write section of the
+	 * sequence counter of its bucket, which is striped like the version
+	 * counters.
+	 */
+	ck_sequence_t *sequences;
+
+	/*
+	 * If non-NULL, then entries are being migrated into this map. Slots
+	 * below cursor have already been migrated.
+	 */
+	struct ck_ht_map *next;
+	uint64_t cursor;
+
+	/*
+	 * One bit for every bucket of entries, which is clear only if the
+	 * bucket holds no entries. Iterators skip buckets with a clear bit.
+	 */
+	unsigned int *occupied;
+};
+
+struct ck_ht_counters {
+	/* Allocation that the counters are aligned within. */
+	void *memory;
+
+	uint64_t probes[CK_HT_STAT_PROBES];
+	uint64_t grows;
+	uint64_t grow_entries;
+
+	/* Updated by readers, so kept apart from the counters of writers. */
+	uint64_t retries CK_CC_CACHELINE;
 };
 
+/*
+ * The counters of readers are on a cache line of their own, so the
+ * counters are aligned by hand within a larger allocation.
+ */
+static struct ck_ht_counters *
+ck_ht_counters_create(struct ck_malloc *m)
+{
+	struct ck_ht_counters *counters;
+	void *memory;
+
+	memory = ck_malloc_hinted(m, sizeof(struct ck_ht_counters) +
+	    CK_MD_CACHELINE - 1, CK_MD_CACHELINE, 0);
+	if (memory == NULL)
+		return NULL;
+
+	counters = (void *)(((uintptr_t)memory + CK_MD_CACHELINE - 1) &
+	    ~(uintptr_t)(CK_MD_CACHELINE - 1));
+	memset(counters, 0, sizeof(struct ck_ht_counters));
+	counters->memory = memory;
+	return counters;
+}
+
+static void
+ck_ht_counters_destroy(struct ck_malloc *m, struct ck_ht_counters *counters)
+{
+
+	m->free(counters->memory, sizeof(struct ck_ht_counters) +
+	    CK_MD_CACHELINE - 1, false);
+	return;
+}
+
+/*
+ * Records an insertion with a probe sequence of the specified length.
+ */
+static inline void
+ck_ht_counter_probe(struct ck_ht *table, uint64_t n_probes)
+{
+#ifdef CK_HT_COUNTERS
+	unsigned int i = 0;
+
+	if (table->counters == NULL)
+		return;
+
+	while ((n_probes >>= 1) != 0 && i < CK_HT_STAT_PROBES - 1)
+		i++;
+
+	ck_pr_inc_64(&table->counters->probes[i]);
+#else
+	(void)table;
+	(void)n_probes;
+#endif
+	return;
+}
+
+/*
+ * Records a lookup that was restarted due to a concurrent deletion or
+ * relocation.
+ */
+static inline void
+ck_ht_counter_retry(struct ck_ht *table)
+{
+#ifdef CK_HT_COUNTERS
+	if (table->counters != NULL)
+		ck_pr_inc_64(&table->counters->retries);
+#else
+	(void)table;
+#endif
+	return;
+}
+
+/*
+ * Records a growth of the table that migrates the specified number of entries.
+ */
+static inline void
+ck_ht_counter_grow(struct ck_ht *table, uint64_t n_entries)
+{
+#ifdef CK_HT_COUNTERS
+	if (table->counters == NULL)
+		return;
+
+	ck_pr_inc_64(&table->counters->grows);
+	ck_pr_add_64(&table->counters->grow_entries, n_entries);
+#else
+	(void)table;
+	(void)n_entries;
+#endif
+	return;
+}
+
 void
 ck_ht_stat(struct ck_ht *table,
     struct ck_ht_stat *st)
 {
-	struct ck_ht_map *map = table->map;
+	struct ck_ht_map *map = ck_pr_load_ptr(&table->map);
+	struct ck_ht_map *next = ck_pr_load_ptr(&map->next);
+	unsigned int i;
+
+	st->n_entries = ck_pr_load_64(&map->n_entries);
+	st->probe_maximum = ck_pr_load_64(&map->probe_maximum);
+	st->tombstones = ck_pr_load_64(&map->tombstones);
+
+	if (next != NULL) {
+		st->n_entries += ck_pr_load_64(&next->n_entries);
+		st->tombstones += ck_pr_load_64(&next->tombstones);
+		if (ck_pr_load_64(&next->probe_maximum) > st->probe_maximum)
+			st->probe_maximum = ck_pr_load_64(&next->probe_maximum);
+	}
 
-	st->n_entries = map->n_entries;
-	st->probe_maximum = map->probe_maximum;
+	memset(st->probes, 0, sizeof st->probes);
+	st->retries = st->grows = st->grow_entries = 0;
+
+#ifdef CK_HT_COUNTERS
+	if (table->counters == NULL)
+		return;
+
+	for (i = 0; i < CK_HT_STAT_PROBES; i++)
+		st->probes[i] = ck_pr_load_64(&table->counters->probes[i]);
+
+	st->retries = ck_pr_load_64(&table->counters->retries);
+	st->grows = ck_pr_load_64(&table->counters->grows);
+	st->grow_entries = ck_pr_load_64(&table->counters->grow_entries);
+#else
+	(void)i;
+#endif
 	return;
 }
 
@@ -121,13 +317,29 @@ static struct ck_ht_map *
 ck_ht_map_create(struct ck_ht *table, uint64_t entries)
 {
 	struct ck_ht_map *map;
-	uint64_t size, n_entries;
+	uint64_t size, n_entries, n_occupied, n_versions, n_sequences = 0;
+	uint64_t slot_shift = 0;
 
 	n_entries = ck_internal_power_2(entries);
-	size = sizeof(struct ck_ht_map) +
-		   (sizeof(struct ck_ht_entry) * n_entries + CK_MD_CACHELINE - 1);
+	n_occupied = (n_entries + CK_HT_BUCKET_LENGTH - 1) >> CK_HT_BUCKET_SHIFT;
+	n_versions = n_occupied > CK_HT_VERSION_MAXIMUM ?
+	    CK_HT_VERSION_MAXIMUM : n_occupied;
+	n_occupied = (n_occupied + CK_HT_OCCUPIED_BITS - 1) / CK_HT_OCCUPIED_BITS;
+
+	if (table->mode & CK_HT_MODE_INLINE) {
+		slot_shift = CK_HT_BUCKET_SHIFT;
+		n_sequences = n_versions;
+	}
 
-	map = table->m->malloc(size);
+	size = sizeof(struct ck_ht_map) +
+		   (sizeof(struct ck_ht_entry) * (n_entries << slot_shift) +
+		    CK_MD_CACHELINE - 1) +
+		   sizeof(uint64_t) * n_versions +
+		   sizeof(ck_sequence_t) * n_sequences +
+		   sizeof(unsigned int) * n_occupied;
+
+	map = ck_malloc_hinted(table->m, size, CK_MD_CACHELINE,
+	    CK_MALLOC_HINT_RANDOM | CK_MALLOC_HINT_SHARED);
 	if (map == NULL)
 		return NULL;
 
@@ -142,6 +354,10 @@ ck_ht_map_create(struct ck_ht *table, uint64_t entries)
 	map->step = ck_internal_bsf_64(map->capacity);
 	map->mask = map->capacity - 1;
 	map->n_entries = 0;
+	map->tombstones = 0;
+	map->next = NULL;
+	map->cursor = 0;
+	map->slot_shift = slot_shift;
 	map->entries = (struct ck_ht_entry *)(((uintptr_t)(map + 1) +
 	    CK_MD_CACHELINE - 1) & ~(CK_MD_CACHELINE - 1));
 
@@ -150,10 +366,246 @@ ck_ht_map_create(struct ck_ht *table, uint64_t entries)
 		return NULL;
 	}
 
-	memset(map->entries, 0, sizeof(struct ck_ht_entry) * n_entries);
+	memset(map->entries, 0, sizeof(struct ck_ht_entry) * (n_entries << slot_shift));
+
+	map->versions = (uint64_t *)(void *)(map->entries + (n_entries << slot_shift));
+	map->versions_mask = n_versions - 1;
+	memset(map->versions, 0, sizeof(uint64_t) * n_versions);
+
+	map->sequences = (ck_sequence_t *)(void *)(map->versions + n_versions);
+	memset(map->sequences, 0, sizeof(ck_sequence_t) * n_sequences);
+
+	map->occupied = (unsigned int *)(void *)(map->sequences + n_sequences);
+	memset(map->occupied, 0, sizeof(unsigned int) * n_occupied);
+
+	if (n_sequences == 0)
+		map->sequences = NULL;
+
 	return map;
 }
 
+/*
+ * Returns the entry of the slot at offset.
+ */
+static inline struct ck_ht_entry *
+ck_ht_map_entry(struct ck_ht_map *map, uint64_t offset)
+{
+
+	return map->entries + (offset << map->slot_shift);
+}
+
+/*
+ * Returns the offset of the slot of an entry.
+ */
+static inline uint64_t
+ck_ht_map_offset(struct ck_ht_map *map, struct ck_ht_entry *entry)
+{
+
+	return (uint64_t)(entry - map->entries) >> map->slot_shift;
+}
+
+/*
+ * Returns the inline key storage of a slot, which follows its entry.
+ */
+static inline char *
+ck_ht_map_key_inline(struct ck_ht_entry *slot)
+{
+
+	return (char *)(slot + 1);
+}
+
+/*
+ * Returns the sequence counter that guards the inline key storage of a
+ * slot.
+ */
+static inline ck_sequence_t *
+ck_ht_map_sequence(struct ck_ht_map *map, struct ck_ht_entry *slot)
+{
+	uint64_t bucket = ck_ht_map_offset(map, slot) >> CK_HT_BUCKET_SHIFT;
+
+	return &map->sequences[bucket & map->versions_mask];
+}
+
+/*
+ * Returns true if a slot no longer holds the contents of snapshot.
+ */
+static inline bool
+ck_ht_entry_changed(struct ck_ht_entry *slot, struct ck_ht_entry *snapshot)
+{
+
+#ifndef CK_HT_PP
+	if (ck_pr_load_64(&slot->key_length) != snapshot->key_length ||
+	    ck_pr_load_64(&slot->hash) != snapshot->hash)
+		return true;
+#endif
+
+	return (uintptr_t)ck_pr_load_ptr(&slot->key) != snapshot->key ||
+	    (uintptr_t)ck_pr_load_ptr(&slot->value) != snapshot->value;
+}
+
+/*
+ * Stores the key of entry into storage owned by the table for a slot of
+ * map, and initializes insert with the entry to publish into the slot.
+ * Keys of up to CK_HT_KEY_INLINE bytes are stored inline. Longer keys are
+ * copied into memory obtained from the allocator, unless owned already
+ * refers to a copy of the key that is being moved. Returns false if
+ * memory could not be allocated.
+ */
+static bool
+ck_ht_map_key_own(struct ck_ht *table,
+    struct ck_ht_map *map,
+    struct ck_ht_entry *slot,
+    struct ck_ht_entry *entry,
+    void *owned,
+    struct ck_ht_entry *insert)
+{
+	uint16_t key_length = ck_ht_entry_key_length(entry);
+	void *key = ck_ht_entry_key(entry);
+	void *pointer;
+
+	if (key_length > CK_HT_KEY_INLINE) {
+		pointer = owned;
+		if (pointer == NULL) {
+			pointer = table->m->malloc(key_length);
+			if (pointer == NULL)
+				return false;
+
+			memcpy(pointer, key, key_length);
+		}
+	} else {
+		pointer = ck_ht_map_key_inline(slot);
+
+		/*
+		 * Concurrent readers may be comparing against the previous
+		 * key of a tombstone. Storage that already holds the key,
+		 * as is the case for replacement, is left untouched.
+		 */
+		if (pointer != owned) {
+			if (slot->key == CK_HT_KEY_TOMBSTONE) {
+				ck_sequence_t *sequence = ck_ht_map_sequence(map, slot);
+
+				ck_sequence_write_begin(sequence);
+				memcpy(pointer, key, key_length);
+				ck_sequence_write_end(sequence);
+			} else {
+				memcpy(pointer, key, key_length);
+			}
+		}
+	}
+
+	*insert = *entry;
+#ifdef CK_HT_PP
+	insert->key = (uintptr_t)pointer | ((uintptr_t)key_length << CK_MD_VMA_BITS);
+#else
+	insert->key = (uintptr_t)pointer;
+#endif
+	return true;
+}
+
+/*
+ * Releases the copies of keys longer than CK_HT_KEY_INLINE bytes that are
+ * owned by the entries of a map.
+ */
+static void
+ck_ht_map_key_release(struct ck_ht *table, struct ck_ht_map *map, bool defer)
+{
+	struct ck_ht_entry *entry;
+	uint64_t k;
+
+	if ((map->mode & CK_HT_MODE_INLINE) == 0)
+		return;
+
+	for (k = 0; k < map->capacity; k++) {
+		entry = ck_ht_map_entry(map, k);
+		if (entry->key == CK_HT_KEY_EMPTY || entry->key == CK_HT_KEY_TOMBSTONE)
+			continue;
+
+		if (ck_ht_entry_key_length(entry) > CK_HT_KEY_INLINE) {
+			table->m->free(ck_ht_entry_key(entry),
+			    ck_ht_entry_key_length(entry), defer);
+		}
+	}
+
+	return;
+}
+
+/*
+ * Returns the version counter that guards lookups of keys with the
+ * specified hash value.
+ */
+static inline uint64_t *
+ck_ht_map_version(struct ck_ht_map *map, ck_ht_hash_t h)
+{
+
+	return &map->versions[(h.value >> CK_HT_BUCKET_SHIFT) & map->versions_mask];
+}
+
+/*
+ * Marks the bucket of an entry as occupied. Must precede the publication
+ * of a key into the entry.
+ */
+static inline void
+ck_ht_map_occupy(struct ck_ht_map *map, struct ck_ht_entry *entry)
+{
+	uint64_t bucket = ck_ht_map_offset(map, entry) >> CK_HT_BUCKET_SHIFT;
+	unsigned int *word = &map->occupied[bucket / CK_HT_OCCUPIED_BITS];
+	unsigned int bit = 1U << (bucket % CK_HT_OCCUPIED_BITS);
+
+	if ((*word & bit) == 0)
+		ck_pr_store_uint(word, *word | bit);
+
+	return;
+}
+
+/*
+ * Clears the occupancy bit of the bucket of an entry if the bucket no
+ * longer holds any keys.
+ */
+static inline void
+ck_ht_map_vacate(struct ck_ht_map *map, struct ck_ht_entry *entry)
+{
+	uint64_t bucket = ck_ht_map_offset(map, entry) >> CK_HT_BUCKET_SHIFT;
+	unsigned int *word = &map->occupied[bucket / CK_HT_OCCUPIED_BITS];
+	struct ck_ht_entry *cursor;
+	size_t j;
+
+	for (j = 0; j < CK_HT_BUCKET_LENGTH && j < map->capacity; j++) {
+		cursor = ck_ht_map_entry(map, (bucket << CK_HT_BUCKET_SHIFT) + j);
+		if (cursor->key != CK_HT_KEY_EMPTY &&
+		    cursor->key != CK_HT_KEY_TOMBSTONE)
+			return;
+	}
+
+	ck_pr_store_uint(word, *word & ~(1U << (bucket % CK_HT_OCCUPIED_BITS)));
+	return;
+}
+
+/*
+ * Returns the first entry offset at or after offset whose bucket may hold
+ * keys, or the capacity of the map if there is none.
+ */
+static uint64_t
+ck_ht_map_scan(struct ck_ht_map *map, uint64_t offset)
+{
+	uint64_t bucket = offset >> CK_HT_BUCKET_SHIFT;
+	uint64_t w = bucket / CK_HT_OCCUPIED_BITS, slot;
+	uint64_t n = (map->capacity + CK_HT_BUCKET_LENGTH - 1) >> CK_HT_BUCKET_SHIFT;
+	unsigned int word;
+
+	n = (n + CK_HT_OCCUPIED_BITS - 1) / CK_HT_OCCUPIED_BITS;
+	word = ck_pr_load_uint(&map->occupied[w]) & (~0U << (bucket % CK_HT_OCCUPIED_BITS));
+
+	while (word == 0) {
+		if (++w == n)
+			return map->capacity;
+
+		word = ck_pr_load_uint(&map->occupied[w]);
+	}
+
+	slot = (w * CK_HT_OCCUPIED_BITS + ck_cc_ffs(word) - 1) << CK_HT_BUCKET_SHIFT;
+	return slot > offset ? slot : offset;
+}
+
 static void
 ck_ht_map_destroy(struct ck_malloc *m, struct ck_ht_map *map, bool defer)
 {
@@ -188,9 +640,20 @@ ck_ht_init(ck_ht_t *table,
 	if (m == NULL || m->malloc == NULL || m->free == NULL)
 		return false;
 
+	/* Only keys that are byte strings may be copied. */
+	if ((mode & CK_HT_MODE_INLINE) && (mode & CK_HT_MODE_BYTESTRING) == 0)
+		return false;
+
 	table->m = m;
 	table->mode = mode;
 	table->seed = seed;
+	table->counters = NULL;
+
+	if (mode & CK_HT_MODE_STAT) {
+		table->counters = ck_ht_counters_create(m);
+		if (table->counters == NULL)
+			return false;
+	}
 
 	if (h == NULL) {
 		table->h = ck_ht_hash_wrapper;
@@ -199,7 +662,14 @@ ck_ht_init(ck_ht_t *table,
 	}
 
 	table->map = ck_ht_map_create(table, entries);
-	return table->map != NULL;
+	if (table->map == NULL) {
+		if (table->counters != NULL)
+			ck_ht_counters_destroy(m, table->counters);
+
+		return false;
+	}
+
+	return true;
 }
 
 static struct ck_ht_entry *
@@ -231,14 +701,14 @@ retry:
 		 * the beginning of the cache line. Only when the complete cache line has
 		 * been scanned do we move on to the next row.
 		 */
-		bucket = (void *)((uintptr_t)(map->entries + offset) &
-			     ~(CK_MD_CACHELINE - 1));
+		bucket = ck_ht_map_entry(map, offset & ~CK_HT_BUCKET_MASK);
 
 		for (j = 0; j < CK_HT_BUCKET_LENGTH; j++) {
 			uint16_t k;
 
 			probes++;
-			cursor = bucket + ((j + offset) & (CK_HT_BUCKET_LENGTH - 1));
+			cursor = bucket + (((j + offset) & CK_HT_BUCKET_MASK) <<
+			    map->slot_shift);
 
 			/*
 			 * It is probably worth it to encapsulate probe state
@@ -260,7 +730,7 @@ retry:
 			if (cursor->key == (uintptr_t)key)
 				goto leave;
 
-			if (map->mode == CK_HT_MODE_BYTESTRING) {
+			if (map->mode & CK_HT_MODE_BYTESTRING) {
 				void *pointer;
 
 				/*
@@ -313,7 +783,8 @@ leave:
 }
 
 static struct ck_ht_entry *
-ck_ht_map_probe_rd(struct ck_ht_map *map,
+ck_ht_map_probe_rd(struct ck_ht *table,
+    struct ck_ht_map *map,
     ck_ht_hash_t h,
     ck_ht_entry_t *snapshot,
     const void *key,
@@ -325,11 +796,12 @@ ck_ht_map_probe_rd(struct ck_ht_map *map,
 	uint64_t probe_maximum;
 
 #ifndef CK_HT_PP
+	uint64_t *version = ck_ht_map_version(map, h);
 	uint64_t d = 0;
 	uint64_t d_prime = 0;
-retry:
 #endif
 
+retry:
 	probe_maximum = ck_pr_load_64(&map->probe_maximum);
 	offset = h.value & map->mask;
 
@@ -339,21 +811,21 @@ retry:
 		 * the beginning of the cache line. Only when the complete cache line has
 		 * been scanned do we move on to the next row.
 		 */
-		bucket = (void *)((uintptr_t)(map->entries + offset) &
-			     ~(CK_MD_CACHELINE - 1));
+		bucket = ck_ht_map_entry(map, offset & ~CK_HT_BUCKET_MASK);
 
 		for (j = 0; j < CK_HT_BUCKET_LENGTH; j++) {
 			uint16_t k;
 
 			probes++;
-			cursor = bucket + ((j + offset) & (CK_HT_BUCKET_LENGTH - 1));
+			cursor = bucket + (((j + offset) & CK_HT_BUCKET_MASK) <<
+			    map->slot_shift);
 
 #ifdef CK_HT_PP
 			snapshot->key = (uintptr_t)ck_pr_load_ptr(&cursor->key);
 			ck_pr_fence_load();
 			snapshot->value = (uintptr_t)ck_pr_load_ptr(&cursor->value);
 #else
-			d = ck_pr_load_64(&map->deletions);
+			d = ck_pr_load_64(version);
 			snapshot->key = (uintptr_t)ck_pr_load_ptr(&cursor->key);
 			ck_pr_fence_load();
 			snapshot->key_length = ck_pr_load_64(&cursor->key_length);
@@ -375,7 +847,7 @@ retry:
 			if (snapshot->key == (uintptr_t)key)
 				goto leave;
 
-			if (map->mode == CK_HT_MODE_BYTESTRING) {
+			if (map->mode & CK_HT_MODE_BYTESTRING) {
 				void *pointer;
 
 				/*
@@ -392,17 +864,48 @@ retry:
 				if (snapshot->hash != h.value)
 					continue;
 
-				d_prime = ck_pr_load_64(&map->deletions);
+				d_prime = ck_pr_load_64(version);
 
 				/*
 				 * It is possible that the slot was
 				 * replaced, initiate a re-probe.
 				 */
-				if (d != d_prime)
+				if (d != d_prime) {
+					ck_ht_counter_retry(table);
 					goto retry;
+				}
 #endif
 
 				pointer = ck_ht_entry_key(snapshot);
+				if ((map->mode & CK_HT_MODE_INLINE) &&
+				    k <= CK_HT_KEY_INLINE) {
+					ck_sequence_t *sequence;
+					unsigned int s;
+					bool match;
+
+					/*
+					 * Inline storage may be re-used by the
+					 * writer as soon as the slot holds a
+					 * tombstone. The comparison is only valid
+					 * if the storage was not re-written and
+					 * the slot still holds the snapshot.
+					 */
+					sequence = ck_ht_map_sequence(map, cursor);
+					s = ck_sequence_read_begin(sequence);
+					match = memcmp(pointer, key, key_length) == 0;
+					ck_pr_fence_load();
+					if (ck_ht_entry_changed(cursor, snapshot) == true ||
+					    ck_sequence_read_retry(sequence, s) == true) {
+						ck_ht_counter_retry(table);
+						goto retry;
+					}
+
+					if (match == true)
+						goto leave;
+
+					continue;
+				}
+
 				if (memcmp(pointer, key, key_length) == 0)
 					goto leave;
 			}
@@ -424,8 +927,13 @@ uint64_t
 ck_ht_count(ck_ht_t *table)
 {
 	struct ck_ht_map *map = ck_pr_load_ptr(&table->map);
+	struct ck_ht_map *next = ck_pr_load_ptr(&map->next);
+	uint64_t n_entries = ck_pr_load_64(&map->n_entries);
+
+	if (next != NULL)
+		n_entries += ck_pr_load_64(&next->n_entries);
 
-	return ck_pr_load_64(&map->n_entries);
+	return n_entries;
 }
 
 bool
@@ -434,167 +942,526 @@ ck_ht_next(struct ck_ht *table,
     struct ck_ht_entry **entry)
 {
 	struct ck_ht_map *map = table->map;
+	uint64_t base = 0, offset;
 	uintptr_t key;
 
-	if (i->offset >= map->capacity)
-		return false;
+	for (;;) {
+		/*
+		 * If a migration is in progress, then the iteration space
+		 * spans the slots of the current map followed by those of
+		 * the map being migrated into.
+		 */
+		while (i->offset >= base + map->capacity) {
+			base += map->capacity;
+			map = map->next;
+			if (map == NULL)
+				return false;
+		}
 
-	do {
-		key = map->entries[i->offset].key;
-		if (key != CK_HT_KEY_EMPTY && key != CK_HT_KEY_TOMBSTONE)
-			break;
-	} while (++i->offset < map->capacity);
+		offset = i->offset - base;
 
-	if (i->offset >= map->capacity)
-		return false;
+		/* Skip over buckets that hold no keys. */
+		if ((offset & CK_HT_BUCKET_MASK) == 0) {
+			offset = ck_ht_map_scan(map, offset);
+			i->offset = base + offset;
+			if (offset >= map->capacity)
+				continue;
+		}
 
-	*entry = map->entries + i->offset++;
-	return true;
+		i->offset++;
+		key = ck_ht_map_entry(map, offset)->key;
+		if (key != CK_HT_KEY_EMPTY && key != CK_HT_KEY_TOMBSTONE) {
+			*entry = ck_ht_map_entry(map, offset);
+			return true;
+		}
+	}
 }
 
-bool
-ck_ht_reset_size_spmc(struct ck_ht *table, uint64_t size)
+/*
+ * Returns a value that changes whenever an entry of a map, or of the map
+ * it is being migrated into, may have been relocated.
+ */
+static uint64_t
+ck_ht_map_iteration(struct ck_ht_map *map)
 {
-	struct ck_ht_map *map, *update;
+	struct ck_ht_map *next;
+	uint64_t version;
 
-	map = table->map;
-	update = ck_ht_map_create(table, size);
-	if (update == NULL)
-		return false;
+	version = ck_pr_load_64(&map->deletions);
+	version += ck_pr_load_64(&map->cursor);
 
-	ck_pr_store_ptr(&table->map, update);
-	ck_ht_map_destroy(table->m, map, true);
-	return true;
+	next = ck_pr_load_ptr(&map->next);
+	if (next != NULL) {
+		version += (uintptr_t)next;
+		version += ck_pr_load_64(&next->deletions);
+	}
+
+	return version;
 }
 
-bool
-ck_ht_reset_spmc(struct ck_ht *table)
+void
+ck_ht_iterator_partition(struct ck_ht *table,
+    struct ck_ht_iterator *iterators,
+    unsigned int n)
 {
-	struct ck_ht_map *map = table->map;
+	struct ck_ht_map *map = ck_pr_load_ptr(&table->map);
+	struct ck_ht_map *next;
+	uint64_t version, total, k;
+
+	version = ck_ht_map_iteration(map);
+	ck_pr_fence_load();
+
+	/* Slots of the map being migrated into follow those of the map. */
+	total = map->capacity;
+	next = ck_pr_load_ptr(&map->next);
+	if (next != NULL)
+		total += next->capacity;
+
+	/* Ranges are aligned to buckets so that each may skip buckets. */
+	for (k = 0; k < n; k++) {
+		iterators[k].current = NULL;
+		iterators[k].offset = k == 0 ? 0 : iterators[k - 1].limit;
+		iterators[k].limit = k + 1 == n ? total :
+		    (total * (k + 1) / n) & ~(uint64_t)CK_HT_BUCKET_MASK;
+		iterators[k].map = map;
+		iterators[k].version = version;
+	}
 
-	return ck_ht_reset_size_spmc(table, map->capacity);
+	return;
 }
 
 bool
-ck_ht_grow_spmc(ck_ht_t *table, uint64_t capacity)
+ck_ht_next_spmc(struct ck_ht *table,
+    struct ck_ht_iterator *i,
+    struct ck_ht_entry *snapshot)
 {
-	struct ck_ht_map *map, *update;
-	struct ck_ht_entry *bucket, *previous;
-	struct ck_ht_hash h;
-	size_t k, i, j, offset;
-	uint64_t probes;
+	struct ck_ht_map *map;
+	struct ck_ht_entry *cursor;
+	uint64_t base, offset;
+#ifndef CK_HT_PP
+	uint64_t d, d_prime;
+#endif
 
-restart:
-	map = table->map;
+	if (i->map == NULL)
+		ck_ht_iterator_partition(table, i, 1);
 
-	if (map->capacity >= capacity)
-		return false;
+	while (i->offset < i->limit) {
+		/* Slots beyond the map belong to the map being migrated into. */
+		map = i->map;
+		base = 0;
+		if (i->offset >= map->capacity) {
+			base = map->capacity;
+			map = ck_pr_load_ptr(&map->next);
+		}
 
-	update = ck_ht_map_create(table, capacity);
-	if (update == NULL)
-		return false;
+		offset = i->offset - base;
+		if ((offset & CK_HT_BUCKET_MASK) == 0) {
+			offset = ck_ht_map_scan(map, offset);
+			i->offset = base + offset;
+			if (i->offset >= i->limit) {
+				i->offset = i->limit;
+				break;
+			}
 
-	for (k = 0; k < map->capacity; k++) {
-		previous = &map->entries[k];
+			if (offset >= map->capacity)
+				continue;
+		}
 
-		if (previous->key == CK_HT_KEY_EMPTY || previous->key == CK_HT_KEY_TOMBSTONE)
-			continue;
+		cursor = ck_ht_map_entry(map, offset);
 
-		if (table->mode == CK_HT_MODE_BYTESTRING) {
 #ifdef CK_HT_PP
-			void *key;
-			uint16_t key_length;
+		snapshot->key = (uintptr_t)ck_pr_load_ptr(&cursor->key);
+		ck_pr_fence_load();
+		snapshot->value = (uintptr_t)ck_pr_load_ptr(&cursor->value);
+		ck_pr_fence_load();
 
-			key = ck_ht_entry_key(previous);
-			key_length = ck_ht_entry_key_length(previous);
+		/* The slot was recycled while it was being copied. */
+		if (snapshot->key != (uintptr_t)ck_pr_load_ptr(&cursor->key))
+			continue;
+#else
+		d = ck_pr_load_64(&map->deletions);
+		snapshot->key = (uintptr_t)ck_pr_load_ptr(&cursor->key);
+		ck_pr_fence_load();
+		snapshot->key_length = ck_pr_load_64(&cursor->key_length);
+		snapshot->hash = ck_pr_load_64(&cursor->hash);
+		snapshot->value = (uintptr_t)ck_pr_load_ptr(&cursor->value);
+		ck_pr_fence_load();
+		d_prime = ck_pr_load_64(&map->deletions);
+
+		if (d != d_prime ||
+		    snapshot->key != (uintptr_t)ck_pr_load_ptr(&cursor->key))
+			continue;
 #endif
 
+		i->offset++;
+		if (snapshot->key != CK_HT_KEY_EMPTY &&
+		    snapshot->key != CK_HT_KEY_TOMBSTONE)
+			return true;
+	}
+
+	return false;
+}
+
+bool
+ck_ht_iterator_stale(struct ck_ht *table, struct ck_ht_iterator *i)
+{
+
+	if (i->map == NULL)
+		return false;
+
+	ck_pr_fence_load();
+	return ck_pr_load_ptr(&table->map) != i->map ||
+	    ck_ht_map_iteration(i->map) != i->version;
+}
+
+bool
+ck_ht_reset_size_spmc(struct ck_ht *table, uint64_t size)
+{
+	struct ck_ht_map *map, *update;
+
+	map = table->map;
+	update = ck_ht_map_create(table, size);
+	if (update == NULL)
+		return false;
+
+	ck_pr_store_ptr(&table->map, update);
+	if (map->next != NULL) {
+		ck_ht_map_key_release(table, map->next, true);
+		ck_ht_map_destroy(table->m, map->next, true);
+	}
+
+	ck_ht_map_key_release(table, map, true);
+	ck_ht_map_destroy(table->m, map, true);
+	return true;
+}
+
+bool
+ck_ht_reset_spmc(struct ck_ht *table)
+{
+	struct ck_ht_map *map = table->map;
+
+	return ck_ht_reset_size_spmc(table, map->capacity);
+}
+
+/*
+ * Computes the hash value of an entry that is stored in a map.
+ */
+static void
+ck_ht_entry_rehash(struct ck_ht *table,
+    struct ck_ht_entry *entry,
+    struct ck_ht_hash *h)
+{
+
 #ifndef CK_HT_PP
-			h.value = previous->hash;
+	(void)table;
+	h->value = entry->hash;
 #else
-			table->h(&h, key, key_length, table->seed);
+	if (table->mode & CK_HT_MODE_BYTESTRING) {
+		table->h(h, ck_ht_entry_key(entry), ck_ht_entry_key_length(entry),
+		    table->seed);
+	} else {
+		table->h(h, &entry->key, sizeof(entry->key), table->seed);
+	}
 #endif
-		} else {
+
+	return;
+}
+
+/*
+ * Stores an entry into the first empty slot of its probe sequence. The key
+ * is published last, so the map may already be visible to readers. Returns
+ * false if the probe limit of the map has been reached.
+ */
+static bool
+ck_ht_map_insert(struct ck_ht *table,
+    struct ck_ht_map *map,
+    struct ck_ht_entry *entry)
+{
+	struct ck_ht_entry *bucket, *cursor, owned;
+	struct ck_ht_hash h;
+	size_t i, j, offset;
+	uint64_t probes = 0;
+
+	ck_ht_entry_rehash(table, entry, &h);
+	offset = h.value & map->mask;
+
+	for (i = 0; i < map->probe_limit; i++) {
+		bucket = ck_ht_map_entry(map, offset & ~CK_HT_BUCKET_MASK);
+
+		for (j = 0; j < CK_HT_BUCKET_LENGTH; j++) {
+			cursor = bucket + (((j + offset) & CK_HT_BUCKET_MASK) <<
+			    map->slot_shift);
+
+			probes++;
+			if (cursor->key != CK_HT_KEY_EMPTY)
+				continue;
+
+			/* Storage of keys that are not inline moves along. */
+			if (map->mode & CK_HT_MODE_INLINE) {
+				ck_ht_map_key_own(table, map, cursor, entry,
+				    ck_ht_entry_key(entry), &owned);
+				entry = &owned;
+			}
+
+			if (probes > map->probe_maximum)
+				ck_pr_store_64(&map->probe_maximum, probes);
+
+			ck_ht_map_occupy(map, cursor);
+
 #ifndef CK_HT_PP
-			h.value = previous->hash;
-#else
-			table->h(&h, &previous->key, sizeof(previous->key), table->seed);
+			ck_pr_store_64(&cursor->key_length, entry->key_length);
+			ck_pr_store_64(&cursor->hash, entry->hash);
 #endif
+			ck_pr_store_ptr(&cursor->value, (void *)entry->value);
+			ck_pr_fence_store();
+			ck_pr_store_ptr(&cursor->key, (void *)entry->key);
+			ck_pr_store_64(&map->n_entries, map->n_entries + 1);
+			return true;
 		}
 
-		offset = h.value & update->mask;
-		probes = 0;
+		offset = ck_ht_map_probe_next(map, offset, h, probes);
+	}
+
+	return false;
+}
+
+/*
+ * Copies every entry of map into update. Returns false if the probe limit
+ * of update was reached.
+ */
+static bool
+ck_ht_map_copy(struct ck_ht *table,
+    struct ck_ht_map *update,
+    struct ck_ht_map *map)
+{
+	struct ck_ht_entry *previous;
+	size_t k;
+
+	for (k = 0; k < map->capacity; k++) {
+		previous = ck_ht_map_entry(map, k);
 
-		for (i = 0; i < update->probe_limit; i++) {
-			bucket = (void *)((uintptr_t)(update->entries + offset) & ~(CK_MD_CACHELINE - 1));
+		if (previous->key == CK_HT_KEY_EMPTY || previous->key == CK_HT_KEY_TOMBSTONE)
+			continue;
 
-			for (j = 0; j < CK_HT_BUCKET_LENGTH; j++) {
-				struct ck_ht_entry *cursor = bucket + ((j + offset) & (CK_HT_BUCKET_LENGTH - 1));
+		if (ck_ht_map_insert(table, update, previous) == false)
+			return false;
+	}
 
-				probes++;
-				if (cursor->key == CK_HT_KEY_EMPTY) {
-					*cursor = *previous;
-					update->n_entries++;
+	return true;
+}
 
-					if (probes > update->probe_maximum)
-						update->probe_maximum = probes;
+bool
+ck_ht_grow_spmc(ck_ht_t *table, uint64_t capacity)
+{
+	struct ck_ht_map *map, *next, *update;
 
-					break;
-				}
-			}
+restart:
+	map = table->map;
+	next = map->next;
 
-			if (j < CK_HT_BUCKET_LENGTH)
-				break;
+	/*
+	 * If a migration is in progress, then it is completed as part of
+	 * this operation. The capacity of the in-progress migration target
+	 * is the effective capacity of the table.
+	 */
+	if (next != NULL) {
+		if (next->capacity > capacity)
+			capacity = next->capacity;
+	} else if (map->capacity >= capacity) {
+		return false;
+	}
 
-			offset = ck_ht_map_probe_next(update, offset, h, probes);
-		}
+	update = ck_ht_map_create(table, capacity);
+	if (update == NULL)
+		return false;
+
+	if (ck_ht_map_copy(table, update, map) == false ||
+	    (next != NULL && ck_ht_map_copy(table, update, next) == false)) {
+		/*
+		 * We have hit the probe limit, the map needs to be even
+		 * larger.
+		 */
+		ck_ht_map_destroy(table->m, update, false);
+		capacity <<= 1;
+		goto restart;
+	}
+
+	ck_ht_counter_grow(table, update->n_entries);
+	ck_pr_fence_store();
+	ck_pr_store_ptr(&table->map, update);
+	if (next != NULL)
+		ck_ht_map_destroy(table->m, next, true);
+
+	ck_ht_map_destroy(table->m, map, true);
+	return true;
+}
+
+/*
+ * Migrates up to n slots of the current map into the next map. Once the
+ * last slot has been migrated, the next map is published and the previous
+ * map is scheduled for destruction.
+ */
+static void
+ck_ht_migrate(struct ck_ht *table, struct ck_ht_map *map, uint64_t n)
+{
+	struct ck_ht_map *update = map->next;
+	struct ck_ht_entry *previous;
+	uint64_t k, limit;
+
+	limit = map->capacity - map->cursor;
+	if (n > limit)
+		n = limit;
+
+	for (k = map->cursor, limit = k + n; k < limit; k++) {
+		previous = ck_ht_map_entry(map, k);
+
+		/*
+		 * The cursor is advanced before the entry is moved so that
+		 * iterators observing the move are considered stale.
+		 */
+		ck_pr_store_64(&map->cursor, k + 1);
+		if (previous->key == CK_HT_KEY_EMPTY || previous->key == CK_HT_KEY_TOMBSTONE)
+			continue;
 
-		if (i == update->probe_limit) {
+		ck_pr_fence_store();
+		if (ck_ht_map_insert(table, update, previous) == false) {
 			/*
-			 * We have hit the probe limit, the map needs to be even
-			 * larger.
+			 * The next map is too small to complete the migration,
+			 * fall back to a complete re-hash into a larger map.
 			 */
-			ck_ht_map_destroy(table->m, update, false);
-			capacity <<= 1;
-			goto restart;
+			ck_ht_grow_spmc(table, update->capacity << 1);
+			return;
 		}
+
+		/*
+		 * Readers probe the current map before the next map, so the
+		 * entry must be visible in the next map before it is removed
+		 * from the current map. The slot is never re-used, so readers
+		 * of the current map need not be restarted.
+		 */
+		ck_pr_fence_store();
+		ck_pr_store_ptr(&previous->key, (void *)CK_HT_KEY_TOMBSTONE);
+		ck_ht_map_vacate(map, previous);
+		ck_pr_store_64(&map->n_entries, map->n_entries - 1);
+		ck_pr_store_64(&map->tombstones, map->tombstones + 1);
+	}
+
+	if (map->cursor == map->capacity) {
+		ck_pr_fence_store();
+		ck_pr_store_ptr(&table->map, update);
+		ck_ht_map_destroy(table->m, map, true);
 	}
 
+	return;
+}
+
+/*
+ * Begins an incremental migration into a map of the specified capacity.
+ * Tables that are not in incremental mode are grown immediately.
+ */
+static bool
+ck_ht_grow_incremental(struct ck_ht *table, uint64_t capacity)
+{
+	struct ck_ht_map *map, *update;
+
+	map = table->map;
+	if ((table->mode & CK_HT_MODE_INCREMENTAL) == 0 || map->next != NULL)
+		return ck_ht_grow_spmc(table, capacity);
+
+	update = ck_ht_map_create(table, capacity);
+	if (update == NULL)
+		return false;
+
+	ck_ht_counter_grow(table, map->n_entries);
 	ck_pr_fence_store();
-	ck_pr_store_ptr(&table->map, update);
-	ck_ht_map_destroy(table->m, map, true);
+	ck_pr_store_ptr(&map->next, update);
 	return true;
 }
 
-bool
-ck_ht_remove_spmc(ck_ht_t *table,
-    ck_ht_hash_t h,
-    ck_ht_entry_t *entry)
+/*
+ * Returns the map that write operations must target. If a migration is
+ * in progress, then a bounded number of slots is migrated and the map
+ * being migrated from is returned through previous.
+ */
+static struct ck_ht_map *
+ck_ht_map_writer(struct ck_ht *table, struct ck_ht_map **previous)
 {
-	struct ck_ht_map *map;
-	struct ck_ht_entry *candidate, *priority, snapshot;
-	uint64_t probes, probes_wr;
+	struct ck_ht_map *map = table->map;
+
+	*previous = NULL;
+	if (map->next == NULL)
+		return map;
+
+	ck_ht_migrate(table, map, CK_HT_MIGRATE_DEFAULT);
 
 	map = table->map;
+	if (map->next == NULL)
+		return map;
+
+	*previous = map;
+	return map->next;
+}
+
+/*
+ * Returns the slot of a map that holds the key of entry, or NULL if there
+ * is none. The contents of the slot are copied into snapshot.
+ */
+static struct ck_ht_entry *
+ck_ht_map_find(struct ck_ht *table,
+    struct ck_ht_map *map,
+    ck_ht_hash_t h,
+    ck_ht_entry_t *entry,
+    ck_ht_entry_t *snapshot)
+{
+	struct ck_ht_entry *candidate, *priority;
+	uint64_t probes, probes_wr;
 
-	if (table->mode == CK_HT_MODE_BYTESTRING) {
-		candidate = ck_ht_map_probe_wr(map, h, &snapshot, &priority,
+	if (table->mode & CK_HT_MODE_BYTESTRING) {
+		candidate = ck_ht_map_probe_wr(map, h, snapshot, &priority,
 				ck_ht_entry_key(entry),
 				ck_ht_entry_key_length(entry),
 				&probes, &probes_wr);
 	} else {
-		candidate = ck_ht_map_probe_wr(map, h, &snapshot, &priority,
+		candidate = ck_ht_map_probe_wr(map, h, snapshot, &priority,
 				(void *)entry->key,
 				sizeof(entry->key),
 				&probes, &probes_wr);
 	}
 
+	if (candidate == NULL || snapshot->key == CK_HT_KEY_EMPTY)
+		return NULL;
+
+	return candidate;
+}
+
+bool
+ck_ht_remove_spmc(ck_ht_t *table,
+    ck_ht_hash_t h,
+    ck_ht_entry_t *entry)
+{
+	struct ck_ht_map *map, *old;
+	struct ck_ht_entry *candidate = NULL, snapshot;
+	uint64_t *version;
+
+	map = ck_ht_map_writer(table, &old);
+
+	/* The key may have yet to be migrated. */
+	if (old != NULL) {
+		candidate = ck_ht_map_find(table, old, h, entry, &snapshot);
+		if (candidate != NULL)
+			map = old;
+	}
+
+	if (candidate == NULL)
+		candidate = ck_ht_map_find(table, map, h, entry, &snapshot);
+
 	/* No matching entry was found. */
-	if (candidate == NULL || snapshot.key == CK_HT_KEY_EMPTY)
+	if (candidate == NULL)
 		return false;
 
 	*entry = snapshot;
 	ck_pr_store_ptr(&candidate->key, (void *)CK_HT_KEY_TOMBSTONE);
+	ck_ht_map_vacate(map, candidate);
 
 	/*
 	 * It is possible that the key is read before transition into
@@ -605,7 +1472,7 @@ ck_ht_remove_spmc(ck_ht_t *table,
 	 * the reader acquires some value V' instead of V. Let us assume
 	 * however that any transition from V into V' (essentially, update
 	 * of a value without the reader knowing of a K -> K' transition),
-	 * is preceded by an update to the deletions counter. This guarantees
+	 * is preceded by an update to the version counter of K. This guarantees
 	 * any replacement of a T key also implies a D -> D' transition.
 	 * If D has not transitioned, the value has yet to be replaced so it
 	 * is a valid association with K and is safe to return. If D has
@@ -613,11 +1480,22 @@ ck_ht_remove_spmc(ck_ht_t *table,
 	 * possible that we are in the invalid state of (K, V'). The reader
 	 * is then able to attempt a reprobe at which point the only visible
 	 * states should be (T, V') or (K', V'). The latter is guaranteed
-	 * through memory fencing.
+	 * through memory fencing. Only readers of keys that share the
+	 * version counter of K observe the transition; the deletions
+	 * counter serves iterators.
 	 */
+	version = ck_ht_map_version(map, h);
+	ck_pr_store_64(version, *version + 1);
 	ck_pr_store_64(&map->deletions, map->deletions + 1);
 	ck_pr_fence_store();
 	ck_pr_store_64(&map->n_entries, map->n_entries - 1);
+	ck_pr_store_64(&map->tombstones, map->tombstones + 1);
+
+	/* Copies of long keys are reclaimed once readers are done. */
+	if ((map->mode & CK_HT_MODE_INLINE) &&
+	    ck_ht_entry_key_length(entry) > CK_HT_KEY_INLINE)
+		table->m->free(ck_ht_entry_key(entry), ck_ht_entry_key_length(entry), true);
+
 	return true;
 }
 
@@ -628,37 +1506,53 @@ ck_ht_get_spmc(ck_ht_t *table,
 {
 	struct ck_ht_entry *candidate, snapshot;
 	struct ck_ht_map *map;
-	uint64_t d, d_prime;
+	uint64_t *version, d, d_prime;
 
 restart:
 	map = ck_pr_load_ptr(&table->map);
 
+next:
+	version = ck_ht_map_version(map, h);
+
 	/*
 	 * Platforms that cannot read key and key_length atomically must reprobe
 	 * on the scan of any single entry.
 	 */
-	d = ck_pr_load_64(&map->deletions);
+	d = ck_pr_load_64(version);
 
-	if (table->mode == CK_HT_MODE_BYTESTRING) {
-		candidate = ck_ht_map_probe_rd(map, h, &snapshot,
+	if (table->mode & CK_HT_MODE_BYTESTRING) {
+		candidate = ck_ht_map_probe_rd(table, map, h, &snapshot,
 		    ck_ht_entry_key(entry), ck_ht_entry_key_length(entry));
 	} else {
-		candidate = ck_ht_map_probe_rd(map, h, &snapshot,
+		candidate = ck_ht_map_probe_rd(table, map, h, &snapshot,
 		    (void *)entry->key, sizeof(entry->key));
 	}
 
-	d_prime = ck_pr_load_64(&map->deletions);
+	d_prime = ck_pr_load_64(version);
 	if (d != d_prime) {
 		/*
 		 * It is possible we have read (K, V'). Only valid states are
 		 * (K, V), (K', V') and (T, V). Restart load operation in face
-		 * of concurrent deletions or replacements.
+		 * of concurrent deletions or replacements of K.
 		 */
+		ck_ht_counter_retry(table);
 		goto restart;
 	}
 
-	if (candidate == NULL || snapshot.key == CK_HT_KEY_EMPTY)
+	if (candidate == NULL || snapshot.key == CK_HT_KEY_EMPTY) {
+		/*
+		 * Entries are published into the next map before they are
+		 * removed from the current map, so a miss in the current map
+		 * followed by a probe of the next map will observe any entry
+		 * being migrated.
+		 */
+		ck_pr_fence_load();
+		map = ck_pr_load_ptr(&map->next);
+		if (map != NULL)
+			goto next;
+
 		return false;
+	}
 
 	*entry = snapshot;
 	return true;
@@ -669,15 +1563,16 @@ ck_ht_set_spmc(ck_ht_t *table,
     ck_ht_hash_t h,
     ck_ht_entry_t *entry)
 {
-	struct ck_ht_entry snapshot, *candidate, *priority;
-	struct ck_ht_map *map;
+	struct ck_ht_entry snapshot, previous, owned, *candidate, *priority;
+	struct ck_ht_entry *migrate = NULL, *insert = entry;
+	struct ck_ht_map *map, *old;
 	uint64_t probes, probes_wr;
 	bool empty = false;
 
 	for (;;) {
-		map = table->map;
+		map = ck_ht_map_writer(table, &old);
 
-		if (table->mode == CK_HT_MODE_BYTESTRING) {
+		if (table->mode & CK_HT_MODE_BYTESTRING) {
 			candidate = ck_ht_map_probe_wr(map, h, &snapshot, &priority,
 					ck_ht_entry_key(entry),
 					ck_ht_entry_key_length(entry),
@@ -701,14 +1596,42 @@ ck_ht_set_spmc(ck_ht_t *table,
 			return false;
 	}
 
-	if (probes > map->probe_maximum)
-		ck_pr_store_64(&map->probe_maximum, probes);
+	/*
+	 * The key may have yet to be migrated. If so, it is inserted into
+	 * the next map and the stale slot is removed from the previous map
+	 * afterwards.
+	 */
+	if (old != NULL && (candidate == NULL || snapshot.key == CK_HT_KEY_EMPTY))
+		migrate = ck_ht_map_find(table, old, h, entry, &previous);
 
 	if (candidate == NULL) {
 		candidate = priority;
 		empty = true;
 	}
 
+	if (table->mode & CK_HT_MODE_INLINE) {
+		void *key = NULL;
+
+		/* The storage of an existing key moves along with it. */
+		if (migrate != NULL) {
+			key = ck_ht_entry_key(&previous);
+		} else if (empty == false && snapshot.key != CK_HT_KEY_EMPTY) {
+			key = ck_ht_entry_key(&snapshot);
+		}
+
+		if (ck_ht_map_key_own(table, map,
+		    priority != NULL ? priority : candidate,
+		    entry, key, &owned) == false)
+			return false;
+
+		insert = &owned;
+	}
+
+	if (probes > map->probe_maximum)
+		ck_pr_store_64(&map->probe_maximum, probes);
+
+	ck_ht_counter_probe(table, probes);
+
 	if (candidate->key != CK_HT_KEY_EMPTY &&
 	    priority != NULL && candidate != priority) {
 		/*
@@ -720,17 +1643,22 @@ ck_ht_set_spmc(ck_ht_t *table,
 		 * before transitioning from K to T. (K, B) implies (K, B, D')
 		 * so we will reprobe successfully from this transient state.
 		 */
+		uint64_t *version = ck_ht_map_version(map, h);
+
 #ifndef CK_HT_PP
-		ck_pr_store_64(&priority->key_length, entry->key_length);
-		ck_pr_store_64(&priority->hash, entry->hash);
+		ck_pr_store_64(&priority->key_length, insert->key_length);
+		ck_pr_store_64(&priority->hash, insert->hash);
 #endif
-		ck_pr_store_ptr(&priority->value, (void *)entry->value);
+		ck_pr_store_ptr(&priority->value, (void *)insert->value);
+		ck_ht_map_occupy(map, priority);
 		ck_pr_fence_store();
-		ck_pr_store_ptr(&priority->key, (void *)entry->key);
+		ck_pr_store_ptr(&priority->key, (void *)insert->key);
 		ck_pr_fence_store();
+		ck_pr_store_64(version, *version + 1);
 		ck_pr_store_64(&map->deletions, map->deletions + 1);
 		ck_pr_fence_store();
 		ck_pr_store_ptr(&candidate->key, (void *)CK_HT_KEY_TOMBSTONE);
+		ck_ht_map_vacate(map, candidate);
 	} else {
 		/*
 		 * In this case we are inserting a new entry or replacing
@@ -742,19 +1670,23 @@ ck_ht_set_spmc(ck_ht_t *table,
 		bool replace = candidate->key != CK_HT_KEY_EMPTY &&
 		    candidate->key != CK_HT_KEY_TOMBSTONE;
 
-		if (priority != NULL)
+		if (priority != NULL) {
 			candidate = priority;
+			ck_pr_store_64(&map->tombstones, map->tombstones - 1);
+		}
+
+		ck_ht_map_occupy(map, candidate);
 
 #ifdef CK_HT_PP
-		ck_pr_store_ptr(&candidate->value, (void *)entry->value);
+		ck_pr_store_ptr(&candidate->value, (void *)insert->value);
 		ck_pr_fence_store();
-		ck_pr_store_ptr(&candidate->key, (void *)entry->key);
+		ck_pr_store_ptr(&candidate->key, (void *)insert->key);
 #else
-		ck_pr_store_64(&candidate->key_length, entry->key_length);
-		ck_pr_store_64(&candidate->hash, entry->hash);
-		ck_pr_store_ptr(&candidate->value, (void *)entry->value);
+		ck_pr_store_64(&candidate->key_length, insert->key_length);
+		ck_pr_store_64(&candidate->hash, insert->hash);
+		ck_pr_store_ptr(&candidate->value, (void *)insert->value);
 		ck_pr_fence_store();
-		ck_pr_store_ptr(&candidate->key, (void *)entry->key);
+		ck_pr_store_ptr(&candidate->key, (void *)insert->key);
 #endif
 
 		/*
@@ -765,11 +1697,27 @@ ck_ht_set_spmc(ck_ht_t *table,
 			ck_pr_store_64(&map->n_entries, map->n_entries + 1);
 	}
 
+	if (migrate != NULL) {
+		/*
+		 * Iterators that have yet to visit the stale slot may have
+		 * already visited the slot the key was inserted into.
+		 */
+		ck_pr_fence_store();
+		ck_pr_store_64(&old->deletions, old->deletions + 1);
+		ck_pr_fence_store();
+		ck_pr_store_ptr(&migrate->key, (void *)CK_HT_KEY_TOMBSTONE);
+		ck_ht_map_vacate(old, migrate);
+		ck_pr_store_64(&old->n_entries, old->n_entries - 1);
+		ck_pr_store_64(&old->tombstones, old->tombstones + 1);
+	}
+
 	/* Enforce a load factor of 0.5. */
-	if (map->n_entries * 2 > map->capacity)
-		ck_ht_grow_spmc(table, map->capacity << 1);
+	if ((map->n_entries + (old != NULL ? old->n_entries : 0)) * 2 > map->capacity)
+		ck_ht_grow_incremental(table, map->capacity << 1);
 
-	if (empty == true) {
+	if (migrate != NULL) {
+		*entry = previous;
+	} else if (empty == true) {
 		entry->key = CK_HT_KEY_EMPTY;
 	} else {
 		*entry = snapshot;
@@ -783,14 +1731,20 @@ ck_ht_put_spmc(ck_ht_t *table,
     ck_ht_hash_t h,
     ck_ht_entry_t *entry)
 {
-	struct ck_ht_entry snapshot, *candidate, *priority;
-	struct ck_ht_map *map;
+	struct ck_ht_entry snapshot, owned, *candidate, *priority;
+	struct ck_ht_entry *insert = entry;
+	struct ck_ht_map *map, *old;
 	uint64_t probes, probes_wr;
 
 	for (;;) {
-		map = table->map;
+		map = ck_ht_map_writer(table, &old);
+
+		/* Fail operation if the key has yet to be migrated. */
+		if (old != NULL &&
+		    ck_ht_map_find(table, old, h, entry, &snapshot) != NULL)
+			return false;
 
-		if (table->mode == CK_HT_MODE_BYTESTRING) {
+		if (table->mode & CK_HT_MODE_BYTESTRING) {
 			candidate = ck_ht_map_probe_wr(map, h, &snapshot, &priority,
 					ck_ht_entry_key(entry),
 					ck_ht_entry_key_length(entry),
@@ -809,40 +1763,54 @@ ck_ht_put_spmc(ck_ht_t *table,
 			return false;
 	}
 
+	/*
+	 * If the snapshot key is non-empty then an identical key was found,
+	 * possibly beyond a tombstone. As store does not implement
+	 * replacement, we will fail.
+	 */
+	if (candidate != NULL && snapshot.key != CK_HT_KEY_EMPTY)
+		return false;
+
 	if (priority != NULL) {
 		/* Re-use tombstone if one was found. */
 		candidate = priority;
 		probes = probes_wr;
-	} else if (candidate->key != CK_HT_KEY_EMPTY &&
-	    candidate->key != CK_HT_KEY_TOMBSTONE) {
-		/*
-		 * If the snapshot key is non-empty and the value field is not
-		 * a tombstone then an identical key was found. As store does
-		 * not implement replacement, we will fail.
-		 */
-		return false;
 	}
 
+	if (table->mode & CK_HT_MODE_INLINE) {
+		if (ck_ht_map_key_own(table, map, candidate, entry,
+		    NULL, &owned) == false)
+			return false;
+
+		insert = &owned;
+	}
+
+	if (priority != NULL)
+		ck_pr_store_64(&map->tombstones, map->tombstones - 1);
+
 	if (probes > map->probe_maximum)
 		ck_pr_store_64(&map->probe_maximum, probes);
 
+	ck_ht_counter_probe(table, probes);
+	ck_ht_map_occupy(map, candidate);
+
 #ifdef CK_HT_PP
-	ck_pr_store_ptr(&candidate->value, (void *)entry->value);
+	ck_pr_store_ptr(&candidate->value, (void *)insert->value);
 	ck_pr_fence_store();
-	ck_pr_store_ptr(&candidate->key, (void *)entry->key);
+	ck_pr_store_ptr(&candidate->key, (void *)insert->key);
 #else
-	ck_pr_store_64(&candidate->key_length, entry->key_length);
-	ck_pr_store_64(&candidate->hash, entry->hash);
-	ck_pr_store_ptr(&candidate->value, (void *)entry->value);
+	ck_pr_store_64(&candidate->key_length, insert->key_length);
+	ck_pr_store_64(&candidate->hash, insert->hash);
+	ck_pr_store_ptr(&candidate->value, (void *)insert->value);
 	ck_pr_fence_store();
-	ck_pr_store_ptr(&candidate->key, (void *)entry->key);
+	ck_pr_store_ptr(&candidate->key, (void *)insert->key);
 #endif
 
 	ck_pr_store_64(&map->n_entries, map->n_entries + 1);
 
 	/* Enforce a load factor of 0.5. */
-	if (map->n_entries * 2 > map->capacity)
-		ck_ht_grow_spmc(table, map->capacity << 1);
+	if ((map->n_entries + (old != NULL ? old->n_entries : 0)) * 2 > map->capacity)
+		ck_ht_grow_incremental(table, map->capacity << 1);
 
 	return true;
 }
@@ -851,8 +1819,235 @@ void
 ck_ht_destroy(struct ck_ht *table)
 {
 
+	if (table->map->next != NULL) {
+		ck_ht_map_key_release(table, table->map->next, false);
+		ck_ht_map_destroy(table->m, table->map->next, false);
+	}
+
+	ck_ht_map_key_release(table, table->map, false);
 	ck_ht_map_destroy(table->m, table->map, false);
+	if (table->counters != NULL)
+		ck_ht_counters_destroy(table->m, table->counters);
+
+	return;
+}
+
+bool
+ck_ht_sharded_init(struct ck_ht_sharded *table,
+    enum ck_ht_mode mode,
+    ck_ht_hash_cb_t *h,
+    struct ck_malloc *m,
+    uint64_t entries,
+    uint64_t seed,
+    unsigned int n_shards)
+{
+	struct ck_ht_shard *shards;
+	unsigned int i;
+	size_t size;
+	void *memory;
+
+	if (m == NULL || m->malloc == NULL || m->free == NULL)
+		return false;
+
+	/* Also rejects a shard count that cannot be rounded up. */
+	n_shards = ck_internal_power_2(n_shards);
+	if (n_shards == 0)
+		return false;
+
+	/*
+	 * The allocator only aligns memory if it has an aligned callback, so
+	 * the shards are aligned within a larger allocation.
+	 */
+	size = sizeof(struct ck_ht_shard) * n_shards + CK_MD_CACHELINE - 1;
+	memory = ck_malloc_hinted(m, size, CK_MD_CACHELINE, CK_MALLOC_HINT_SHARED);
+	if (memory == NULL)
+		return false;
+
+	shards = (struct ck_ht_shard *)(((uintptr_t)memory +
+	    CK_MD_CACHELINE - 1) & ~(uintptr_t)(CK_MD_CACHELINE - 1));
+
+	for (i = 0; i < n_shards; i++) {
+		ck_spinlock_init(&shards[i].lock);
+
+		/* Every shard shares the seed used to route keys. */
+		if (ck_ht_init(&shards[i].table, mode, h, m,
+		    (entries + n_shards - 1) / n_shards, seed) == false) {
+			while (i-- > 0)
+				ck_ht_destroy(&shards[i].table);
+
+			m->free(memory, size, false);
+			return false;
+		}
+	}
+
+	table->m = m;
+	table->shards = shards;
+	table->memory = memory;
+	table->n_shards = n_shards;
+	table->shift = 63 - ck_internal_log(n_shards);
+	return true;
+}
+
+void
+ck_ht_sharded_destroy(struct ck_ht_sharded *table)
+{
+	unsigned int i;
+
+	for (i = 0; i < table->n_shards; i++)
+		ck_ht_destroy(&table->shards[i].table);
+
+	table->m->free(table->memory,
+	    sizeof(struct ck_ht_shard) * table->n_shards + CK_MD_CACHELINE - 1,
+	    false);
+	return;
+}
+
+void
+ck_ht_sharded_hash(struct ck_ht_hash *h,
+    struct ck_ht_sharded *table,
+    const void *key,
+    uint16_t key_length)
+{
+
+	ck_ht_hash(h, &table->shards[0].table, key, key_length);
+	return;
+}
+
+void
+ck_ht_sharded_hash_direct(struct ck_ht_hash *h,
+    struct ck_ht_sharded *table,
+    uintptr_t key)
+{
+
+	ck_ht_hash_direct(h, &table->shards[0].table, key);
+	return;
+}
+
+bool
+ck_ht_sharded_get_mpmc(struct ck_ht_sharded *table,
+    ck_ht_hash_t h,
+    ck_ht_entry_t *entry)
+{
+
+	return ck_ht_get_spmc(&ck_ht_sharded_shard(table, h)->table, h, entry);
+}
+
+bool
+ck_ht_sharded_set_mpmc(struct ck_ht_sharded *table,
+    ck_ht_hash_t h,
+    ck_ht_entry_t *entry)
+{
+	struct ck_ht_shard *shard = ck_ht_sharded_shard(table, h);
+	bool r;
+
+	ck_spinlock_lock_eb(&shard->lock);
+	r = ck_ht_set_spmc(&shard->table, h, entry);
+	ck_spinlock_unlock(&shard->lock);
+	return r;
+}
+
+bool
+ck_ht_sharded_put_mpmc(struct ck_ht_sharded *table,
+    ck_ht_hash_t h,
+    ck_ht_entry_t *entry)
+{
+	struct ck_ht_shard *shard = ck_ht_sharded_shard(table, h);
+	bool r;
+
+	ck_spinlock_lock_eb(&shard->lock);
+	r = ck_ht_put_spmc(&shard->table, h, entry);
+	ck_spinlock_unlock(&shard->lock);
+	return r;
+}
+
+bool
+ck_ht_sharded_remove_mpmc(struct ck_ht_sharded *table,
+    ck_ht_hash_t h,
+    ck_ht_entry_t *entry)
+{
+	struct ck_ht_shard *shard = ck_ht_sharded_shard(table, h);
+	bool r;
+
+	ck_spinlock_lock_eb(&shard->lock);
+	r = ck_ht_remove_spmc(&shard->table, h, entry);
+	ck_spinlock_unlock(&shard->lock);
+	return r;
+}
+
+bool
+ck_ht_sharded_reset_mpmc(struct ck_ht_sharded *table)
+{
+	struct ck_ht_shard *shard;
+	unsigned int i;
+	bool r = true;
+
+	/* Shards are reset one at a time, so this is not atomic. */
+	for (i = 0; i < table->n_shards; i++) {
+		shard = &table->shards[i];
+		ck_spinlock_lock_eb(&shard->lock);
+		if (ck_ht_reset_spmc(&shard->table) == false)
+			r = false;
+		ck_spinlock_unlock(&shard->lock);
+	}
+
+	return r;
+}
+
+uint64_t
+ck_ht_sharded_count(struct ck_ht_sharded *table)
+{
+	uint64_t n_entries = 0;
+	unsigned int i;
+
+	for (i = 0; i < table->n_shards; i++)
+		n_entries += ck_ht_count(&table->shards[i].table);
+
+	return n_entries;
+}
+
+void
+ck_ht_sharded_stat(struct ck_ht_sharded *table,
+    struct ck_ht_stat *st)
+{
+	struct ck_ht_stat shard;
+	unsigned int i, j;
+
+	memset(st, 0, sizeof *st);
+	for (i = 0; i < table->n_shards; i++) {
+		ck_ht_stat(&table->shards[i].table, &shard);
+
+		if (shard.probe_maximum > st->probe_maximum)
+			st->probe_maximum = shard.probe_maximum;
+
+		st->n_entries += shard.n_entries;
+		st->tombstones += shard.tombstones;
+		for (j = 0; j < CK_HT_STAT_PROBES; j++)
+			st->probes[j] += shard.probes[j];
+
+		st->retries += shard.retries;
+		st->grows += shard.grows;
+		st->grow_entries += shard.grow_entries;
+	}
+
 	return;
 }
 
+bool
+ck_ht_sharded_next(struct ck_ht_sharded *table,
+    struct ck_ht_sharded_iterator *i,
+    struct ck_ht_entry *entry)
+{
+
+	while (i->shard < table->n_shards) {
+		if (ck_ht_next_spmc(&table->shards[i->shard].table,
+		    &i->iterator, entry) == true)
+			return true;
+
+		i->shard++;
+		ck_ht_iterator_init(&i->iterator);
+	}
+
+	return false;
+}
+
 #endif /* CK_F_HT */
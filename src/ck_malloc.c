@@ -0,0 +1,224 @@
+/*
+ * Copyright 2013 Samy Al Bahra.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <ck_cc.h>
+#include <ck_malloc.h>
+#include <ck_md.h>
+#include <ck_stdint.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/mman.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/*
+ * Allocations of at least a huge page are rounded up to and aligned to
+ * huge pages, so that they may be backed by them.
+ */
+#ifndef CK_MALLOC_HUGE_PAGE
+#define CK_MALLOC_HUGE_PAGE (2UL * 1024 * 1024)
+#endif
+
+/* Memory policy interface of Linux, which is not exposed by the C library. */
+#ifndef MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE 3
+#endif
+
+#ifndef MPOL_F_MEMS_ALLOWED
+#define MPOL_F_MEMS_ALLOWED (1 << 2)
+#endif
+
+#define CK_MALLOC_NODES 1024
+
+static size_t
+ck_malloc_mmap_length(size_t size)
+{
+
+	if (size >= CK_MALLOC_HUGE_PAGE)
+		return (size + CK_MALLOC_HUGE_PAGE - 1) & ~(size_t)(CK_MALLOC_HUGE_PAGE - 1);
+
+	return (size + CK_MD_PAGESIZE - 1) & ~(size_t)(CK_MD_PAGESIZE - 1);
+}
+
+static void *
+ck_malloc_mmap_region(size_t length, int flags)
+{
+	void *p;
+
+	p = mmap(NULL, length, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	return p;
+}
+
+void *
+ck_malloc_mmap_aligned(size_t size, size_t alignment)
+{
+	uintptr_t base, aligned;
+	size_t length;
+	void *p;
+
+	if (size == 0)
+		size = 1;
+
+	length = ck_malloc_mmap_length(size);
+	if (length >= CK_MALLOC_HUGE_PAGE && alignment < CK_MALLOC_HUGE_PAGE)
+		alignment = CK_MALLOC_HUGE_PAGE;
+
+#ifdef MAP_HUGETLB
+	/* Huge pages are only available if the system has reserved them. */
+	if (length >= CK_MALLOC_HUGE_PAGE) {
+		p = ck_malloc_mmap_region(length, MAP_HUGETLB);
+		if (p != NULL) {
+			if (((uintptr_t)p & (alignment - 1)) == 0)
+				return p;
+
+			munmap(p, length);
+		}
+	}
+#endif
+
+	if (alignment <= CK_MD_PAGESIZE)
+		return ck_malloc_mmap_region(length, 0);
+
+	/* Over-allocate and trim the mapping to the requested alignment. */
+	p = ck_malloc_mmap_region(length + alignment, 0);
+	if (p == NULL)
+		return NULL;
+
+	base = (uintptr_t)p;
+	aligned = (base + alignment - 1) & ~(uintptr_t)(alignment - 1);
+	if (aligned != base)
+		munmap(p, aligned - base);
+
+	if (aligned + length != base + length + alignment)
+		munmap((void *)(aligned + length), base + alignment - aligned);
+
+	return (void *)aligned;
+}
+
+void *
+ck_malloc_mmap(size_t size)
+{
+
+	return ck_malloc_mmap_aligned(size, 0);
+}
+
+#if defined(__linux__) && defined(SYS_mbind) && defined(SYS_get_mempolicy)
+/*
+ * Spreads the pages of a region across every node the process may
+ * allocate from. Systems with a single node are left unmodified.
+ */
+static void
+ck_malloc_mmap_interleave(void *p, size_t length)
+{
+	unsigned long nodes[CK_MALLOC_NODES / (sizeof(unsigned long) * CHAR_BIT)] = { 0 };
+	unsigned long word;
+	unsigned int i, n = 0;
+
+	if (syscall(SYS_get_mempolicy, NULL, nodes, (unsigned long)CK_MALLOC_NODES,
+	    NULL, MPOL_F_MEMS_ALLOWED) != 0)
+		return;
+
+	for (i = 0; i < sizeof(nodes) / sizeof(*nodes); i++) {
+		for (word = nodes[i]; word != 0; word &= word - 1)
+			n++;
+	}
+
+	if (n > 1) {
+		syscall(SYS_mbind, p, length, MPOL_INTERLEAVE, nodes,
+		    (unsigned long)CK_MALLOC_NODES, 0U);
+	}
+
+	return;
+}
+#endif
+
+void
+ck_malloc_mmap_hint(void *p, size_t size, unsigned int hints)
+{
+	size_t length = ck_malloc_mmap_length(size);
+
+	/* Failures are ignored, as hints are advisory. */
+#ifdef MADV_HUGEPAGE
+	if ((hints & CK_MALLOC_HINT_RANDOM) && length >= CK_MALLOC_HUGE_PAGE)
+		madvise(p, length, MADV_HUGEPAGE);
+#endif
+
+#if defined(__linux__) && defined(SYS_mbind) && defined(SYS_get_mempolicy)
+	if (hints & CK_MALLOC_HINT_SHARED)
+		ck_malloc_mmap_interleave(p, length);
+#endif
+
+	(void)p;
+	(void)length;
+	(void)hints;
+	return;
+}
+
+void
+ck_malloc_mmap_free(void *p, size_t size)
+{
+
+	if (p != NULL)
+		munmap(p, ck_malloc_mmap_length(size));
+
+	return;
+}
+
+/*
+ * Data structures request deferred releases of memory that concurrent
+ * readers may still access, which an unmapped region would fault on. The
+ * free callback is the only place where such releases can be deferred,
+ * so it is required.
+ */
+bool
+ck_malloc_mmap_init(struct ck_malloc *m, void (*free_cb)(void *, size_t, bool))
+{
+
+	if (free_cb == NULL)
+		return false;
+
+	m->malloc = ck_malloc_mmap;
+	m->free = free_cb;
+	m->aligned = ck_malloc_mmap_aligned;
+	m->hint = ck_malloc_mmap_hint;
+	return true;
+}